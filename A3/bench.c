@@ -0,0 +1,566 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+
+#include "freq_list.h"
+#include "worker.h"
+
+/* A load generator for the query engine.
+ *
+ * Builds a synthetic corpus of directories filled with Zipf-distributed
+ * words, runs indexer on every directory, then replays a Zipf-distributed
+ * stream of query words through query, and reports the throughput and
+ * latency as key=value lines on standard output.
+ *
+ * By default, queries are sent one at a time. With -c, up to that many
+ * are kept in flight at once, pipelined on query's input. With -r,
+ * queries are instead sent at a fixed rate whether or not the earlier
+ * ones have been answered, and a query's latency runs from when it was
+ * due to be sent, so that time spent queued behind a backlog counts.
+ *
+ * The indexer and query programs are expected to be in the current
+ * directory unless -b is given.
+ */
+
+#define WORDS_PER_LINE 12
+
+/**
+ * Per-directory answer times reported by query.
+ */
+typedef struct
+{
+    char path[PATHLENGTH];
+    long long *samples;
+    int nsamples;
+} DirTimings;
+
+/**
+ * The stream of queries replayed through query, shared between the
+ * thread sending them and the main thread reading their answers, which
+ * arrive in the order the queries were sent.
+ */
+typedef struct
+{
+    FILE *in;
+    char (*words)[16];
+    int nqueries;
+
+    // the most queries left unanswered at once, or, if rate is positive,
+    // the number of queries sent every second regardless of answers.
+    int concurrency;
+    double rate;
+    long long start;
+
+    // when each query was sent, or for a rate, when it was due to be.
+    // Guarded by the lock, which answered is signalled with.
+    long long *sent;
+    int nanswered;
+    pthread_mutex_t lock;
+    pthread_cond_t answered;
+} QueryStream;
+
+/**
+ * A xorshift generator, so that a run is reproducible from its seed
+ * regardless of the platform's rand().
+ */
+unsigned long long rng_state = 88172645463325252ULL;
+
+double rng_uniform()
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return (rng_state >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/**
+ * Builds the cumulative distribution of a Zipf distribution with
+ * exponent s over n ranks.
+ */
+double *zipf_cdf(int n, double s)
+{
+    double *cdf = panic_malloc(sizeof(double) * n);
+    double total = 0;
+    for (int i = 0; i < n; i++)
+    {
+        total += 1.0 / pow(i + 1, s);
+        cdf[i] = total;
+    }
+    for (int i = 0; i < n; i++)
+    {
+        cdf[i] /= total;
+    }
+    return cdf;
+}
+
+/**
+ * Samples a rank from the cumulative distribution by binary search.
+ */
+int zipf_sample(const double *cdf, int n)
+{
+    double u = rng_uniform();
+    int lo = 0;
+    int hi = n - 1;
+    while (lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+        if (cdf[mid] < u)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/**
+ * Writes the word of the given rank. Words are made only of letters and
+ * are long enough to be kept by the indexer.
+ */
+void rank_word(int rank, char *word)
+{
+    word[0] = 'w';
+    for (int i = 5; i >= 1; i--)
+    {
+        word[i] = 'a' + rank % 26;
+        rank /= 26;
+    }
+    word[6] = '\0';
+}
+
+int compare_ll(const void *a, const void *b)
+{
+    long long x = *(const long long *)a;
+    long long y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Returns the p-th percentile of the sorted samples.
+ */
+long long percentile(const long long *sorted, int n, double p)
+{
+    if (n == 0)
+    {
+        return 0;
+    }
+    int i = (int)ceil(p / 100.0 * n) - 1;
+    if (i < 0)
+    {
+        i = 0;
+    }
+    return sorted[i < n ? i : n - 1];
+}
+
+/**
+ * Runs the program with the given arguments to completion, discarding
+ * its standard output. Exits if it does not succeed.
+ */
+void run_program(char *const argv[])
+{
+    int pid = fork();
+    if (pid == -1)
+    {
+        perror("fork");
+        exit(1);
+    }
+    if (pid == 0)
+    {
+        int devnull = open("/dev/null", O_WRONLY);
+        dup2(devnull, STDOUT_FILENO);
+        execv(argv[0], argv);
+        perror(argv[0]);
+        exit(1);
+    }
+
+    int status;
+    if (waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    {
+        fprintf(stderr, "bench: %s failed\n", argv[0]);
+        exit(1);
+    }
+}
+
+/**
+ * Creates the corpus under root, and indexes every directory.
+ */
+void build_corpus(const char *root, const char *bindir, int ndirs, int nfiles,
+                  int nwords, const double *cdf, int vocab)
+{
+    char dir[PATHLENGTH];
+    char file[PATHLENGTH + 16];
+    char word[16];
+
+    for (int d = 0; d < ndirs; d++)
+    {
+        snprintf(dir, PATHLENGTH, "%s/d%d", root, d);
+        if (mkdir(dir, 0755) == -1)
+        {
+            perror(dir);
+            exit(1);
+        }
+
+        for (int f = 0; f < nfiles; f++)
+        {
+            snprintf(file, sizeof(file), "%s/f%d", dir, f);
+            FILE *fp;
+            if ((fp = fopen(file, "w")) == NULL)
+            {
+                perror(file);
+                exit(1);
+            }
+            for (int w = 0; w < nwords; w++)
+            {
+                rank_word(zipf_sample(cdf, vocab), word);
+                fprintf(fp, "%s%c", word, (w + 1) % WORDS_PER_LINE == 0 ? '\n' : ' ');
+            }
+            fprintf(fp, "\n");
+            fclose(fp);
+        }
+
+        char indexer[PATHLENGTH];
+        char listfile[PATHLENGTH + 16];
+        char namefile[PATHLENGTH + 16];
+        snprintf(indexer, PATHLENGTH, "%s/indexer", bindir);
+        snprintf(listfile, sizeof(listfile), "%s/index", dir);
+        snprintf(namefile, sizeof(namefile), "%s/filenames", dir);
+        char *argv[] = {indexer, "-d", dir, "-i", listfile, "-n", namefile, NULL};
+        run_program(argv);
+    }
+}
+
+/**
+ * Starts query on the corpus with end markers enabled, returning its pid,
+ * and connecting its standard input and output to the given streams.
+ */
+int start_query(const char *root, const char *bindir, const char *deadline, FILE **in, FILE **out)
+{
+    int to_query[2];
+    int from_query[2];
+    if (pipe(to_query) == -1 || pipe(from_query) == -1)
+    {
+        perror("pipe");
+        exit(1);
+    }
+
+    int pid = fork();
+    if (pid == -1)
+    {
+        perror("fork");
+        exit(1);
+    }
+    if (pid == 0)
+    {
+        char query[PATHLENGTH];
+        snprintf(query, PATHLENGTH, "%s/query", bindir);
+        dup2(to_query[0], STDIN_FILENO);
+        dup2(from_query[1], STDOUT_FILENO);
+        close(to_query[0]);
+        close(to_query[1]);
+        close(from_query[0]);
+        close(from_query[1]);
+        if (deadline != NULL)
+        {
+            execl(query, query, "-d", root, "-e", "-t", deadline, (char *)NULL);
+        }
+        else
+        {
+            execl(query, query, "-d", root, "-e", (char *)NULL);
+        }
+        perror(query);
+        exit(1);
+    }
+
+    close(to_query[0]);
+    close(from_query[1]);
+    *in = fdopen(to_query[1], "w");
+    *out = fdopen(from_query[0], "r");
+    return pid;
+}
+
+/**
+ * Records a per-directory answer time reported by query.
+ */
+void record_dir_timing(DirTimings **dirs, int *ndirs, int nqueries, const char *path, long long us)
+{
+    int i;
+    for (i = 0; i < *ndirs; i++)
+    {
+        if (strcmp((*dirs)[i].path, path) == 0)
+        {
+            break;
+        }
+    }
+    if (i == *ndirs)
+    {
+        *dirs = panic_realloc(*dirs, sizeof(DirTimings) * (*ndirs + 1));
+        strncpy((*dirs)[i].path, path, PATHLENGTH - 1);
+        (*dirs)[i].path[PATHLENGTH - 1] = '\0';
+        (*dirs)[i].samples = panic_malloc(sizeof(long long) * nqueries);
+        (*dirs)[i].nsamples = 0;
+        (*ndirs)++;
+    }
+    if ((*dirs)[i].nsamples < nqueries)
+    {
+        (*dirs)[i].samples[(*dirs)[i].nsamples++] = us;
+    }
+}
+
+/**
+ * Body of the thread sending every query of the stream, each once it is
+ * due or once few enough queries are in flight.
+ */
+void *send_queries(void *arg)
+{
+    QueryStream *qs = arg;
+    for (int q = 0; q < qs->nqueries; q++)
+    {
+        long long due = 0;
+        if (qs->rate > 0)
+        {
+            due = qs->start + (long long)(q * 1000000.0 / qs->rate);
+            long long now = monotonic_us();
+            if (due > now)
+            {
+                usleep(due - now);
+            }
+        }
+
+        pthread_mutex_lock(&qs->lock);
+        while (qs->rate <= 0 && q - qs->nanswered >= qs->concurrency)
+        {
+            pthread_cond_wait(&qs->answered, &qs->lock);
+        }
+        qs->sent[q] = qs->rate > 0 ? due : monotonic_us();
+        pthread_mutex_unlock(&qs->lock);
+
+        fprintf(qs->in, "%s\n", qs->words[q]);
+        fflush(qs->in);
+    }
+    return NULL;
+}
+
+void print_latencies(const char *prefix, long long *samples, int n)
+{
+    qsort(samples, n, sizeof(long long), compare_ll);
+    printf("%s.samples=%d\n", prefix, n);
+    printf("%s.p50_us=%lld\n", prefix, percentile(samples, n, 50));
+    printf("%s.p99_us=%lld\n", prefix, percentile(samples, n, 99));
+    printf("%s.p999_us=%lld\n", prefix, percentile(samples, n, 99.9));
+    printf("%s.max_us=%lld\n", prefix, n > 0 ? samples[n - 1] : 0);
+}
+
+int main(int argc, char **argv)
+{
+    char ch;
+    int ndirs = 4;
+    int nfiles = 8;
+    int nwords = 2000;
+    int vocab = 5000;
+    int nqueries = 1000;
+    double exponent = 1.0;
+    char *bindir = ".";
+    char *deadline = NULL;
+    int keep = 0;
+    int concurrency = 1;
+    double rate = 0;
+
+    while ((ch = getopt(argc, argv, "D:F:W:V:Q:s:S:b:t:kc:r:")) != -1)
+    {
+        switch (ch)
+        {
+        case 'D':
+            ndirs = atoi(optarg);
+            break;
+        case 'F':
+            nfiles = atoi(optarg);
+            break;
+        case 'W':
+            nwords = atoi(optarg);
+            break;
+        case 'V':
+            vocab = atoi(optarg);
+            break;
+        case 'Q':
+            nqueries = atoi(optarg);
+            break;
+        case 's':
+            exponent = atof(optarg);
+            break;
+        case 'S':
+            rng_state = strtoull(optarg, NULL, 10) | 1;
+            break;
+        case 'b':
+            bindir = optarg;
+            break;
+        case 't':
+            deadline = optarg;
+            break;
+        case 'k':
+            keep = 1;
+            break;
+        case 'c':
+            concurrency = atoi(optarg);
+            break;
+        case 'r':
+            rate = atof(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: bench [-D DIRS] [-F FILES_PER_DIR] [-W WORDS_PER_FILE] [-V VOCABULARY]\n"
+                            "             [-Q QUERIES] [-s ZIPF_EXPONENT] [-S SEED] [-b BINDIR]\n"
+                            "             [-t DEADLINE_MS] [-k] [-c CONCURRENCY | -r QUERIES_PER_SECOND]\n");
+            exit(1);
+        }
+    }
+
+    if (ndirs <= 0 || nfiles <= 0 || nfiles >= MAXFILES || nwords <= 0 || vocab <= 0 || nqueries <= 0 ||
+        concurrency <= 0 || rate < 0)
+    {
+        fprintf(stderr, "bench: sizes must be positive, with fewer than %d files per directory\n", MAXFILES);
+        exit(1);
+    }
+
+    char root[] = "/tmp/a3bench.XXXXXX";
+    if (mkdtemp(root) == NULL)
+    {
+        perror("mkdtemp");
+        exit(1);
+    }
+
+    double *cdf = zipf_cdf(vocab, exponent);
+
+    long long start = monotonic_us();
+    build_corpus(root, bindir, ndirs, nfiles, nwords, cdf, vocab);
+    long long index_us = monotonic_us() - start;
+
+    FILE *in;
+    FILE *out;
+    int pid = start_query(root, bindir, deadline, &in, &out);
+
+    long long *latencies = panic_malloc(sizeof(long long) * nqueries);
+    DirTimings *dirs = NULL;
+    int ndirtimings = 0;
+    int partial = 0;
+    int cached = 0;
+    long long results = 0;
+    char line[MAXLINE];
+    char path[PATHLENGTH];
+    long long us;
+
+    // the words are drawn up front, so that a run replays the same
+    // stream whatever the load.
+    QueryStream qs = {.in = in, .nqueries = nqueries, .concurrency = concurrency, .rate = rate};
+    qs.words = panic_malloc(sizeof(*qs.words) * nqueries);
+    for (int q = 0; q < nqueries; q++)
+    {
+        rank_word(zipf_sample(cdf, vocab), qs.words[q]);
+    }
+    qs.sent = panic_malloc(sizeof(long long) * nqueries);
+    pthread_mutex_init(&qs.lock, NULL);
+    pthread_cond_init(&qs.answered, NULL);
+
+    start = monotonic_us();
+    qs.start = start;
+    pthread_t sender;
+    if ((errno = pthread_create(&sender, NULL, send_queries, &qs)) != 0)
+    {
+        perror("bench: pthread_create");
+        exit(1);
+    }
+
+    for (int q = 0; q < nqueries; q++)
+    {
+        int done = 0;
+        while (!done && fgets(line, MAXLINE, out) != NULL)
+        {
+            if (sscanf(line, "# worker %127s %lld", path, &us) == 2)
+            {
+                record_dir_timing(&dirs, &ndirtimings, nqueries, path, us);
+            }
+            else if (strncmp(line, "# cached", 8) == 0)
+            {
+                cached++;
+            }
+            else if (strncmp(line, "# end", 5) == 0)
+            {
+                done = 1;
+            }
+            else if (strncmp(line, "partial:", 8) == 0)
+            {
+                partial++;
+            }
+            else if (line[0] >= '0' && line[0] <= '9')
+            {
+                results++;
+            }
+        }
+        if (!done)
+        {
+            fprintf(stderr, "bench: query exited early\n");
+            exit(1);
+        }
+
+        pthread_mutex_lock(&qs.lock);
+        latencies[q] = monotonic_us() - qs.sent[q];
+        qs.nanswered++;
+        pthread_cond_signal(&qs.answered);
+        pthread_mutex_unlock(&qs.lock);
+    }
+    long long total_us = monotonic_us() - start;
+
+    pthread_join(sender, NULL);
+    fclose(in);
+    fclose(out);
+    waitpid(pid, NULL, 0);
+
+    printf("corpus.dirs=%d\n", ndirs);
+    printf("corpus.files=%d\n", ndirs * nfiles);
+    printf("corpus.words=%lld\n", (long long)ndirs * nfiles * nwords);
+    printf("corpus.vocabulary=%d\n", vocab);
+    printf("index.total_us=%lld\n", index_us);
+    printf("queries=%d\n", nqueries);
+    if (rate > 0)
+    {
+        printf("queries.target_qps=%.1f\n", rate);
+    }
+    else
+    {
+        printf("queries.concurrency=%d\n", concurrency);
+    }
+    printf("queries.partial=%d\n", partial);
+    printf("queries.cached=%d\n", cached);
+    printf("queries.records=%lld\n", results);
+    printf("queries.total_us=%lld\n", total_us);
+    printf("queries.qps=%.1f\n", total_us > 0 ? nqueries * 1000000.0 / total_us : 0.0);
+    print_latencies("latency", latencies, nqueries);
+    for (int i = 0; i < ndirtimings; i++)
+    {
+        char prefix[PATHLENGTH + 16];
+        // report directories relative to the corpus root.
+        const char *name = strrchr(dirs[i].path, '/');
+        snprintf(prefix, sizeof(prefix), "worker.%s", name != NULL ? name + 1 : dirs[i].path);
+        print_latencies(prefix, dirs[i].samples, dirs[i].nsamples);
+    }
+
+    if (keep)
+    {
+        fprintf(stderr, "bench: corpus kept in %s\n", root);
+    }
+    else
+    {
+        char *argv[] = {"/bin/rm", "-rf", root, NULL};
+        run_program(argv);
+    }
+    return 0;
+}
@@ -0,0 +1,79 @@
+#!/bin/sh
+# Tests of queryone and query, run by make check from this directory.
+#
+# Every test builds and indexes its own small corpus in a temporary
+# directory, so that nothing under simpletest or testcases is touched.
+# Each test is reported on its own line; the exit status is the number
+# of tests that failed.
+
+tmp=$(mktemp -d /tmp/a3check.XXXXXX) || exit 1
+node=
+trap '[ -n "$node" ] && kill $node 2>/dev/null; rm -rf "$tmp"' EXIT
+
+failed=0
+
+# report STATUS NAME: prints whether the test NAME passed.
+report() {
+    if [ "$1" -eq 0 ]; then
+        echo "ok   $2"
+    else
+        echo "FAIL $2"
+        failed=$((failed + 1))
+    fi
+}
+
+# corpus DIR NFILES WORD: creates DIR holding NFILES files, the i-th of
+# which holds WORD i times, and indexes it.
+corpus() {
+    mkdir -p "$1"
+    i=1
+    while [ "$i" -le "$2" ]; do
+        yes "$3" | head -n "$i" > "$1/f$i"
+        i=$((i + 1))
+    done
+    ./indexer -d "$1" -i "$1/index" -n "$1/filenames" > /dev/null
+}
+
+corpus "$tmp/small/d1" 3 apple
+corpus "$tmp/small/d2" 2 apple
+corpus "$tmp/wide/a" 40 waaaaa
+corpus "$tmp/wide/b" 40 waaaaa
+
+# queryone reads plain lines and frames them for the workers itself.
+# Its output is the raw records of every directory, each answer ending
+# with an empty sentinel record: for two queries, 3 records and a
+# sentinel from d1, and 2 records and a sentinel from d2.
+printf 'apple\n\napple\n' | ./queryone -d "$tmp/small" > "$tmp/queryone.out"
+# A record is a 4-byte freq and a PATHLENGTH (128) byte filename.
+[ "$(wc -c < "$tmp/queryone.out")" -eq $((14 * 132)) ] &&
+    [ "$(tr '\0' '\n' < "$tmp/queryone.out" | grep -c '/d1/f')" -eq 6 ] &&
+    [ "$(tr '\0' '\n' < "$tmp/queryone.out" | grep -c '/d2/f')" -eq 4 ]
+report $? queryone_frames_queries
+
+# a node answers with the records of every directory it serves, more
+# than fit in one directory's answer, and the coordinator keeps them all.
+port=$((20000 + $$ % 20000))
+./query -d "$tmp/wide" -l "$port" > /dev/null 2>&1 &
+node=$!
+sleep 0.5
+echo waaaaa | ./query -d "$tmp/wide" | sort > "$tmp/local.out"
+echo waaaaa | ./query -n "127.0.0.1:$port" 2> /dev/null | sort > "$tmp/remote.out"
+[ "$(wc -l < "$tmp/local.out")" -eq 80 ] && cmp -s "$tmp/local.out" "$tmp/remote.out"
+report $? remote_answer_not_truncated
+kill $node 2>/dev/null
+node=
+
+# a stopped worker misses the deadline of the queries asked while it is
+# stopped, without holding them up, and answers again once resumed.
+(for i in 1 2 3 4 5 6; do echo apple; sleep 0.4; done) |
+    ./query -d "$tmp/small" -t 100 > "$tmp/stall.out" 2>&1 &
+sleep 0.2
+worker=$(pgrep -P $! | head -n 1)
+kill -STOP "$worker"
+sleep 1.2
+kill -CONT "$worker"
+wait
+grep -q "missed deadline" "$tmp/stall.out" && [ "$(tail -n 5 "$tmp/stall.out" | grep -c '^[0-9]')" -eq 5 ]
+report $? stopped_worker_misses_deadline
+
+exit $failed
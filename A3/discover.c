@@ -0,0 +1,460 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "discover.h"
+
+#define CACHE_MAGIC "discover"
+
+/**
+ * A directory waiting to be scanned, and its depth below the root.
+ */
+typedef struct
+{
+    char *path;
+    int depth;
+} ScanItem;
+
+/**
+ * A scanned directory and its modification time, used to tell whether
+ * a cached result is still valid.
+ */
+typedef struct
+{
+    char *path;
+    struct timespec mtime;
+} DirStamp;
+
+/**
+ * State shared between the threads scanning a tree.
+ */
+typedef struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    // directories waiting to be scanned.
+    ScanItem *pending;
+    int npending;
+    int cappending;
+
+    // number of threads in the middle of scanning a directory.
+    int busy;
+
+    int maxdepth;
+
+    // index directories found so far.
+    DirList *found;
+    int capfound;
+
+    // every directory scanned so far.
+    DirStamp *scanned;
+    int nscanned;
+    int capscanned;
+} ScanState;
+
+/**
+ * A malloc that panics and quits on ENOMEM.
+ */
+static void *discover_malloc(size_t size)
+{
+    void *ptr;
+    if ((ptr = malloc(size)) == NULL)
+    {
+        perror("malloc");
+        exit(1);
+    }
+    return ptr;
+}
+
+/**
+ * Grows the array at *ptr, holding *cap elements of the given size,
+ * so that it can hold at least n elements.
+ */
+static void grow(void **ptr, int *cap, int n, size_t size)
+{
+    if (n <= *cap)
+    {
+        return;
+    }
+    *cap = *cap ? *cap * 2 : 64;
+    if ((*ptr = realloc(*ptr, *cap * size)) == NULL)
+    {
+        perror("realloc");
+        exit(1);
+    }
+}
+
+static char *join_path(const char *dir, const char *name)
+{
+    char *path = discover_malloc(strlen(dir) + strlen(name) + 2);
+    sprintf(path, "%s/%s", dir, name);
+    return path;
+}
+
+static int compare_paths(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/**
+ * Returns the type (one of the DT_* constants) of an entry read from the
+ * directory open as dirfd, following symbolic links. The type reported by
+ * readdir is used when available, otherwise it is looked up with fstatat.
+ *
+ * Returns DT_UNKNOWN if the entry can not be looked up.
+ */
+int discover_entry_type(int dirfd, const struct dirent *dp)
+{
+    if (dp->d_type != DT_UNKNOWN && dp->d_type != DT_LNK)
+    {
+        return dp->d_type;
+    }
+
+    struct stat sbuf;
+    if (fstatat(dirfd, dp->d_name, &sbuf, 0) == -1)
+    {
+        return DT_UNKNOWN;
+    }
+    return IFTODT(sbuf.st_mode);
+}
+
+/**
+ * Scans a single directory, queueing its subdirectories to be scanned
+ * if they are within the maximum depth, and recording it if it is an
+ * index directory.
+ */
+static void scan_dir(ScanState *s, ScanItem item)
+{
+    int fd = open(item.path, O_RDONLY | O_DIRECTORY);
+    if (fd == -1)
+    {
+        perror(item.path);
+        free(item.path);
+        return;
+    }
+
+    struct stat sbuf;
+    if (fstat(fd, &sbuf) == -1)
+    {
+        perror(item.path);
+        close(fd);
+        free(item.path);
+        return;
+    }
+
+    DIR *dirp;
+    if ((dirp = fdopendir(fd)) == NULL)
+    {
+        perror(item.path);
+        close(fd);
+        free(item.path);
+        return;
+    }
+
+    // subdirectories are collected locally, and queued all at once.
+    ScanItem *children = NULL;
+    int nchildren = 0;
+    int capchildren = 0;
+    int has_index = 0;
+    int has_names = 0;
+
+    struct dirent *dp;
+    while ((dp = readdir(dirp)) != NULL)
+    {
+        if (strcmp(dp->d_name, ".") == 0 ||
+            strcmp(dp->d_name, "..") == 0 ||
+            strcmp(dp->d_name, ".svn") == 0 ||
+            strcmp(dp->d_name, ".git") == 0)
+        {
+            continue;
+        }
+
+        int is_index = strcmp(dp->d_name, "index") == 0;
+        int is_names = strcmp(dp->d_name, "filenames") == 0;
+        int descend = s->maxdepth < 0 || item.depth < s->maxdepth;
+        if (!is_index && !is_names && !descend)
+        {
+            continue;
+        }
+
+        int type = discover_entry_type(fd, dp);
+        if (type == DT_DIR && descend)
+        {
+            grow((void **)&children, &capchildren, nchildren + 1, sizeof(ScanItem));
+            children[nchildren].path = join_path(item.path, dp->d_name);
+            children[nchildren].depth = item.depth + 1;
+            nchildren++;
+        }
+        else if (type == DT_REG)
+        {
+            has_index |= is_index;
+            has_names |= is_names;
+        }
+    }
+
+    if (closedir(dirp) < 0)
+    {
+        perror("closedir");
+    }
+
+    pthread_mutex_lock(&s->lock);
+
+    for (int i = 0; i < nchildren; i++)
+    {
+        grow((void **)&s->pending, &s->cappending, s->npending + 1, sizeof(ScanItem));
+        s->pending[s->npending++] = children[i];
+    }
+
+    // the root itself is never an index directory to search.
+    if (item.depth > 0 && has_index && has_names)
+    {
+        grow((void **)&s->found->paths, &s->capfound, s->found->n + 1, sizeof(char *));
+        s->found->paths[s->found->n++] = strdup(item.path);
+    }
+    else if (item.depth > 0 && (has_index || has_names))
+    {
+        fprintf(stderr, "discover: %s is missing its %s file, skipping\n",
+                item.path, has_index ? "filenames" : "index");
+    }
+
+    grow((void **)&s->scanned, &s->capscanned, s->nscanned + 1, sizeof(DirStamp));
+    s->scanned[s->nscanned].path = item.path;
+    s->scanned[s->nscanned].mtime = sbuf.st_mtim;
+    s->nscanned++;
+
+    pthread_mutex_unlock(&s->lock);
+    free(children);
+}
+
+/**
+ * Scans directories until there are none left to scan, and no other
+ * thread is in the middle of a scan that could queue more.
+ */
+static void *scan_loop(void *arg)
+{
+    ScanState *s = arg;
+
+    pthread_mutex_lock(&s->lock);
+    while (1)
+    {
+        while (s->npending == 0 && s->busy > 0)
+        {
+            pthread_cond_wait(&s->cond, &s->lock);
+        }
+        if (s->npending == 0)
+        {
+            break;
+        }
+
+        ScanItem item = s->pending[--s->npending];
+        s->busy++;
+        pthread_mutex_unlock(&s->lock);
+
+        scan_dir(s, item);
+
+        pthread_mutex_lock(&s->lock);
+        s->busy--;
+        pthread_cond_broadcast(&s->cond);
+    }
+    pthread_mutex_unlock(&s->lock);
+    return NULL;
+}
+
+/**
+ * Loads the result of a previous scan from the cache file, if the
+ * scan was of the same root and depth and none of the scanned
+ * directories has been modified since. Returns NULL otherwise.
+ */
+static DirList *load_cache(const char *cachefile, const char *root, int maxdepth)
+{
+    FILE *fp;
+    if ((fp = fopen(cachefile, "r")) == NULL)
+    {
+        return NULL;
+    }
+
+    DirList *l = discover_malloc(sizeof(DirList));
+    l->paths = NULL;
+    l->n = 0;
+    int cap = 0;
+    int valid = 0;
+
+    char *line = NULL;
+    size_t linecap = 0;
+    ssize_t len;
+    int depth;
+    int offset;
+
+    // header: magic, depth and root.
+    if ((len = getline(&line, &linecap, fp)) > 0)
+    {
+        line[strcspn(line, "\n")] = '\0';
+        valid = sscanf(line, CACHE_MAGIC " %d %n", &depth, &offset) == 1 &&
+                depth == maxdepth && strcmp(line + offset, root) == 0;
+    }
+
+    long long sec;
+    long nsec;
+    struct stat sbuf;
+    while (valid && (len = getline(&line, &linecap, fp)) > 0)
+    {
+        line[strcspn(line, "\n")] = '\0';
+        if (sscanf(line, "D %lld %ld %n", &sec, &nsec, &offset) == 2)
+        {
+            valid = stat(line + offset, &sbuf) == 0 &&
+                    sbuf.st_mtim.tv_sec == sec && sbuf.st_mtim.tv_nsec == nsec;
+        }
+        else if (strncmp(line, "I ", 2) == 0)
+        {
+            grow((void **)&l->paths, &cap, l->n + 1, sizeof(char *));
+            l->paths[l->n++] = strdup(line + 2);
+        }
+        else
+        {
+            valid = 0;
+        }
+    }
+
+    free(line);
+    fclose(fp);
+
+    if (!valid)
+    {
+        dl_free(l);
+        return NULL;
+    }
+    return l;
+}
+
+/**
+ * Saves the result of a scan to the cache file. The cache is written to
+ * a temporary file first, so that a reader never sees half a cache.
+ */
+static void save_cache(const char *cachefile, const char *root, int maxdepth, ScanState *s)
+{
+    char *tmpfile = discover_malloc(strlen(cachefile) + 8);
+    sprintf(tmpfile, "%s.tmp", cachefile);
+
+    FILE *fp;
+    if ((fp = fopen(tmpfile, "w")) == NULL)
+    {
+        perror(tmpfile);
+        free(tmpfile);
+        return;
+    }
+
+    fprintf(fp, CACHE_MAGIC " %d %s\n", maxdepth, root);
+    for (int i = 0; i < s->nscanned; i++)
+    {
+        fprintf(fp, "D %lld %ld %s\n", (long long)s->scanned[i].mtime.tv_sec,
+                s->scanned[i].mtime.tv_nsec, s->scanned[i].path);
+    }
+    for (int i = 0; i < s->found->n; i++)
+    {
+        fprintf(fp, "I %s\n", s->found->paths[i]);
+    }
+
+    if (fclose(fp) != 0 || rename(tmpfile, cachefile) == -1)
+    {
+        perror("discover: saving cache");
+        unlink(tmpfile);
+    }
+    free(tmpfile);
+}
+
+/**
+ * Finds every index directory below root, that is, every directory that
+ * contains both an index file and a filenames file.
+ *
+ * See discover.h for details.
+ */
+DirList *discover_index_dirs(const char *root, int maxdepth, int nthreads, const char *cachefile)
+{
+    if (cachefile != NULL)
+    {
+        DirList *cached = load_cache(cachefile, root, maxdepth);
+        if (cached != NULL)
+        {
+            return cached;
+        }
+    }
+
+    ScanState s;
+    memset(&s, 0, sizeof(s));
+    pthread_mutex_init(&s.lock, NULL);
+    pthread_cond_init(&s.cond, NULL);
+    s.maxdepth = maxdepth;
+    s.found = discover_malloc(sizeof(DirList));
+    s.found->paths = NULL;
+    s.found->n = 0;
+
+    grow((void **)&s.pending, &s.cappending, 1, sizeof(ScanItem));
+    s.pending[0].path = strdup(root);
+    s.pending[0].depth = 0;
+    s.npending = 1;
+
+    // the calling thread scans too.
+    pthread_t *threads = NULL;
+    int nstarted = 0;
+    if (nthreads > 1)
+    {
+        threads = discover_malloc(sizeof(pthread_t) * (nthreads - 1));
+        for (int i = 0; i < nthreads - 1; i++)
+        {
+            if (pthread_create(&threads[nstarted], NULL, scan_loop, &s) != 0)
+            {
+                break;
+            }
+            nstarted++;
+        }
+    }
+    scan_loop(&s);
+    for (int i = 0; i < nstarted; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+
+    qsort(s.found->paths, s.found->n, sizeof(char *), compare_paths);
+
+    // the root could not even be opened.
+    if (s.nscanned == 0)
+    {
+        dl_free(s.found);
+        s.found = NULL;
+    }
+    else if (cachefile != NULL)
+    {
+        save_cache(cachefile, root, maxdepth, &s);
+    }
+
+    for (int i = 0; i < s.nscanned; i++)
+    {
+        free(s.scanned[i].path);
+    }
+    free(s.scanned);
+    free(s.pending);
+    pthread_mutex_destroy(&s.lock);
+    pthread_cond_destroy(&s.cond);
+    return s.found;
+}
+
+/**
+ * Frees the list, including every path in it.
+ */
+void dl_free(DirList *l)
+{
+    for (int i = 0; i < l->n; i++)
+    {
+        free(l->paths[i]);
+    }
+    free(l->paths);
+    free(l);
+}
@@ -0,0 +1,57 @@
+#ifndef DISCOVER_H
+#define DISCOVER_H
+
+#include <dirent.h>
+
+// Unlimited depth for discover_index_dirs
+#define DISCOVER_RECURSIVE -1
+
+/**
+ * A list of directories found by discover_index_dirs.
+ *
+ * Use dl_free to release the list and all its paths.
+ */
+typedef struct
+{
+    char **paths;
+    int n;
+} DirList;
+
+/**
+ * Finds every index directory below root, that is, every directory that
+ * contains both an index file and a filenames file.
+ *
+ * Only directories at most maxdepth levels below root are considered;
+ * a maxdepth of 1 only considers the immediate subdirectories of root,
+ * and DISCOVER_RECURSIVE considers the whole tree. Directories named
+ * .git or .svn are never entered.
+ *
+ * Entry types are taken from readdir where the file system reports them,
+ * so a stat is only needed for entries of unknown type and symbolic links.
+ * If nthreads is greater than 1, subtrees are scanned in parallel by that
+ * many threads.
+ *
+ * If cachefile is not NULL, the directories that were scanned are saved
+ * to it along with their modification times. As long as none of those
+ * directories has changed since, the next call with the same root and
+ * maxdepth returns the cached result without scanning.
+ *
+ * The returned paths are sorted, and are prefixed with root.
+ */
+DirList *discover_index_dirs(const char *root, int maxdepth, int nthreads, const char *cachefile);
+
+/**
+ * Frees the list, including every path in it.
+ */
+void dl_free(DirList *l);
+
+/**
+ * Returns the type (one of the DT_* constants) of an entry read from the
+ * directory open as dirfd, following symbolic links. The type reported by
+ * readdir is used when available, otherwise it is looked up with fstatat.
+ *
+ * Returns DT_UNKNOWN if the entry can not be looked up.
+ */
+int discover_entry_type(int dirfd, const struct dirent *dp);
+
+#endif /* DISCOVER_H */
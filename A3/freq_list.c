@@ -8,10 +8,50 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
 
 #include "freq_list.h"
 
 int num_words = 0;
+WordArena word_arena = {NULL, 0, 0};
+
+/* Make sure the arena has room for n more bytes, growing it
+* geometrically.
+*/
+static void reserve_words(int n) {
+    if (word_arena.len + n <= word_arena.cap) {
+        return;
+    }
+    int cap = word_arena.cap ? word_arena.cap : 4096;
+    while (cap < word_arena.len + n) {
+        cap *= 2;
+    }
+    if ((word_arena.bytes = realloc(word_arena.bytes, cap)) == NULL) {
+        perror("realloc for word arena");
+        exit(1);
+    }
+    word_arena.cap = cap;
+}
+
+/* Copy the first len bytes of word into the arena, null terminated,
+* and return its offset.
+*/
+int intern_word(const char *word, int len) {
+    reserve_words(len + 1);
+    int offset = word_arena.len;
+    memcpy(word_arena.bytes + offset, word, len);
+    word_arena.bytes[offset + len] = '\0';
+    word_arena.len += len + 1;
+    return offset;
+}
+
+/* Return the word of a node. The pointer is only valid until the
+* next word is interned.
+*/
+char *node_word(const Node *node) {
+    return word_arena.bytes + node->word;
+}
 
 /* Allocate and initialize a new node for the list.
 */
@@ -22,9 +62,8 @@ Node *create_node(char *word, int count, int filenum) {
         exit(1);
     }
 
-    strncpy(newnode->word, word, MAXWORD);
-    /* Make sure it is null terminated. */
-    newnode->word[MAXWORD - 1] = '\0';
+    newnode->wordlen = strlen(word);
+    newnode->word = intern_word(word, newnode->wordlen);
 
     memset(newnode->freq, 0, MAXFILES * sizeof(int));
     newnode->freq[filenum] = count;
@@ -45,7 +84,7 @@ Node *add_word(Node *head, char **filenames, char *word, char *fname) {
     Node *prev = head;
 
     filenum = get_filenum(fname, filenames);
-    if (cur && (strcmp(cur->word, word)) > 0) {
+    if (cur && (strcmp(node_word(cur), word)) > 0) {
         head = create_node(word, 1, filenum);
         head->next = cur;
         num_words++;
@@ -54,11 +93,11 @@ Node *add_word(Node *head, char **filenames, char *word, char *fname) {
 
     /* look for the word */
     while (cur != NULL) {
-        if ((strcmp(cur->word, word)) == 0) {
+        if ((strcmp(node_word(cur), word)) == 0) {
             /* found word */
             cur->freq[filenum] += 1;
             return head;
-        } else if ((strcmp(cur->word, word)) > 0) {
+        } else if ((strcmp(node_word(cur), word)) > 0) {
             /* need to insert word */
             if (cur == prev ) { /* we are at the head */
                 prev = create_node(word, 1, filenum);
@@ -97,7 +136,7 @@ void display_list(Node *head, char **filenames) {
     int i;
 
     while (head != NULL) {
-        printf("%s\n", head->word);
+        printf("%s\n", node_word(head));
 
         for (i = 0; i < MAXFILES; i++) {
             if (filenames[i] != NULL) {
@@ -111,47 +150,235 @@ void display_list(Node *head, char **filenames) {
     }
 }
 
+/* Fold n bytes of buf into a running 32-bit FNV-1a checksum. Start
+* with CHECKSUM_INIT.
+*/
+unsigned int checksum(unsigned int sum, const void *buf, size_t n) {
+    const unsigned char *bytes = buf;
+    size_t i;
+    for (i = 0; i < n; i++) {
+        sum = (sum ^ bytes[i]) * 16777619u;
+    }
+    return sum;
+}
+
+/* Return the checksum of the header, taken with its own checksum
+* field zeroed.
+*/
+unsigned int header_checksum(const IndexHeader *header) {
+    IndexHeader copy = *header;
+    copy.header_checksum = 0;
+    return checksum(CHECKSUM_INIT, &copy, sizeof(IndexHeader));
+}
+
+/* Return whether the header is that of an index file of this version,
+* and has not been corrupted.
+*/
+int valid_header(const IndexHeader *header) {
+    return header->magic == INDEX_MAGIC && header->version == INDEX_VERSION &&
+        header->header_checksum == header_checksum(header);
+}
+
+/* Return the generation of the index in listfile, or 0 if there is no
+* valid index there yet.
+*/
+static unsigned int index_generation(char *listfile) {
+    IndexHeader header;
+    FILE *fp;
+    unsigned int generation = 0;
+
+    if ((fp = fopen(listfile, "r")) == NULL) {
+        return 0;
+    }
+    if (fread(&header, sizeof(IndexHeader), 1, fp) == 1 && valid_header(&header)) {
+        generation = header.generation;
+    }
+    fclose(fp);
+    return generation;
+}
+
+/* Return a malloc'd copy of path with suffix appended.
+*/
+static char *suffixed(const char *path, const char *suffix) {
+    char *result = malloc(strlen(path) + strlen(suffix) + 1);
+    if (result == NULL) {
+        perror("malloc for file name");
+        exit(1);
+    }
+    sprintf(result, "%s%s", path, suffix);
+    return result;
+}
+
+/* Return the path of the copy of namefile kept for a generation.
+*/
+static char *generation_name(const char *namefile, unsigned int generation) {
+    char suffix[16];
+    snprintf(suffix, sizeof(suffix), ".%u", generation);
+    return suffixed(namefile, suffix);
+}
+
+/* Flush the stream and make sure its contents are on disk before
+* closing it.
+*/
+static void close_synced(FILE *fp, const char *path) {
+    if (fflush(fp) != 0 || fsync(fileno(fp)) == -1) {
+        perror(path);
+        exit(1);
+    }
+    if (fclose(fp)) {
+        perror(path);
+        exit(1);
+    }
+}
+
+/* Make sure the renames in the directory holding path are on disk.
+*/
+static void sync_parent(const char *path) {
+    char *dir = strdup(path);
+    char *slash = strrchr(dir, '/');
+    int fd;
+
+    if (slash == NULL) {
+        strcpy(dir, ".");
+    } else if (slash == dir) {
+        dir[1] = '\0';
+    } else {
+        *slash = '\0';
+    }
+
+    if ((fd = open(dir, O_RDONLY)) != -1) {
+        fsync(fd);
+        close(fd);
+    }
+    free(dir);
+}
+
+static void publish(const char *from, const char *to) {
+    if (rename(from, to) == -1) {
+        perror(to);
+        exit(1);
+    }
+}
+
 /* Print the linked list of words to two files.  The array of file names
 * will be written one line per file in text format to namefile.  The
-* linked list will be written to the file listfile in binary format.
+* linked list will be written to the file listfile in binary format,
+* as a header followed by the words section and the postings section
+* (see freq_list.h).
+*
+* Both files are written under temporary names and synced before being
+* renamed into place, so that a reader never sees a half written file,
+* even if the indexer crashes.  The two renames can not happen at once,
+* so a copy of the filenames file is also kept as namefile.GENERATION
+* (along with the one of the previous generation) for readers that
+* catch the index and the filenames file from different generations.
 */
 void write_list(char *namefile, char *listfile, Node *head, char **filenames) {
-    Node *cur = head;
+    Node *cur;
     int i;
 
+    IndexHeader header;
+    memset(&header, 0, sizeof(IndexHeader));
+    header.magic = INDEX_MAGIC;
+    header.version = INDEX_VERSION;
+    header.generation = index_generation(listfile) + 1;
+    header.names_checksum = CHECKSUM_INIT;
+    header.words_checksum = CHECKSUM_INIT;
+    header.postings_checksum = CHECKSUM_INIT;
+
+    /* Write the file names array, and publish it under its generation. */
+    char *name_tmp = suffixed(namefile, ".tmp");
+    char *name_gen = generation_name(namefile, header.generation);
+    FILE *fname_fp;
+    if ((fname_fp = fopen(name_tmp, "w")) == NULL) {
+        perror("fopen for names file");
+        exit(1);
+    }
+
+    for (i = 0; i < MAXFILES && filenames[i] != NULL; i++) {
+        header.names_checksum = checksum(header.names_checksum, filenames[i], strlen(filenames[i]));
+        header.names_checksum = checksum(header.names_checksum, "\n", 1);
+        fprintf(fname_fp, "%s\n", filenames[i]);
+    }
+    close_synced(fname_fp, name_tmp);
+    publish(name_tmp, name_gen);
+
+    /* Checksum both sections before writing, since the header
+    * comes first.  Offsets are relative to the start of the words
+    * section.
+    */
+    IndexEntry entry;
+    unsigned int offset = 0;
+    memset(&entry, 0, sizeof(IndexEntry));
+    for (cur = head; cur != NULL; cur = cur->next) {
+        header.nwords++;
+        header.words_bytes += cur->wordlen + 1;
+        header.words_checksum = checksum(header.words_checksum, node_word(cur), cur->wordlen + 1);
+
+        entry.word = offset;
+        entry.wordlen = cur->wordlen;
+        memcpy(entry.freq, cur->freq, sizeof(entry.freq));
+        header.postings_checksum = checksum(header.postings_checksum, &entry, sizeof(IndexEntry));
+        offset += cur->wordlen + 1;
+    }
+    header.header_checksum = header_checksum(&header);
+
     /* Write out the linked list */
+    char *list_tmp = suffixed(listfile, ".tmp");
     FILE *list_fp;
-    if ((list_fp = fopen(listfile, "w")) == NULL) {
+    if ((list_fp = fopen(list_tmp, "w")) == NULL) {
         perror("fopen for list file");
         exit(1);
     }
 
-    while (cur != NULL) {
-        if (fwrite(cur, sizeof(Node), 1, list_fp) != 1) {
+    if (fwrite(&header, sizeof(IndexHeader), 1, list_fp) != 1) {
+        perror("fwrite for list file");
+        exit(1);
+    }
+
+    for (cur = head; cur != NULL; cur = cur->next) {
+        if (fwrite(node_word(cur), cur->wordlen + 1, 1, list_fp) != 1) {
             perror("fwrite for list file");
             exit(1);
         }
-        cur = cur->next;
     }
 
-    if (fclose(list_fp)) {
-        perror("fclose for list file");
+    offset = 0;
+    for (cur = head; cur != NULL; cur = cur->next) {
+        entry.word = offset;
+        entry.wordlen = cur->wordlen;
+        memcpy(entry.freq, cur->freq, sizeof(entry.freq));
+        if (fwrite(&entry, sizeof(IndexEntry), 1, list_fp) != 1) {
+            perror("fwrite for list file");
+            exit(1);
+        }
+        offset += cur->wordlen + 1;
     }
-
-    /* Write the file names array */
-    FILE *fname_fp;
-    if ((fname_fp = fopen(namefile, "w")) == NULL) {
-        perror("fopen for names file");
+    close_synced(list_fp, list_tmp);
+
+    /* Publish the filenames first, then the index.  A hard link lets
+    * the generation copy stay behind after the rename.
+    */
+    unlink(name_tmp);
+    if (link(name_gen, name_tmp) == -1) {
+        perror("link for names file");
         exit(1);
     }
-
-    for (i = 0; i < MAXFILES && filenames[i] != NULL; i++) {
-        fprintf(fname_fp, "%s\n", filenames[i]);
+    publish(name_tmp, namefile);
+    publish(list_tmp, listfile);
+    sync_parent(namefile);
+    sync_parent(listfile);
+
+    /* No reader can need the filenames of two generations ago. */
+    if (header.generation > 2) {
+        char *old = generation_name(namefile, header.generation - 2);
+        unlink(old);
+        free(old);
     }
 
-    if (fclose(fname_fp)) {
-        perror("fclose for names file");
-    }
+    free(name_tmp);
+    free(name_gen);
+    free(list_tmp);
 }
 
 /* Populate the linked list and filenames data structures with data
@@ -159,7 +386,11 @@ void write_list(char *namefile, char *listfile, Node *head, char **filenames) {
 * filenames array, and the data in listfile is used to construct a
 * linked list.  Note that filenames must point to an array of the
 * correct size, but that head does not point to a list node when it is
-* passed in.
+* passed in.  The words of the list are read into the word arena in
+* one go.
+*
+* Every checksum in the header is verified, and a corrupt index is
+* fatal.
 */
 void read_list(char *listfile, char *namefile, 
                     Node **head, char **filenames) {
@@ -171,54 +402,138 @@ void read_list(char *listfile, char *namefile,
         exit(1);
     }
 
-    Node *cur = malloc(sizeof(Node));
-    if (cur == NULL) {
-        perror("malloc for current node");
+    IndexHeader header;
+    if (fread(&header, sizeof(IndexHeader), 1, list_fp) != 1 ||
+        header.magic != INDEX_MAGIC || header.version != INDEX_VERSION) {
+        fprintf(stderr, "%s: not an index file, or an old one; run indexer again\n", listfile);
+        exit(1);
+    }
+    if (header.header_checksum != header_checksum(&header)) {
+        fprintf(stderr, "%s: corrupt header\n", listfile);
         exit(1);
     }
 
-    Node *prev = NULL;
-    *head = cur;
+    reserve_words(header.words_bytes);
+    int base = word_arena.len;
+    if (header.words_bytes > 0 &&
+        fread(word_arena.bytes + base, header.words_bytes, 1, list_fp) != 1) {
+        fprintf(stderr, "%s: truncated words section\n", listfile);
+        exit(1);
+    }
+    if (checksum(CHECKSUM_INIT, word_arena.bytes + base, header.words_bytes) != header.words_checksum) {
+        fprintf(stderr, "%s: corrupt words section\n", listfile);
+        exit(1);
+    }
+    word_arena.len += header.words_bytes;
 
-    while ((fread(cur, sizeof(Node), 1, list_fp)) != 0) {
-        cur->next = NULL;
+    Node *prev = NULL;
+    *head = NULL;
 
-        if (cur == *head) {
-            prev = cur;
-        } else {
-            prev->next = cur;
-            prev = cur;
+    IndexEntry entry;
+    unsigned int sum = CHECKSUM_INIT;
+    for (unsigned int n = 0; n < header.nwords; n++) {
+        if (fread(&entry, sizeof(IndexEntry), 1, list_fp) != 1) {
+            fprintf(stderr, "%s: truncated postings section\n", listfile);
+            exit(1);
+        }
+        sum = checksum(sum, &entry, sizeof(IndexEntry));
+        if (entry.word + entry.wordlen >= header.words_bytes ||
+            word_arena.bytes[base + entry.word + entry.wordlen] != '\0') {
+            fprintf(stderr, "%s: corrupt word offset\n", listfile);
+            exit(1);
         }
 
-        cur = malloc(sizeof(Node));
+        Node *cur = malloc(sizeof(Node));
         if (cur == NULL) {
             perror("malloc for current node");
             exit(1);
         }
-    }
-
-    /* Check if the file is empty. */
-    if (*head == cur)
-        *head = NULL;
+        cur->word = base + entry.word;
+        cur->wordlen = entry.wordlen;
+        memcpy(cur->freq, entry.freq, sizeof(cur->freq));
+        cur->next = NULL;
 
-    /* Release memory not being used. */
-    free(cur);
+        if (prev == NULL) {
+            *head = cur;
+        } else {
+            prev->next = cur;
+        }
+        prev = cur;
+    }
+    if (sum != header.postings_checksum) {
+        fprintf(stderr, "%s: corrupt postings section\n", listfile);
+        exit(1);
+    }
 
     if ((fclose(list_fp))) {
         perror("fclose for list_fp");
     }
 
-    /* Read in the file names */
-    FILE *fname_fp;
-    if ((fname_fp = fopen(namefile, "r")) == NULL) {
+    read_filenames(namefile, filenames, &header);
+}
+
+/* Read the whole of namefile into a malloc'd, null terminated buffer.
+* Returns NULL if it can not be read.
+*/
+static char *slurp(const char *namefile, long *size) {
+    FILE *fp;
+    char *buf;
+
+    if ((fp = fopen(namefile, "r")) == NULL) {
+        return NULL;
+    }
+    fseek(fp, 0, SEEK_END);
+    *size = ftell(fp);
+    rewind(fp);
+
+    if ((buf = malloc(*size + 1)) == NULL) {
+        perror("malloc for names file");
+        exit(1);
+    }
+    if (*size > 0 && fread(buf, *size, 1, fp) != 1) {
+        free(buf);
+        fclose(fp);
+        return NULL;
+    }
+    buf[*size] = '\0';
+    fclose(fp);
+    return buf;
+}
+
+/* Populate the filenames array with the names stored one per line
+* in namefile.  If header is not NULL, the names must match the checksum
+* recorded in it; if the index and namefile are from different
+* generations, the copy of namefile kept for the generation of the index
+* is read instead.
+*/
+void read_filenames(char *namefile, char **filenames, const IndexHeader *header) {
+    long size = 0;
+    char *buf = slurp(namefile, &size);
+
+    if (buf == NULL) {
         perror("fopen for fname_fp");
         exit(1);
     }
 
-    char line[MAXLINE];
+    if (header != NULL && checksum(CHECKSUM_INIT, buf, size) != header->names_checksum) {
+        char *name_gen = generation_name(namefile, header->generation);
+        free(buf);
+        buf = slurp(name_gen, &size);
+        if (buf == NULL || checksum(CHECKSUM_INIT, buf, size) != header->names_checksum) {
+            fprintf(stderr, "%s: does not match generation %u of the index\n",
+                    namefile, header->generation);
+            exit(1);
+        }
+        free(name_gen);
+    }
+
+    char *line = buf;
+    char *newline;
     int i = 0;
-    while ((fgets(line, MAXLINE, fname_fp)) != NULL) {
-        line[strlen(line) - 1] = '\0';
+    while (*line != '\0') {
+        if ((newline = strchr(line, '\n')) != NULL) {
+            *newline = '\0';
+        }
 
         char *name = malloc(strlen(line) + 1);
         if (name == NULL) {
@@ -234,11 +549,12 @@ void read_list(char *listfile, char *namefile,
             fprintf(stderr, "Invalid input file! Too many filenames!\n");
             exit(1);
         }
+        if (newline == NULL) {
+            break;
+        }
+        line = newline + 1;
     }
-
-    if ((fclose(fname_fp))) {
-        perror("fclose for fname_fp");
-    }
+    free(buf);
 }
 
 /* Create an array to hold filenames and initialize it to all NULL 
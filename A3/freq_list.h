@@ -2,20 +2,69 @@
 #define FREQ_LIST_H
 
 #define MAXFILES 50
-#define MAXWORD 32
 #define MAXLINE 1024
 #define PATHLENGTH 128
 
+/* Words are interned in a single growable arena of null terminated
+ * strings, and nodes refer to them by offset, so that a word takes up
+ * only as much space as it needs. Use node_word to get at the word of
+ * a node; the pointer is only valid until the next word is interned.
+ */
+typedef struct {
+    char *bytes;
+    int len;
+    int cap;
+} WordArena;
+
 struct node {
-    char word[MAXWORD];
+    int word;
+    int wordlen;
     int freq[MAXFILES];
     struct node *next;
 };
 
 typedef struct node Node; 
 
+/* Layout of an index file: a header, the words section holding every
+ * word null terminated, then the postings section holding one
+ * IndexEntry per word, in the same order as the words.
+ *
+ * The header records the generation of the index, which write_list
+ * bumps every time it publishes one, and checksums of itself, of both
+ * sections and of the filenames file written along with it, so that a
+ * reader can tell a torn or mismatched pair of files from a good one.
+ */
+#define INDEX_MAGIC 0x41334958 /* "A3IX" */
+#define INDEX_VERSION 3
+#define CHECKSUM_INIT 2166136261u
+
+typedef struct {
+    unsigned int magic;
+    unsigned int version;
+    unsigned int generation;
+    unsigned int nwords;
+    unsigned int words_bytes;
+    unsigned int names_checksum;
+    unsigned int words_checksum;
+    unsigned int postings_checksum;
+    unsigned int header_checksum;
+} IndexHeader;
+
+typedef struct {
+    unsigned int word;
+    unsigned int wordlen;
+    int freq[MAXFILES];
+} IndexEntry;
+
 extern char *filenames[MAXFILES];
 extern int num_words;
+extern WordArena word_arena;
+
+unsigned int checksum(unsigned int sum, const void *buf, size_t n);
+unsigned int header_checksum(const IndexHeader *header);
+int valid_header(const IndexHeader *header);
+int intern_word(const char *word, int len);
+char *node_word(const Node *node);
 
 Node *create_node(char *word, int count, int filenum);
 Node *add_word(Node *head, char **filenames, char *word, char *fname);
@@ -25,5 +74,6 @@ int get_filenum(char *fname, char **filenames);
 void display_list(Node *head, char **filenames);
 void write_list(char *namefile, char *listfile, Node *head, char **filenames);
 void read_list(char *namefile, char *listfile, Node **head, char **filenames);
+void read_filenames(char *namefile, char **filenames, const IndexHeader *header);
 
 #endif /* FREQ_LIST_H */
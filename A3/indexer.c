@@ -3,19 +3,74 @@
 #include <unistd.h>
 #include <dirent.h>
 #include <stdlib.h>
-#include <ctype.h>
+#include <sys/time.h>
+#include <sys/resource.h>
 
 #include "freq_list.h"
+#include "discover.h"
+#include "punc.h"
+#include "monotime.h"
 
-char *remove_punc(char *);
+/* Number of lines between checks of whether a periodic stats report is due.
+*/
+#define STATS_CHECK_LINES 1024
+
+/* Counters describing where indexing time goes. Only collected when a
+* destination for them is given, so that indexing without stats pays
+* nothing beyond a few local counters per file.
+*/
+struct index_stats {
+    FILE *out;
+    /* seconds between periodic reports, or 0 to only report per file */
+    int interval;
+    long long started;
+    long long last_report;
+    int files;
+    long long bytes;
+    long long tokens_seen;
+    long long tokens_kept;
+};
+
+typedef struct index_stats IndexStats;
+
+/* Return the peak resident set size of this process in kilobytes.
+*/
+long max_rss_kb() {
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == -1) {
+        return 0;
+    }
+    return usage.ru_maxrss;
+}
+
+/* Write a single line of counters to the stats destination. The counters
+* of the file being indexed are passed separately since they are only
+* added to the totals once the file is done.
+*/
+void report_stats(IndexStats *stats, char *kind, long long bytes,
+                  long long seen, long long kept) {
+    long long now = monotonic_us();
+    fprintf(stats->out, "%s elapsed_us=%lld files=%d bytes=%lld tokens_seen=%lld "
+            "tokens_kept=%lld words=%d maxrss_kb=%ld\n",
+            kind, now - stats->started, stats->files, stats->bytes + bytes,
+            stats->tokens_seen + seen, stats->tokens_kept + kept, num_words,
+            max_rss_kb());
+    fflush(stats->out);
+    stats->last_report = now;
+}
 
 /* Returns a pointer to a linked list of nodes where each node
 * contains a word and the count of the number of occurrences of the word.
+* If stats is not NULL, the counters for this file are added to it.
 */
-Node *index_file(Node *head, char *fname, char **filenames) {
+Node *index_file(Node *head, char *fname, char **filenames, IndexStats *stats) {
     char line[MAXLINE];
     char *marker, *token;
     int countlines = 0;
+    long long bytes = 0;
+    long long seen = 0;
+    long long kept = 0;
+    long long started = 0;
     FILE *fp;
 
     if ((fp = fopen(fname, "r")) == NULL) {
@@ -23,19 +78,27 @@ Node *index_file(Node *head, char *fname, char **filenames) {
         exit(1);
     }
 
+    if (stats != NULL) {
+        started = monotonic_us();
+    }
+
     while ((fgets(line, MAXLINE, fp)) != NULL) {
+        int len = strlen(line);
         countlines++;
-        if ((countlines % 1000) == 0) {
-            printf("processed %d lines from %s (words%d)\n", countlines, fname, num_words);
+        bytes += len;
+
+        if (stats != NULL && stats->interval > 0 && (countlines % STATS_CHECK_LINES) == 0 &&
+            monotonic_us() - stats->last_report >= stats->interval * 1000000LL) {
+            report_stats(stats, "progress", bytes, seen, kept);
         }
 
-        if (strlen(line) > 0 ) {
-            line[strlen(line) - 1] = '\0';
+        if (len > 0 ) {
+            line[len - 1] = '\0';
         } else {
             continue;
         }
 
-        if (strlen(line) == 0) {
+        if (len == 1) {
             continue;
         }
 
@@ -45,18 +108,30 @@ Node *index_file(Node *head, char *fname, char **filenames) {
                 continue;
             }
 
-            token = remove_punc(token);
-            if ((strlen(token) <= 3) || isdigit(*token)) {
-                free(token);
+            seen++;
+            if ((token = normalize_word(token)) == NULL) {
                 continue;
             }
 
-            if (*token != '\0') {
-                head = add_word(head, filenames, token, fname);
-            }
+            kept++;
+            head = add_word(head, filenames, token, fname);
             free(token);
         }
     }
+
+    if (fclose(fp)) {
+        perror("fclose");
+    }
+
+    if (stats != NULL) {
+        fprintf(stats->out, "file path=%s wall_us=%lld lines=%d bytes=%lld tokens_seen=%lld "
+                "tokens_kept=%lld maxrss_kb=%ld\n", fname, monotonic_us() - started, countlines,
+                bytes, seen, kept, max_rss_kb());
+        stats->files++;
+        stats->bytes += bytes;
+        stats->tokens_seen += seen;
+        stats->tokens_kept += kept;
+    }
     return head;
 }
 
@@ -64,6 +139,10 @@ Node *index_file(Node *head, char *fname, char **filenames) {
  * An index consists of the filenames file and the associated index file. 
  * Strip punctuation, convert words to lowercase and ignore words 
  * that are shorter than 4 characters.
+ *
+ * With -s FILE (or -s - for standard error), per-file and total counters
+ * are written to FILE, and with -r SECONDS, a progress line is also
+ * written every SECONDS while indexing.
  */
 int main(int argc, char **argv) {
     Node *head = NULL;
@@ -73,8 +152,10 @@ int main(int argc, char **argv) {
     char *namefile = "filenames";
     char dirname[PATHLENGTH] = ".";
     char path[PATHLENGTH];
+    char *statsfile = NULL;
+    IndexStats stats = {0};
 
-    while ((ch = getopt(argc, argv, "i:n:d:")) != -1) {
+    while ((ch = getopt(argc, argv, "i:n:d:s:r:")) != -1) {
         switch (ch) {
         case 'i':
             indexfile = optarg;
@@ -86,10 +167,28 @@ int main(int argc, char **argv) {
             strncpy(dirname, optarg, PATHLENGTH);
             dirname[PATHLENGTH - 1] = '\0';
             break;
+        case 's':
+            statsfile = optarg;
+            break;
+        case 'r':
+            stats.interval = atoi(optarg);
+            break;
         default:
-            fprintf(stderr, "Usage: indexer [-i FILE] [-n FILE] [-d DIRECTORY_NAME]\n");
+            fprintf(stderr, "Usage: indexer [-i FILE] [-n FILE] [-d DIRECTORY_NAME] "
+                    "[-s STATSFILE] [-r SECONDS]\n");
+            exit(1);
+        }
+    }
+
+    if (statsfile != NULL) {
+        if (strcmp(statsfile, "-") == 0) {
+            stats.out = stderr;
+        } else if ((stats.out = fopen(statsfile, "w")) == NULL) {
+            perror(statsfile);
             exit(1);
         }
+        stats.started = monotonic_us();
+        stats.last_report = stats.started;
     }
 
     DIR *dirp;
@@ -105,18 +204,31 @@ int main(int argc, char **argv) {
                 continue;
         }
 
+        /* Only regular files can be indexed. The type usually comes straight
+         * from readdir, so this rarely costs a stat. */
+        if (discover_entry_type(dirfd(dirp), dp) != DT_REG) {
+            continue;
+        }
+
         path[0] = '\0';
         strncpy(path, dirname, PATHLENGTH);
         strncat(path, "/", PATHLENGTH-strlen(path));
         strncat(path, dp->d_name, PATHLENGTH-strlen(path));
         path[PATHLENGTH - 1] = '\0';
         printf("Indexing: %s\n", path);
-        head = index_file(head, path, filenames);
+        head = index_file(head, path, filenames, stats.out != NULL ? &stats : NULL);
     }
 
     if (closedir(dirp) < 0)
         perror("closedir");
 
     write_list(namefile, indexfile, head, filenames);
+
+    if (stats.out != NULL) {
+        report_stats(&stats, "total", 0, 0, 0);
+        if (stats.out != stderr && fclose(stats.out)) {
+            perror("fclose for stats file");
+        }
+    }
     return 0;
 }
@@ -0,0 +1,220 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "lookup.h"
+
+// tag of a slot that holds no node. Tags of full slots never have the
+// high bit set.
+#define WT_EMPTY 0x80
+
+/**
+ * The tags of a group, with the nodes of its slots right after them, so
+ * that a probe touches as few cache lines as possible.
+ */
+typedef struct
+{
+    uint8_t tags[WT_GROUP];
+    Node *nodes[WT_GROUP];
+} WordGroup;
+
+/**
+ * Struct definition for opaque type WordTable.
+ *
+ * See lookup.h for WordTable typedef
+ */
+typedef struct word_table_s
+{
+    // number of groups, a power of two.
+    size_t ngroups;
+    WordGroup *groups;
+} word_table_s;
+
+/**
+ * A malloc that panics and quits on ENOMEM.
+ */
+static void *lookup_malloc(size_t size)
+{
+    void *ptr;
+    if ((ptr = malloc(size)) == NULL)
+    {
+        perror("malloc");
+        exit(1);
+    }
+    return ptr;
+}
+
+/**
+ * Hashes the len bytes of word, eight bytes at a time.
+ */
+static uint64_t hash_word(const char *word, size_t len)
+{
+    uint64_t h = 0x9e3779b97f4a7c15ULL ^ len;
+    uint64_t chunk;
+    while (len >= 8)
+    {
+        memcpy(&chunk, word, 8);
+        h = (h ^ chunk) * 0xff51afd7ed558ccdULL;
+        h ^= h >> 32;
+        word += 8;
+        len -= 8;
+    }
+    chunk = 0;
+    memcpy(&chunk, word, len);
+    h = (h ^ chunk) * 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 29;
+    return h;
+}
+
+/**
+ * The group a hash starts probing from, and its tag. The two are taken
+ * from different bits of the hash.
+ */
+static size_t hash_group(const WordTable *t, uint64_t h)
+{
+    return (h >> 7) & (t->ngroups - 1);
+}
+
+static uint8_t hash_tag(uint64_t h)
+{
+    return h & 0x7f;
+}
+
+static int node_is(const Node *node, const char *word, size_t len)
+{
+    return (size_t)node->wordlen == len && memcmp(node_word(node), word, len) == 0;
+}
+
+/**
+ * Builds a table holding every node of the list.
+ */
+WordTable *wt_build(Node *head)
+{
+    size_t nwords = 0;
+    for (Node *cur = head; cur != NULL; cur = cur->next)
+    {
+        nwords++;
+    }
+
+    // keep groups at most 7/8 full, so that probes stay short.
+    WordTable *t = lookup_malloc(sizeof(WordTable));
+    t->ngroups = 1;
+    while (t->ngroups * WT_GROUP * 7 / 8 < nwords)
+    {
+        t->ngroups *= 2;
+    }
+    if (posix_memalign((void **)&t->groups, 64, t->ngroups * sizeof(WordGroup)) != 0)
+    {
+        perror("posix_memalign");
+        exit(1);
+    }
+    for (size_t g = 0; g < t->ngroups; g++)
+    {
+        memset(t->groups[g].tags, WT_EMPTY, WT_GROUP);
+    }
+
+    for (Node *cur = head; cur != NULL; cur = cur->next)
+    {
+        uint64_t h = hash_word(node_word(cur), cur->wordlen);
+        size_t g = hash_group(t, h);
+
+        // probe groups linearly until one has a free slot.
+        while (1)
+        {
+            WordGroup *group = &t->groups[g];
+            int slot = 0;
+            while (slot < WT_GROUP && group->tags[slot] != WT_EMPTY)
+            {
+                slot++;
+            }
+            if (slot < WT_GROUP)
+            {
+                group->tags[slot] = hash_tag(h);
+                group->nodes[slot] = cur;
+                break;
+            }
+            g = (g + 1) & (t->ngroups - 1);
+        }
+    }
+    return t;
+}
+
+/**
+ * Same as wt_find, but never uses vector instructions.
+ */
+Node *wt_find_scalar(const WordTable *t, const char *word)
+{
+    size_t len = strlen(word);
+    uint64_t h = hash_word(word, len);
+    uint8_t tag = hash_tag(h);
+
+    for (size_t g = hash_group(t, h);; g = (g + 1) & (t->ngroups - 1))
+    {
+        const WordGroup *group = &t->groups[g];
+        for (int slot = 0; slot < WT_GROUP; slot++)
+        {
+            if (group->tags[slot] == tag && node_is(group->nodes[slot], word, len))
+            {
+                return group->nodes[slot];
+            }
+            // slots are filled in order, so the word would have been here.
+            if (group->tags[slot] == WT_EMPTY)
+            {
+                return NULL;
+            }
+        }
+    }
+}
+
+/**
+ * Returns the node of the given word, or NULL if it is not in the table.
+ */
+Node *wt_find(const WordTable *t, const char *word)
+{
+#ifdef __SSE2__
+    size_t len = strlen(word);
+    uint64_t h = hash_word(word, len);
+    __m128i tag = _mm_set1_epi8(hash_tag(h));
+    __m128i empty = _mm_set1_epi8((char)WT_EMPTY);
+
+    for (size_t g = hash_group(t, h);; g = (g + 1) & (t->ngroups - 1))
+    {
+        const WordGroup *group = &t->groups[g];
+        __m128i tags = _mm_load_si128((const __m128i *)group->tags);
+
+        // one bit per slot whose tag matches.
+        unsigned int match = _mm_movemask_epi8(_mm_cmpeq_epi8(tags, tag));
+        while (match != 0)
+        {
+            int slot = __builtin_ctz(match);
+            if (node_is(group->nodes[slot], word, len))
+            {
+                return group->nodes[slot];
+            }
+            match &= match - 1;
+        }
+
+        // a group with a free slot ends the probe.
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(tags, empty)) != 0)
+        {
+            return NULL;
+        }
+    }
+#else
+    return wt_find_scalar(t, word);
+#endif
+}
+
+/**
+ * Frees the table, but not the nodes in it.
+ */
+void wt_free(WordTable *t)
+{
+    free(t->groups);
+    free(t);
+}
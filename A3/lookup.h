@@ -0,0 +1,45 @@
+#ifndef LOOKUP_H
+#define LOOKUP_H
+
+#include <stdio.h>
+
+#include "freq_list.h"
+
+// number of slots in a group, whose tags are compared at once.
+#define WT_GROUP 16
+
+/**
+ * A hash table from words to the nodes of an index list, used by workers
+ * for exact-match lookups instead of walking the list.
+ *
+ * Slots are arranged in groups of WT_GROUP. Every slot has a one byte
+ * tag: seven bits of the hash of its word, or WT_EMPTY. A lookup compares
+ * the tags of a whole group against the tag of the word at once, with
+ * SSE2 where available, and only compares the words of matching slots.
+ *
+ * Use wt_free to release the table. The nodes are not owned by the table.
+ */
+typedef struct word_table_s WordTable;
+
+/**
+ * Builds a table holding every node of the list.
+ */
+WordTable *wt_build(Node *head);
+
+/**
+ * Returns the node of the given word, or NULL if it is not in the table.
+ */
+Node *wt_find(const WordTable *t, const char *word);
+
+/**
+ * Same as wt_find, but never uses vector instructions. Always available,
+ * and used by wt_find where SSE2 is not.
+ */
+Node *wt_find_scalar(const WordTable *t, const char *word);
+
+/**
+ * Frees the table, but not the nodes in it.
+ */
+void wt_free(WordTable *t);
+
+#endif /* LOOKUP_H */
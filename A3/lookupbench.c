@@ -0,0 +1,163 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "freq_list.h"
+#include "worker.h"
+#include "lookup.h"
+
+/* A microbenchmark of exact-match word lookups.
+ *
+ * Builds an in-memory index list of synthetic words, then times looking
+ * up a mix of present and absent words by walking the list (get_word's
+ * path), and through a WordTable with both its scalar and vector probes.
+ * Results are reported as key=value lines on standard output.
+ */
+
+/**
+ * A xorshift generator, so that a run is reproducible from its seed.
+ */
+unsigned long long rng_state = 88172645463325252ULL;
+
+unsigned long long rng_next()
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+/**
+ * Writes the i-th synthetic word: a run of letters whose length varies
+ * between 6 and 15, like the vocabulary of a real index. Every i gives a
+ * different word, and absent words are made by changing the first letter.
+ */
+void synth_word(long i, char *word)
+{
+    int len = 6 + (i * 7919) % 10;
+    word[0] = 'w';
+    for (int k = len - 1; k >= 1; k--)
+    {
+        word[k] = 'a' + i % 26;
+        i /= 26;
+    }
+    word[len] = '\0';
+}
+
+/**
+ * Walks the list for the word, as get_word does.
+ */
+Node *list_find(Node *head, const char *word)
+{
+    while (head != NULL && strcmp(node_word(head), word) != 0)
+    {
+        head = head->next;
+    }
+    return head;
+}
+
+/**
+ * Looks up nqueries words, half of them absent, with the given method,
+ * and returns the average nanoseconds per lookup. The number of words
+ * found is stored in found, so that the lookups can not be optimised away.
+ */
+double time_lookups(int method, Node *head, const WordTable *table, long nwords,
+                    long nqueries, long *found)
+{
+    char word[32];
+    *found = 0;
+    rng_state = 88172645463325252ULL;
+
+    long long started = monotonic_us();
+    for (long q = 0; q < nqueries; q++)
+    {
+        unsigned long long r = rng_next();
+        synth_word(r % nwords, word);
+        if (r & (1ULL << 40))
+        {
+            word[0] = 'x';
+        }
+
+        Node *node;
+        if (method == 0)
+        {
+            node = list_find(head, word);
+        }
+        else if (method == 1)
+        {
+            node = wt_find_scalar(table, word);
+        }
+        else
+        {
+            node = wt_find(table, word);
+        }
+        *found += node != NULL;
+    }
+    return (monotonic_us() - started) * 1000.0 / nqueries;
+}
+
+int main(int argc, char **argv)
+{
+    long nwords = 1000000;
+    long nqueries = 2000000;
+    long nlist = 200;
+    char ch;
+
+    while ((ch = getopt(argc, argv, "W:Q:L:")) != -1)
+    {
+        switch (ch)
+        {
+        case 'W':
+            nwords = atol(optarg);
+            break;
+        case 'Q':
+            nqueries = atol(optarg);
+            break;
+        case 'L':
+            nlist = atol(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: lookupbench [-W WORDS] [-Q TABLE_QUERIES] [-L LIST_QUERIES]\n");
+            exit(1);
+        }
+    }
+    if (nwords <= 0 || nqueries <= 0 || nlist <= 0)
+    {
+        fprintf(stderr, "lookupbench: every count must be positive\n");
+        exit(1);
+    }
+
+    // the list is built back to front, so its order does not matter.
+    char word[32];
+    Node *head = NULL;
+    for (long i = 0; i < nwords; i++)
+    {
+        synth_word(i, word);
+        Node *node = create_node(word, 1, 0);
+        node->next = head;
+        head = node;
+    }
+
+    long long started = monotonic_us();
+    WordTable *table = wt_build(head);
+    printf("words=%ld\n", nwords);
+    printf("table.build_us=%lld\n", monotonic_us() - started);
+
+    // walking a long list is slow enough that far fewer lookups do.
+    long found;
+    double ns = time_lookups(0, head, table, nwords, nlist, &found);
+    printf("list.queries=%ld list.found=%ld list.ns_per_lookup=%.1f\n", nlist, found, ns);
+    ns = time_lookups(1, head, table, nwords, nqueries, &found);
+    printf("scalar.queries=%ld scalar.found=%ld scalar.ns_per_lookup=%.1f\n", nqueries, found, ns);
+    ns = time_lookups(2, head, table, nwords, nqueries, &found);
+    printf("vector.queries=%ld vector.found=%ld vector.ns_per_lookup=%.1f\n", nqueries, found, ns);
+#ifdef __SSE2__
+    printf("vector.isa=sse2\n");
+#else
+    printf("vector.isa=none\n");
+#endif
+
+    wt_free(table);
+    return 0;
+}
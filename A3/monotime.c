@@ -0,0 +1,15 @@
+#include <time.h>
+
+#include "monotime.h"
+
+long long monotonic_ms()
+{
+    return monotonic_us() / 1000;
+}
+
+long long monotonic_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
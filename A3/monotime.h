@@ -0,0 +1,16 @@
+#ifndef MONOTIME_H
+#define MONOTIME_H
+
+/**
+ * Returns the current time of the monotonic clock in milliseconds.
+ * Only useful for measuring intervals.
+ */
+long long monotonic_ms();
+
+/**
+ * Returns the current time of the monotonic clock in microseconds.
+ * Only useful for measuring intervals.
+ */
+long long monotonic_us();
+
+#endif /* MONOTIME_H */
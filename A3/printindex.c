@@ -2,18 +2,252 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <getopt.h>
+#include <sys/stat.h>
 
 #include "freq_list.h"
 
+/* Size of the stdio buffers used for reading the index and for output. */
+#define IO_BUFSIZE (1 << 20)
+
+/* Default number of words listed by --stats. */
+#define TOP_WORDS 10
+
+/* A word and its number of postings, kept for the --stats listing. */
+typedef struct {
+    char *word;
+    int postings;
+    long long occurrences;
+} WordCount;
+
+/* Reads an index sequentially, without building the linked list. The
+* words section and the postings section are read in step through two
+* separate streams, so only the current word is ever held in memory.
+* Both sections are checksummed on the way, and checked against the
+* header once the last entry has been read.
+*/
+typedef struct {
+    FILE *words_fp;
+    FILE *postings_fp;
+    IndexHeader header;
+    unsigned int next;
+    char *word;
+    unsigned int wordcap;
+    long long file_bytes;
+    unsigned int words_checksum;
+    unsigned int postings_checksum;
+} IndexReader;
+
+static FILE *open_buffered(char *listfile) {
+    FILE *fp;
+    if ((fp = fopen(listfile, "r")) == NULL) {
+        perror(listfile);
+        exit(1);
+    }
+    if (setvbuf(fp, NULL, _IOFBF, IO_BUFSIZE) != 0) {
+        perror("setvbuf");
+    }
+    return fp;
+}
+
+void open_index(IndexReader *r, char *listfile) {
+    memset(r, 0, sizeof(IndexReader));
+    r->words_fp = open_buffered(listfile);
+
+    if (fread(&r->header, sizeof(IndexHeader), 1, r->words_fp) != 1 || !valid_header(&r->header)) {
+        fprintf(stderr, "%s: not an index file, an old one, or a corrupt one; run indexer again\n",
+                listfile);
+        exit(1);
+    }
+    r->words_checksum = CHECKSUM_INIT;
+    r->postings_checksum = CHECKSUM_INIT;
+
+    struct stat sbuf;
+    if (fstat(fileno(r->words_fp), &sbuf) == -1) {
+        perror(listfile);
+        exit(1);
+    }
+    r->file_bytes = sbuf.st_size;
+
+    r->postings_fp = open_buffered(listfile);
+    if (fseek(r->postings_fp, sizeof(IndexHeader) + (long)r->header.words_bytes, SEEK_SET) == -1) {
+        perror(listfile);
+        exit(1);
+    }
+}
+
+/* Reads the next entry of the index into entry, and its word into
+* r->word. Returns 0 once every entry has been read.
+*/
+int next_entry(IndexReader *r, IndexEntry *entry) {
+    if (r->next == r->header.nwords) {
+        if (r->words_checksum != r->header.words_checksum ||
+            r->postings_checksum != r->header.postings_checksum) {
+            fprintf(stderr, "printindex: index does not match its checksums\n");
+            exit(1);
+        }
+        return 0;
+    }
+    if (fread(entry, sizeof(IndexEntry), 1, r->postings_fp) != 1) {
+        fprintf(stderr, "printindex: truncated postings section\n");
+        exit(1);
+    }
+    if (entry->wordlen + 1 > r->wordcap) {
+        r->wordcap = entry->wordlen + 1 > 2 * r->wordcap ? entry->wordlen + 1 : 2 * r->wordcap;
+        if ((r->word = realloc(r->word, r->wordcap)) == NULL) {
+            perror("realloc for word");
+            exit(1);
+        }
+    }
+
+    /* Entries are in the same order as the words, so the words stream
+    * only moves forward.
+    */
+    if (fread(r->word, entry->wordlen + 1, 1, r->words_fp) != 1 ||
+        r->word[entry->wordlen] != '\0') {
+        fprintf(stderr, "printindex: truncated or corrupt words section\n");
+        exit(1);
+    }
+    r->words_checksum = checksum(r->words_checksum, r->word, entry->wordlen + 1);
+    r->postings_checksum = checksum(r->postings_checksum, entry, sizeof(IndexEntry));
+    r->next++;
+    return 1;
+}
+
+void close_index(IndexReader *r) {
+    fclose(r->words_fp);
+    fclose(r->postings_fp);
+    free(r->word);
+}
+
+/* Print every word followed by how often it occurs in every file, in the
+* same format as display_list. With compact set, only the files the word
+* occurs in are listed.
+*/
+void dump_index(IndexReader *r, char **filenames, int compact) {
+    IndexEntry entry;
+    int i;
+
+    while (next_entry(r, &entry)) {
+        fputs(r->word, stdout);
+        putchar('\n');
+        for (i = 0; i < MAXFILES; i++) {
+            if (filenames[i] == NULL) {
+                putchar('\n');
+                break;
+            }
+            if (!compact || entry.freq[i] > 0) {
+                printf("    %d %s ", entry.freq[i], filenames[i]);
+            }
+        }
+    }
+}
+
+/* Insert the word into the array of the top n words by postings,
+* sorted from the most postings down, if it belongs there.
+*/
+static void keep_top(WordCount *top, int n, const char *word, int postings, long long occurrences) {
+    int i = n - 1;
+    if (top[i].word != NULL && (top[i].postings > postings ||
+        (top[i].postings == postings && top[i].occurrences >= occurrences))) {
+        return;
+    }
+    free(top[i].word);
+
+    while (i > 0 && (top[i - 1].word == NULL || top[i - 1].postings < postings ||
+           (top[i - 1].postings == postings && top[i - 1].occurrences < occurrences))) {
+        top[i] = top[i - 1];
+        i--;
+    }
+    top[i].word = strdup(word);
+    top[i].postings = postings;
+    top[i].occurrences = occurrences;
+}
+
+/* Print summary statistics of the index as key=value lines, followed by
+* the ntop words with the most postings.
+*/
+void print_stats(IndexReader *r, char *namefile, char **filenames, int ntop) {
+    IndexEntry entry;
+    long long postings = 0;
+    long long occurrences = 0;
+    int nfiles = 0;
+    int i;
+
+    WordCount *top = calloc(ntop, sizeof(WordCount));
+    if (top == NULL) {
+        perror("calloc for top words");
+        exit(1);
+    }
+
+    while (filenames[nfiles] != NULL && nfiles < MAXFILES) {
+        nfiles++;
+    }
+
+    while (next_entry(r, &entry)) {
+        int count = 0;
+        long long total = 0;
+        for (i = 0; i < MAXFILES; i++) {
+            if (entry.freq[i] > 0) {
+                count++;
+                total += entry.freq[i];
+            }
+        }
+        postings += count;
+        occurrences += total;
+        keep_top(top, ntop, r->word, count, total);
+    }
+
+    long long names_bytes = 0;
+    struct stat sbuf;
+    if (stat(namefile, &sbuf) == 0) {
+        names_bytes = sbuf.st_size;
+    }
+
+    long long postings_bytes = (long long)r->header.nwords * sizeof(IndexEntry);
+    printf("files=%d\n", nfiles);
+    printf("vocabulary=%u\n", r->header.nwords);
+    printf("postings=%lld\n", postings);
+    printf("occurrences=%lld\n", occurrences);
+    printf("postings_per_word=%.2f\n", r->header.nwords ? (double)postings / r->header.nwords : 0.0);
+    printf("generation=%u\n", r->header.generation);
+    printf("bytes.header=%zu\n", sizeof(IndexHeader));
+    printf("bytes.words=%u\n", r->header.words_bytes);
+    printf("bytes.postings=%lld\n", postings_bytes);
+    printf("bytes.index=%lld\n", r->file_bytes);
+    printf("bytes.filenames=%lld\n", names_bytes);
+
+    for (i = 0; i < ntop && top[i].word != NULL; i++) {
+        printf("top.%d=%s postings=%d occurrences=%lld\n",
+               i + 1, top[i].word, top[i].postings, top[i].occurrences);
+        free(top[i].word);
+    }
+    free(top);
+}
+
+/* Print the contents of an index, one word at a time (with --compact,
+* leaving out the files a word does not occur in), or with --stats,
+* a summary of it. The index is streamed from disk, so memory use does
+* not grow with the size of the index.
+*/
 int main(int argc, char **argv) {
-    Node *head = NULL;
     char **filenames = init_filenames();
-    char arg;
+    int arg;
     char *listfile = "index";
     char *namefile = "filenames";
+    int stats = 0;
+    int compact = 0;
+    int ntop = TOP_WORDS;
+
+    static struct option long_options[] = {
+        {"stats", no_argument, NULL, 's'},
+        {"top", required_argument, NULL, 'k'},
+        {"compact", no_argument, NULL, 'c'},
+        {NULL, 0, NULL, 0}
+    };
 
     /* an example of using getop to process command-line flags and arguments */
-    while ((arg = getopt(argc,argv,"i:n:")) > 0) {
+    while ((arg = getopt_long(argc, argv, "i:n:sck:", long_options, NULL)) != -1) {
         switch(arg) {
         case 'i':
             listfile = optarg;
@@ -21,14 +255,35 @@ int main(int argc, char **argv) {
         case 'n':
             namefile = optarg;
             break;
+        case 's':
+            stats = 1;
+            break;
+        case 'c':
+            compact = 1;
+            break;
+        case 'k':
+            ntop = atoi(optarg) > 0 ? atoi(optarg) : TOP_WORDS;
+            break;
         default:
-            fprintf(stderr, "Usage: printindex [-i FILE] [-n FILE]\n");
+            fprintf(stderr, "Usage: printindex [-i FILE] [-n FILE] [--compact | --stats [--top N]]\n");
             exit(1);
         }
     }
 
-    read_list(listfile, namefile, &head, filenames);
-    display_list(head, filenames);
+    if (setvbuf(stdout, NULL, _IOFBF, IO_BUFSIZE) != 0) {
+        perror("setvbuf");
+    }
+
+    IndexReader reader;
+    open_index(&reader, listfile);
+    read_filenames(namefile, filenames, &reader.header);
+
+    if (stats) {
+        print_stats(&reader, namefile, filenames, ntop);
+    } else {
+        dump_index(&reader, filenames, compact);
+    }
 
+    close_index(&reader);
     return 0;
 }
@@ -3,6 +3,8 @@
 #include <string.h>
 #include <ctype.h>
 
+#include "punc.h"
+
 char *remove_punc(char *word) {
     char *result;
     int i = 0;
@@ -34,3 +36,18 @@ char *remove_punc(char *word) {
     }
     return result;
 }
+
+/* Normalizes a word the way the indexer does before adding it to an
+ * index. Returns a newly allocated normalized word, or NULL if no index
+ * can hold the word.
+ */
+char *normalize_word(char *word) {
+    char *result = remove_punc(word);
+
+    /* the indexer splits lines on blanks, so no indexed word has any */
+    if (strlen(result) < MIN_WORD_LENGTH || isdigit(*result) || strpbrk(result, " \t\r\n") != NULL) {
+        free(result);
+        return NULL;
+    }
+    return result;
+}
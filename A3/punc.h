@@ -0,0 +1,20 @@
+#ifndef PUNC_H
+#define PUNC_H
+
+/* Words shorter than this are never indexed. */
+#define MIN_WORD_LENGTH 4
+
+/* Returns a newly allocated copy of word in lowercase, with punctuation
+ * stripped from its start and punctuation and whitespace from its end.
+ */
+char *remove_punc(char *word);
+
+/* Normalizes a word the way the indexer does before adding it to an
+ * index, so that the indexer and the query master agree on every rule.
+ * Returns a newly allocated normalized word, or NULL if no index can
+ * hold the word: it is shorter than MIN_WORD_LENGTH once normalized,
+ * starts with a digit, or has whitespace inside it.
+ */
+char *normalize_word(char *word);
+
+#endif /* PUNC_H */
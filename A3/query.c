@@ -8,218 +8,1573 @@
 
 #include "freq_list.h"
 #include "worker.h"
+#include "discover.h"
+#include "wire.h"
+#include "punc.h"
 #include <fcntl.h>
 #include <errno.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/socket.h>
 
-/* A program to model calling run_worker and to test it. Notice that run_worker
- * produces binary output, so the output from this program to STDOUT will 
- * not be human readable.  You will need to work out how to save it and view 
- * it (or process it) so that you can confirm that your run_worker 
- * is working properly.
+// delay before respawning a worker after its first failure. Doubles
+// for every consecutive failure, up to RESPAWN_MAX_MS.
+#define RESPAWN_BASE_MS 50
+#define RESPAWN_MAX_MS 10000
+
+// number of consecutive failures after which a query stops waiting for
+// a directory to come back, and answers without it.
+#define RESPAWN_QUERY_RETRIES 3
+
+// number of recent answer times kept per directory to decide when
+// to hedge, and how many are needed before hedging at all.
+#define LATENCY_WINDOW 64
+#define LATENCY_MIN_SAMPLES 8
+
+// set by the SIGCHLD handler when a worker needs to be reaped.
+static volatile sig_atomic_t child_exited = 0;
+
+void on_sigchld(int sig)
+{
+    child_exited = 1;
+}
+
+// set by the SIGUSR1 handler when the worker metrics should be dumped.
+static volatile sig_atomic_t metrics_requested = 0;
+
+void on_sigusr1(int sig)
+{
+    metrics_requested = 1;
+}
+
+/**
+ * Master-side bookkeeping for a single running worker.
+ */
+typedef struct
+{
+    Worker *worker;
+
+    // the shard (directory) this worker is a replica of. A pool worker
+    // is a replica of every pooled shard, and this is the shard of the
+    // last task it was sent.
+    int shard;
+
+    // number of queries sent to this worker that it has not
+    // finished answering (sent a sentinel for) yet.
+    int owed;
+
+    // the id of the last query sent to this worker.
+    int round;
+
+    // records for the current query, held back until the sentinel
+    // arrives so that a worker missing the deadline never contributes
+    // half an answer. A remote node answers with up to MAXRECORDS
+    // records, merged from all of its own workers.
+    FreqRecord pending[MAXRECORDS];
+    int npending;
+
+    // set while the worker is dead and waiting to be respawned.
+    int degraded;
+
+    // number of consecutive failures of this worker.
+    int failures;
+
+    // when the worker should be respawned, if degraded.
+    long long respawn_at;
+
+    // when the current query was sent to the worker, in microseconds.
+    long long sent_at;
+} WorkerSlot;
+
+/**
+ * Master-side bookkeeping for an index directory (or a remote node),
+ * which is searched by one or more replica workers. The replicas of
+ * a shard are consecutive in the array of slots.
+ *
+ * With a worker pool, a shard is instead a slice of a directory, and its
+ * replicas are the whole pool: any idle pool worker can search it.
+ */
+typedef struct
+{
+    int first;
+    int nreplicas;
+
+    // set if the replicas are the shared worker pool, which searches
+    // the given slice, and the name the shard is reported under.
+    int pooled;
+    int slice;
+    char *label;
+
+    // set once a replica has answered the current query.
+    int answered;
+
+    // how long the answer to the current query took, in microseconds.
+    long long answer_us;
+
+    // when to send a hedged duplicate of the current query to another
+    // replica, in microseconds, or 0 if it should not be hedged.
+    long long hedge_at;
+
+    // the replica to try first for the next query.
+    int next;
+
+    // ring buffer of the most recent answer times.
+    long long latencies[LATENCY_WINDOW];
+    int nlatencies;
+    int latpos;
+} Shard;
+
+/**
+ * The query currently being answered by the workers.
+ */
+typedef struct
+{
+    int id;
+    int active;
+    int nanswered;
+    long long started;
+    long long started_us;
+    char *word;
+
+    // number of later repeats of the word in the same batch, which are
+    // answered from a copy of this answer.
+    int repeats;
+} QueryRound;
+
+/**
+ * An answer kept for the repeats of its word later in a batch of input,
+ * so that they are answered without asking the workers again. Both the
+ * records and the text printed for them are kept, the answer being
+ * printed or sent as it was the first time. The text stops short of the
+ * markers, since the workers' timings were for the first answer only.
+ */
+typedef struct repeat_answer
+{
+    char *word;
+    FreqRecord *records;
+    int nrecords;
+    char *text;
+    size_t textlen;
+
+    // repeats still to be answered.
+    int refs;
+    struct repeat_answer *next;
+} RepeatAnswer;
+
+/**
+ * Everything the master needs to answer queries with its workers.
+ */
+typedef struct
+{
+    Worker **workers;
+    WorkerSlot *slots;
+    int nworkers;
+    Shard *shards;
+    int nshards;
+    WorkerPoll *poll;
+    MasterArray *master;
+    QueryRound round;
+
+    // deadline of every query in milliseconds, or 0 for none.
+    int deadline;
+
+    // whether answers are followed by timing markers.
+    int markers;
+
+    // number of records in every provisional answer printed while
+    // the workers are still answering, or 0 to only print final answers.
+    int provisional;
+
+    // percentile of recent answer times after which a query is
+    // duplicated to another replica, or 0 to never hedge.
+    int hedge_pct;
+
+    // where worker metrics are dumped to ("-" for standard error), every
+    // how many seconds (0 for only on SIGUSR1), and when they are next due
+    // in milliseconds.
+    const char *metrics_file;
+    int metrics_interval;
+    long long metrics_at;
+
+    // where answers are written to, and whether they are written as
+    // record frames for a coordinator instead of as text.
+    int out;
+    int framed;
+
+    // answers kept for words repeated later in the input.
+    RepeatAnswer *repeats;
+} QueryMaster;
+
+/**
+ * A query word read from the input, normalized the way the indexer
+ * normalizes words (see normalize_word). The word is NULL if it can not
+ * be in any index. A word that repeats an earlier word of its batch is
+ * answered with a copy of the earlier answer, and the earlier word counts
+ * how many such repeats it has.
+ */
+typedef struct
+{
+    char *word;
+    int repeat;
+    int repeats;
+} QueuedWord;
+
+/**
+ * A FIFO of query words read from the input that have not been
+ * sent to the workers yet.
+ */
+typedef struct
+{
+    QueuedWord *words;
+    int head;
+    int len;
+    int cap;
+
+    // where the batch of words being read starts. Repeats are only
+    // looked for within a batch, so that pushing a word stays cheap.
+    int batch;
+} WordQueue;
+
+/**
+ * Starts a new batch of words: those read from the input at once.
+ */
+void wq_start_batch(WordQueue *q)
+{
+    q->batch = q->len;
+}
+
+void wq_push(WordQueue *q, char *word)
+{
+    // reclaim the space of words that were already popped.
+    if (q->head > 0 && q->len == q->cap)
+    {
+        memmove(q->words, &q->words[q->head], sizeof(q->words[0]) * (q->len - q->head));
+        q->len -= q->head;
+        q->batch = q->batch > q->head ? q->batch - q->head : 0;
+        q->head = 0;
+    }
+    if (q->len == q->cap)
+    {
+        q->cap = q->cap ? q->cap * 2 : 16;
+        q->words = panic_realloc(q->words, sizeof(q->words[0]) * q->cap);
+    }
+
+    QueuedWord *queued = &q->words[q->len];
+    queued->word = normalize_word(word);
+    queued->repeat = 0;
+    queued->repeats = 0;
+    q->len++;
+
+    // words that can not match are never sent anyway.
+    for (int i = q->batch > q->head ? q->batch : q->head; queued->word != NULL && i < q->len - 1; i++)
+    {
+        if (!q->words[i].repeat && q->words[i].word != NULL && strcmp(q->words[i].word, queued->word) == 0)
+        {
+            q->words[i].repeats++;
+            queued->repeat = 1;
+            break;
+        }
+    }
+}
+
+int wq_empty(const WordQueue *q)
+{
+    return q->head == q->len;
+}
+
+/**
+ * Pops the oldest word off the queue. The caller owns the word.
+ */
+QueuedWord wq_pop(WordQueue *q)
+{
+    return q->words[q->head++];
+}
+
+/**
+ * Reads whatever is available from fd, and pushes every complete line
+ * onto the queue as a batch, with trailing whitespace stripped. Incomplete lines
+ * are kept in buf (holding *buflen bytes) until the rest arrives.
+ *
+ * Returns 0 once the input reaches EOF, 1 otherwise.
+ */
+int read_queries(int fd, char *buf, int *buflen, WordQueue *q)
+{
+    wq_start_batch(q);
+    int nbytes = read(fd, buf + *buflen, MAXLINE - 1 - *buflen);
+    if (nbytes == -1 && (errno == EINTR || errno == EAGAIN))
+    {
+        return 1;
+    }
+    if (nbytes > 0)
+    {
+        *buflen += nbytes;
+    }
+    buf[*buflen] = '\0';
+
+    // a line too long to fit in the buffer is treated as complete.
+    int eof = nbytes <= 0;
+    char *line = buf;
+    char *newline;
+    while ((newline = strchr(line, '\n')) != NULL || ((eof || *buflen == MAXLINE - 1) && *line != '\0'))
+    {
+        if (newline == NULL)
+        {
+            newline = buf + *buflen;
+        }
+        *newline = '\0';
+
+        int length = strlen(line);
+        while (length > 0 && (line[length - 1] == '\r' || line[length - 1] == ' ' || line[length - 1] == '\t'))
+        {
+            line[--length] = '\0';
+        }
+        if (length > 0)
+        {
+            wq_push(q, line);
+        }
+
+        line = newline < buf + *buflen ? newline + 1 : newline;
+    }
+
+    *buflen -= line - buf;
+    memmove(buf, line, *buflen);
+    return !eof;
+}
+
+/**
+ * Reads whatever is available from fd, and pushes the word of every
+ * complete query frame (see wire.h) onto the queue as a batch. Incomplete frames are kept in buf
+ * (holding *buflen bytes) until the rest arrives.
+ *
+ * Returns 0 once the input reaches EOF or is malformed, 1 otherwise.
+ */
+int read_query_frames(int fd, char *buf, int *buflen, WordQueue *q)
+{
+    wq_start_batch(q);
+    int nbytes = read(fd, buf + *buflen, MAXLINE + sizeof(uint32_t) - *buflen);
+    if (nbytes == -1 && (errno == EINTR || errno == EAGAIN))
+    {
+        return 1;
+    }
+    if (nbytes <= 0)
+    {
+        return 0;
+    }
+    *buflen += nbytes;
+
+    char word[MAXLINE + 1];
+    int offset = 0;
+    int consumed;
+    while ((consumed = wire_parse_query(buf + offset, *buflen - offset, word, sizeof(word))) > 0)
+    {
+        wq_push(q, word);
+        offset += consumed;
+    }
+
+    *buflen -= offset;
+    memmove(buf, buf + offset, *buflen);
+    return consumed != -1;
+}
+
+/**
+ * Returns the directory (or node) searched by the given shard.
+ */
+const char *shard_path(const QueryMaster *m, const Shard *shard)
+{
+    return shard->label != NULL ? shard->label : worker_path(m->slots[shard->first].worker);
+}
+
+/**
+ * Returns whether the i-th worker has been sent the current query and
+ * still owes its answer.
+ */
+int slot_inflight(const QueryMaster *m, int i)
+{
+    const WorkerSlot *slot = &m->slots[i];
+    return m->round.active && !slot->degraded && slot->owed > 0 && slot->round == m->round.id;
+}
+
+/**
+ * Returns whether a replica of the s-th shard has been sent the current
+ * query for that shard, and still owes its answer.
+ */
+int shard_inflight(const QueryMaster *m, int s)
+{
+    const Shard *shard = &m->shards[s];
+    for (int i = shard->first; i < shard->first + shard->nreplicas; i++)
+    {
+        if (slot_inflight(m, i) && m->slots[i].shard == s)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Sends the word of the current query for the s-th shard to the
+ * i-th worker.
+ */
+void send_round(QueryMaster *m, int i, int s)
+{
+    WorkerSlot *slot = &m->slots[i];
+    slot->shard = s;
+
+    if (m->shards[s].pooled)
+    {
+        worker_send_task(slot->worker, m->shards[s].slice, m->round.word);
+    }
+    else
+    {
+        worker_send(slot->worker, m->round.word);
+    }
+    slot->owed++;
+    slot->round = m->round.id;
+    slot->npending = 0;
+    slot->sent_at = monotonic_us();
+}
+
+/**
+ * Picks a live, idle replica of the shard, rotating between them so that
+ * queries are spread across replicas. A replica still owing answers to
+ * earlier queries, which missed their deadline or were answered first by
+ * another replica, is skipped rather than sent more work: the shard waits
+ * for a replica to be idle again instead. Returns -1 if there is none.
+ */
+int pick_replica(QueryMaster *m, Shard *shard)
+{
+    for (int k = 0; k < shard->nreplicas; k++)
+    {
+        int i = shard->first + (shard->next + k) % shard->nreplicas;
+        WorkerSlot *slot = &m->slots[i];
+        if (!slot->degraded && slot->owed == 0)
+        {
+            shard->next = (i - shard->first + 1) % shard->nreplicas;
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Returns the number of microseconds after which a query to this shard
+ * should be hedged: the configured percentile of its recent answer times.
+ * Returns 0 if hedging is disabled or there are too few samples.
+ */
+long long hedge_delay(const QueryMaster *m, const Shard *shard)
+{
+    if (m->hedge_pct <= 0 || shard->nreplicas < 2 || shard->nlatencies < LATENCY_MIN_SAMPLES)
+    {
+        return 0;
+    }
+
+    // the window is tiny, so an insertion sort of a copy is cheap enough.
+    long long sorted[LATENCY_WINDOW];
+    int n = shard->nlatencies;
+    for (int i = 0; i < n; i++)
+    {
+        long long v = shard->latencies[i];
+        int j = i;
+        while (j > 0 && sorted[j - 1] > v)
+        {
+            sorted[j] = sorted[j - 1];
+            j--;
+        }
+        sorted[j] = v;
+    }
+
+    int k = (n * m->hedge_pct + 99) / 100 - 1;
+    if (k < 0)
+    {
+        k = 0;
+    }
+    return sorted[k < n ? k : n - 1] + 1;
+}
+
+/**
+ * Sends the current query to one replica of the s-th shard, and schedules
+ * its hedge. Returns -1 if no replica can take it right now.
+ */
+int dispatch_shard(QueryMaster *m, int s)
+{
+    Shard *shard = &m->shards[s];
+    int i = pick_replica(m, shard);
+    if (i == -1)
+    {
+        return -1;
+    }
+
+    send_round(m, i, s);
+    long long delay = hedge_delay(m, shard);
+    shard->hedge_at = delay > 0 ? monotonic_us() + delay : 0;
+    return 0;
+}
+
+/**
+ * Hands the shards still waiting for the current query to idle replicas.
+ * Pooled shards go to whichever pool worker finishes first, so a slow
+ * slice never holds up the others, and other shards to the first of
+ * their replicas to finish the queries it still owed.
+ */
+void dispatch_waiting(QueryMaster *m)
+{
+    int pool_busy = 0;
+    for (int s = 0; m->round.active && s < m->nshards; s++)
+    {
+        Shard *shard = &m->shards[s];
+        if (shard->answered || shard_inflight(m, s) || (shard->pooled && pool_busy))
+        {
+            continue;
+        }
+        if (dispatch_shard(m, s) == -1 && shard->pooled)
+        {
+            pool_busy = 1;
+        }
+    }
+}
+
+/**
+ * Sends the word to one live replica of every shard, and starts timing
+ * the query. The round takes ownership of the word. The answer is kept
+ * for the given number of repeats of the word.
+ */
+void start_round(QueryMaster *m, char *word, int repeats)
+{
+    QueryRound *round = &m->round;
+    round->id++;
+    round->repeats = repeats;
+    round->active = 1;
+    round->nanswered = 0;
+    round->started = monotonic_ms();
+    round->started_us = monotonic_us();
+    free(round->word);
+    round->word = word;
+
+    for (int i = 0; i < m->nworkers; i++)
+    {
+        m->slots[i].npending = 0;
+    }
+
+    for (int s = 0; s < m->nshards; s++)
+    {
+        m->shards[s].answered = 0;
+        m->shards[s].hedge_at = 0;
+    }
+
+    // shards with no idle replica are sent the query once one is
+    // respawned or idle again, and pooled shards once a pool worker is.
+    for (int s = 0; s < m->nshards; s++)
+    {
+        dispatch_shard(m, s);
+    }
+}
+
+/**
+ * Sends a hedged duplicate of the current query to another replica of
+ * every shard that has not answered within its hedge delay.
+ */
+void hedge_round(QueryMaster *m)
+{
+    long long now = monotonic_us();
+    for (int s = 0; s < m->nshards; s++)
+    {
+        Shard *shard = &m->shards[s];
+        if (!m->round.active || shard->answered || shard->hedge_at == 0 || now < shard->hedge_at)
+        {
+            continue;
+        }
+
+        // each query is hedged at most once per shard.
+        shard->hedge_at = 0;
+        int i = pick_replica(m, shard);
+        if (i != -1)
+        {
+            DEBUG_PRINTF("hedging %s to replica %d\n", m->round.word, i - shard->first);
+            send_round(m, i, s);
+        }
+    }
+}
+
+/**
+ * Returns whether the current query has to wait for the shard before
+ * it can be answered. A shard whose replicas keep failing stops holding
+ * up queries, but its replicas are still respawned in the background.
+ */
+int shard_required(const QueryMaster *m, const Shard *shard)
+{
+    for (int i = shard->first; i < shard->first + shard->nreplicas; i++)
+    {
+        if (!m->slots[i].degraded || m->slots[i].failures <= RESPAWN_QUERY_RETRIES)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Returns whether every replica of the shard is degraded.
+ */
+int shard_degraded(const QueryMaster *m, const Shard *shard)
+{
+    for (int i = shard->first; i < shard->first + shard->nreplicas; i++)
+    {
+        if (!m->slots[i].degraded)
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Sends the current query to another replica of the s-th shard if it has
+ * not answered yet and no live replica is working on it.
+ */
+void failover_round(QueryMaster *m, int s)
+{
+    if (!m->round.active || m->shards[s].answered || shard_inflight(m, s))
+    {
+        return;
+    }
+    dispatch_shard(m, s);
+}
+
+/**
+ * Marks the i-th worker as dead, killing it if it is somehow still
+ * running, and schedules it to be respawned with exponential backoff.
+ * Any answer it owed is forgotten, and the query in flight is moved to
+ * another replica if there is one.
+ */
+void slot_fail(QueryMaster *m, int i)
+{
+    WorkerSlot *slot = &m->slots[i];
+    if (slot->degraded)
+    {
+        return;
+    }
+
+    fprintf(stderr, "query: worker for %s failed, marking degraded\n", worker_path(slot->worker));
+    worker_kill(slot->worker);
+
+    // stop polling on the closed pipe until the replacement is up.
+    workerp_set_worker(m->poll, i, slot->worker);
+
+    long long delay = RESPAWN_BASE_MS;
+    for (int f = 0; f < slot->failures && delay < RESPAWN_MAX_MS; f++)
+    {
+        delay *= 2;
+    }
+    if (delay > RESPAWN_MAX_MS)
+    {
+        delay = RESPAWN_MAX_MS;
+    }
+
+    slot->degraded = 1;
+    slot->failures++;
+    slot->respawn_at = monotonic_ms() + delay;
+    slot->owed = 0;
+    slot->npending = 0;
+
+    failover_round(m, slot->shard);
+}
+
+/**
+ * Reaps every worker that has exited, marking the ones that were
+ * not already known to be dead as degraded.
+ */
+void reap_workers(QueryMaster *m)
+{
+    int pid;
+    int status;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+    {
+        for (int i = 0; i < m->nworkers; i++)
+        {
+            if (worker_pid(m->slots[i].worker) == pid)
+            {
+                slot_fail(m, i);
+                break;
+            }
+        }
+    }
+}
+
+/**
+ * Respawns every degraded worker whose backoff has elapsed, resending
+ * the current query if its shard has not answered it yet and no other
+ * replica is working on it. Remote workers are reconnected instead.
+ */
+void respawn_workers(QueryMaster *m)
+{
+    long long now = monotonic_ms();
+    for (int i = 0; i < m->nworkers; i++)
+    {
+        WorkerSlot *slot = &m->slots[i];
+        if (!slot->degraded || now < slot->respawn_at)
+        {
+            continue;
+        }
+
+        fprintf(stderr, "query: respawning worker for %s\n", worker_path(slot->worker));
+        slot->degraded = 0;
+        if (worker_restart(slot->worker) == -1)
+        {
+            slot_fail(m, i);
+            continue;
+        }
+        workerp_set_worker(m->poll, i, slot->worker);
+
+        failover_round(m, slot->shard);
+    }
+}
+
+/**
+ * Prints the best records found so far for the current query, headed by
+ * how many directories they come from. Provisional answers may be
+ * followed by more of them, and always by the final answer.
+ */
+void print_provisional(const QueryMaster *m)
+{
+    const FreqRecord *records = ma_records(m->master);
+    int n = ma_count(m->master);
+    if (n > m->provisional)
+    {
+        n = m->provisional;
+    }
+
+    printf("# provisional %d of %d\n", m->round.nanswered, m->nshards);
+    for (int i = 0; i < n; i++)
+    {
+        printf("%d    %s\n", records[i].freq, records[i].filename);
+    }
+    fflush(stdout);
+}
+
+/**
+ * Handles a single record received from the i-th worker, merging the
+ * worker's answer into the master array once it is complete. Records
+ * belonging to a query that has already been answered, by this worker or
+ * by another replica, are discarded.
+ */
+void handle_record(QueryMaster *m, int i, FreqRecord *frp)
+{
+    QueryRound *round = &m->round;
+    WorkerSlot *slot = &m->slots[i];
+    Shard *shard = &m->shards[slot->shard];
+
+    // with one query outstanding, and that query being the current one,
+    // the record must belong to the current query.
+    int current = round->active && slot->owed == 1 && slot->round == round->id && !shard->answered;
+
+    if (!is_sentinel(frp))
+    {
+        if (current && slot->npending < MAXRECORDS)
+        {
+            slot->pending[slot->npending++] = *frp;
+        }
+        else if (current)
+        {
+            fprintf(stderr, "query: worker %d sent more than %d records, dropping %s\n",
+                    i, MAXRECORDS, frp->filename);
+        }
+        return;
+    }
+
+    DEBUG_PRINTF("received sentinel\n");
+    if (slot->owed > 0)
+    {
+        slot->owed--;
+    }
+    slot->failures = 0;
+    if (current)
+    {
+        for (int j = 0; j < slot->npending; j++)
+        {
+            ma_insert_record(m->master, &slot->pending[j]);
+        }
+        shard->answered = 1;
+        shard->answer_us = monotonic_us() - slot->sent_at;
+        round->nanswered++;
+
+        shard->latencies[shard->latpos] = shard->answer_us;
+        shard->latpos = (shard->latpos + 1) % LATENCY_WINDOW;
+        if (shard->nlatencies < LATENCY_WINDOW)
+        {
+            shard->nlatencies++;
+        }
+
+        // the last answer is followed straight away by the final one.
+        if (m->provisional > 0 && !m->framed && round->nanswered < m->nshards)
+        {
+            print_provisional(m);
+        }
+    }
+    slot->npending = 0;
+}
+
+/**
+ * Returns whether every shard the current query has to wait for
+ * has answered it.
  */
-int main(int argc, char **argv)
+int round_complete(const QueryMaster *m)
 {
-    char ch;
-    char path[PATHLENGTH];
-    char *startdir = ".";
+    for (int s = 0; s < m->nshards; s++)
+    {
+        if (!m->shards[s].answered && shard_required(m, &m->shards[s]))
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
 
-    /* this models using getopt to process command-line flags and arguments */
-    while ((ch = getopt(argc, argv, "d:")) != -1)
+/**
+ * Keeps the answer to the current query for its repeats. Takes ownership
+ * of the text, if any.
+ */
+void keep_answer(QueryMaster *m, const FreqRecord *records, int nrecords, char *text, size_t textlen)
+{
+    RepeatAnswer *answer = panic_malloc(sizeof(RepeatAnswer));
+    answer->word = strdup(m->round.word);
+    answer->records = panic_malloc(sizeof(FreqRecord) * (nrecords + 1));
+    memcpy(answer->records, records, sizeof(FreqRecord) * nrecords);
+    answer->nrecords = nrecords;
+    answer->text = text;
+    answer->textlen = textlen;
+    answer->refs = m->round.repeats;
+    answer->next = m->repeats;
+    m->repeats = answer;
+}
+
+/**
+ * Answers a repeat of an earlier word of its batch with a copy of the
+ * earlier answer, without asking the workers. Returns -1 if the earlier
+ * answer was not kept, in which case the word has to be asked for again.
+ *
+ * If markers are enabled, the copy is marked as cached and followed by
+ * an end marker with the time the copy took, but no worker timings,
+ * since no worker was asked.
+ */
+int answer_repeat(QueryMaster *m, const char *word)
+{
+    long long started_us = monotonic_us();
+    RepeatAnswer **prev = &m->repeats;
+    while (*prev != NULL && strcmp((*prev)->word, word) != 0)
     {
-        switch (ch)
+        prev = &(*prev)->next;
+    }
+    RepeatAnswer *answer = *prev;
+    if (answer == NULL)
+    {
+        return -1;
+    }
+
+    if (m->framed)
+    {
+        wire_send_records(m->out, answer->records, answer->nrecords);
+    }
+    else
+    {
+        fwrite(answer->text, 1, answer->textlen, stdout);
+        if (m->markers)
         {
-        case 'd':
-            startdir = optarg;
-            break;
-        default:
-            fprintf(stderr, "Usage: queryone [-d DIRECTORY_NAME]\n");
-            exit(1);
+            printf("# cached\n");
+            printf("# end %lld\n", monotonic_us() - started_us);
+        }
+        if (m->provisional > 0)
+        {
+            printf("# final\n");
         }
+        fflush(stdout);
     }
 
-    // Open the directory provided by the user (or current working directory)
-    DIR *dirp;
-    if ((dirp = opendir(startdir)) == NULL)
+    if (--answer->refs == 0)
     {
-        perror("opendir");
-        exit(1);
+        *prev = answer->next;
+        free(answer->word);
+        free(answer->records);
+        free(answer->text);
+        free(answer);
     }
+    return 0;
+}
 
-    /* For each entry in the directory, eliminate . and .., and check
-     * to make sure that the entry is a directory, then call run_worker
-     * to process the index file contained in the directory.
-     * Note that this implementation of the query engine iterates
-     * sequentially through the directories, and will expect to read
-     * a word from standard input for each index it checks.
-     */
-    struct dirent *dp;
+/**
+ * Answers a query for a word that can not be in any index (see
+ * normalize_word) without asking the workers. The answer is empty, but
+ * has the same markers as any other answer, so that it looks like one
+ * to a reader.
+ */
+void answer_unmatchable(QueryMaster *m)
+{
+    if (m->framed)
+    {
+        wire_send_records(m->out, NULL, 0);
+        return;
+    }
+    if (m->markers)
+    {
+        printf("# end 0\n");
+    }
+    if (m->provisional > 0)
+    {
+        printf("# final\n");
+    }
+    fflush(stdout);
+}
 
-    Worker **workers = panic_malloc(sizeof(Worker *));
+/**
+ * Prints the answer to the current query. If some directories have not
+ * answered, the answer is marked as partial and the directories that
+ * missed the deadline or are degraded are listed. Their answers will
+ * be discarded when they eventually arrive.
+ *
+ * If markers are enabled, the answer is followed by the time each directory
+ * took to answer and an end marker with the total time, in microseconds.
+ * If provisional answers are enabled, the final answer is followed by a
+ * final marker.
+ *
+ * When serving a coordinator, the answer is sent as record frames
+ * instead, and partial answers are not marked.
+ *
+ * If the word is repeated later in its batch, the answer is kept for
+ * the repeats, without its markers (see answer_repeat).
+ */
+void finish_round(QueryMaster *m)
+{
+    QueryRound *round = &m->round;
+    Shard *shards = m->shards;
+    int nshards = m->nshards;
+    const FreqRecord *records = ma_records(m->master);
+    int nrecords = ma_count(m->master);
 
-    int nworkers = 0;
-    while ((dp = readdir(dirp)) != NULL)
+    for (int i = 0; i < m->nworkers; i++)
+    {
+        m->slots[i].npending = 0;
+    }
+
+    if (m->framed)
     {
-        // do worker instantiatio here.
-        if (strcmp(dp->d_name, ".") == 0 ||
-            strcmp(dp->d_name, "..") == 0 ||
-            strcmp(dp->d_name, ".svn") == 0 ||
-            strcmp(dp->d_name, ".git") == 0)
+        // a coordinator that has gone away is noticed when reading from it.
+        wire_send_records(m->out, records, nrecords);
+        if (round->repeats > 0)
         {
-            continue;
+            keep_answer(m, records, nrecords, NULL, 0);
         }
+        ma_clear(m->master);
+        round->active = 0;
+        return;
+    }
+
+    // an answer that is kept is printed to memory first, so that its
+    // repeats print the same records and partial lines.
+    char *text = NULL;
+    size_t textlen = 0;
+    FILE *fp = stdout;
+    if (round->repeats > 0 && (fp = open_memstream(&text, &textlen)) == NULL)
+    {
+        perror("open_memstream");
+        fp = stdout;
+    }
 
-        strncpy(path, startdir, PATHLENGTH);
-        strncat(path, "/", PATHLENGTH - strlen(path));
-        strncat(path, dp->d_name, PATHLENGTH - strlen(path));
-        path[PATHLENGTH - 1] = '\0';
+    for (int i = 0; i < nrecords; i++)
+    {
+        fprintf(fp, "%d    %s\n", records[i].freq, records[i].filename);
+    }
 
-        struct stat sbuf;
-        if (stat(path, &sbuf) == -1)
+    if (round->nanswered < nshards)
+    {
+        fprintf(fp, "partial: %d of %d directories answered\n", round->nanswered, nshards);
+        for (int s = 0; s < nshards; s++)
         {
-            // This should only fail if we got the path wrong
-            // or we don't have permissions on this entry.
-            perror("stat");
-            exit(1);
+            if (shards[s].answered)
+            {
+                continue;
+            }
+            if (shard_degraded(m, &shards[s]))
+            {
+                fprintf(fp, "degraded: %s\n", shard_path(m, &shards[s]));
+            }
+            else
+            {
+                fprintf(fp, "missed deadline: %s\n", shard_path(m, &shards[s]));
+            }
+        }
+    }
+
+    if (fp != stdout)
+    {
+        fclose(fp);
+        fwrite(text, 1, textlen, stdout);
+        keep_answer(m, records, nrecords, text, textlen);
+    }
+
+    // markers let scripts find where an answer ends, and how long
+    // each directory took to answer.
+    if (m->markers)
+    {
+        for (int s = 0; s < nshards; s++)
+        {
+            if (shards[s].answered)
+            {
+                printf("# worker %s %lld\n", shard_path(m, &shards[s]), shards[s].answer_us);
+            }
         }
+        printf("# end %lld\n", monotonic_us() - round->started_us);
+    }
+    if (m->provisional > 0)
+    {
+        printf("# final\n");
+    }
+    fflush(stdout);
+    ma_clear(m->master);
+    round->active = 0;
+}
 
-        // Only call run_worker if it is a directory
-        // Otherwise ignore it.
-        if (S_ISDIR(sbuf.st_mode))
+/**
+ * Dumps the metrics of every worker (see worker_print_stats), headed by
+ * a "metrics" line with the wall clock time. A metrics file is replaced
+ * as a whole, so that a reader never sees half a dump.
+ */
+void dump_metrics(const QueryMaster *m)
+{
+    FILE *fp = stderr;
+    char tmpfile[PATHLENGTH + 8];
+    if (m->metrics_file != NULL && strcmp(m->metrics_file, "-") != 0)
+    {
+        snprintf(tmpfile, sizeof(tmpfile), "%s.tmp", m->metrics_file);
+        if ((fp = fopen(tmpfile, "w")) == NULL)
         {
+            perror(tmpfile);
+            return;
+        }
+    }
+
+    long long now = monotonic_us();
+    fprintf(fp, "metrics time=%lld workers=%d\n", (long long)time(NULL), m->nworkers);
+    for (int i = 0; i < m->nworkers; i++)
+    {
+        worker_print_stats(m->workers[i], fp, now);
+    }
+
+    if (fp == stderr)
+    {
+        fflush(fp);
+    }
+    else if (fclose(fp) != 0 || rename(tmpfile, m->metrics_file) == -1)
+    {
+        perror("query: dumping metrics");
+        unlink(tmpfile);
+    }
+}
 
-            // Check here to avoid run_worker returning errors
-            // despite repeating code.
-            char *listfile = panic_malloc(sizeof(char) * (strlen(path) + strlen("/index") + 0x20));
-            char *namefile = panic_malloc(sizeof(char) * (strlen(path) + strlen("/filenames") + 0x20));
+/**
+ * Answers every query read from the input in, until the input reaches
+ * EOF and every query read has been answered. Queries are read as lines
+ * of text, or as query frames when serving a coordinator.
+ */
+void serve_queries(QueryMaster *m, int in)
+{
+    // queries are read on the main process alongside the worker results,
+    // so that the deadline of each query can be tracked from when it is sent.
+    workerp_watch_input(m->poll, in);
 
-            sprintf(listfile, "%s/%s", path, "index");
-            sprintf(namefile, "%s/%s", path, "filenames");
+    WordQueue queue = {NULL, 0, 0, 0, 0};
+    char inbuf[MAXLINE + sizeof(uint32_t)];
+    int inlen = 0;
+    int reading = 1;
+    FreqRecord freqbuf;
+    int workerstat = 1;
+    while (reading || !wq_empty(&queue) || m->round.active)
+    {
+        // words that can not match, and repeats, are answered without
+        // asking the workers.
+        while (!m->round.active && !wq_empty(&queue))
+        {
+            QueuedWord next = wq_pop(&queue);
+            if (next.word == NULL)
+            {
+                answer_unmatchable(m);
+            }
+            else if (next.repeat && answer_repeat(m, next.word) == 0)
+            {
+                free(next.word);
+            }
+            else
+            {
+                start_round(m, next.word, next.repeats);
+            }
+        }
 
-            if (access(listfile, R_OK) == -1 || access(namefile, R_OK) == -1)
+        // wake up in time to enforce the deadline.
+        int timeout = 500;
+        long long now = monotonic_ms();
+        if (m->round.active && m->deadline > 0 && m->round.started + m->deadline - now < timeout)
+        {
+            timeout = m->round.started + m->deadline - now;
+        }
+        for (int i = 0; i < m->nworkers; i++)
+        {
+            if (m->slots[i].degraded && m->slots[i].respawn_at - now < timeout)
             {
-                perror("access: unable to access index or filenames");
-                exit(1);
+                timeout = m->slots[i].respawn_at - now;
             }
+        }
+        if (m->metrics_interval > 0 && m->metrics_at - now < timeout)
+        {
+            timeout = m->metrics_at - now;
+        }
+        for (int s = 0; m->round.active && s < m->nshards; s++)
+        {
+            if (!m->shards[s].answered && m->shards[s].hedge_at > 0 &&
+                m->shards[s].hedge_at / 1000 - now < timeout)
+            {
+                timeout = m->shards[s].hedge_at / 1000 - now;
+            }
+        }
+        if (timeout < 0)
+        {
+            timeout = 0;
+        }
 
-            // create workers...
-            workers = panic_realloc(workers, sizeof(Worker *) * (nworkers + 1));
-            workers[nworkers] = worker_create(path);
-            nworkers++;
+        for (int i = 0; i < m->nworkers; i++)
+        {
+            workerp_watch_send(m->poll, i, m->workers[i]);
+        }
+        workerp_poll_timeout(m->poll, timeout);
+
+        if (reading && workerp_check_input(m->poll) == 0)
+        {
+            int more = m->framed ? read_query_frames(in, inbuf, &inlen, &queue)
+                                 : read_queries(in, inbuf, &inlen, &queue);
+            if (!more)
+            {
+                DEBUG_PRINTF("eof received.\n");
+                reading = 0;
+                workerp_watch_input(m->poll, -1);
+            }
+        }
+
+        for (int i = 0; i < m->nworkers; i++)
+        {
+            if (m->slots[i].degraded)
+            {
+                continue;
+            }
+            if ((workerstat = workerp_check_send(m->poll, i)) == -1 ||
+                (workerstat == 0 && worker_flush(m->workers[i]) == -1))
+            {
+                slot_fail(m, i);
+                continue;
+            }
+            if ((workerstat = workerp_check_after_poll(m->poll, i)) == 0)
+            {
+                // a remote worker may have sent several records at once,
+                // or only part of one.
+                ssize_t nbytes;
+                do
+                {
+                    if ((nbytes = worker_recv(m->workers[i], &freqbuf)) > 0)
+                    {
+                        handle_record(m, i, &freqbuf);
+                    }
+                } while (nbytes > 0 && worker_recv_buffered(m->workers[i]));
+
+                if (nbytes != WORKER_RECV_AGAIN && nbytes <= 0)
+                {
+                    slot_fail(m, i);
+                }
+            }
+            else if (workerstat == -1)
+            {
+                slot_fail(m, i);
+            }
+        }
+
+        if (child_exited)
+        {
+            child_exited = 0;
+            reap_workers(m);
+        }
+        respawn_workers(m);
+        dispatch_waiting(m);
+        hedge_round(m);
+
+        if (metrics_requested || (m->metrics_interval > 0 && monotonic_ms() >= m->metrics_at))
+        {
+            metrics_requested = 0;
+            m->metrics_at = monotonic_ms() + m->metrics_interval * 1000LL;
+            dump_metrics(m);
+        }
+
+        if (m->round.active && (round_complete(m) ||
+                                (m->deadline > 0 && monotonic_ms() >= m->round.started + m->deadline)))
+        {
+            finish_round(m);
         }
     }
 
-    if (closedir(dirp) < 0)
+    free(queue.words);
+    free(m->round.word);
+    m->round.word = NULL;
+}
+
+/**
+ * Loads the index of every directory, cuts the indexes into slices of at
+ * most slice_words words (by default, about an even share of every word
+ * across the pool), and appends a pool of npool workers that can search
+ * any slice to the workers, and a pooled shard per slice to the shards.
+ */
+void create_pool(const DirList *dirs, int npool, int slice_words,
+                 Worker ***workers, int *nworkers, Shard **shards, int *nshards)
+{
+    Node **heads = panic_malloc(sizeof(Node *) * (dirs->n + 1));
+    char ***names = panic_malloc(sizeof(char **) * (dirs->n + 1));
+    int *sizes = panic_malloc(sizeof(int) * (dirs->n + 1));
+    long long total = 0;
+    for (int d = 0; d < dirs->n; d++)
     {
-        perror("closedir");
-        exit(1);
+        sizes[d] = load_index(dirs->paths[d], &heads[d], &names[d]);
+        total += sizes[d];
     }
 
-    // init management objects...
-    WorkerPoll *poll = workerp_create_poll(workers, nworkers);
+    int target = slice_words;
+    if (target <= 0)
+    {
+        target = (total + npool - 1) / npool;
+    }
+    if (target <= 0)
+    {
+        target = 1;
+    }
 
-    // Start workers
-    for (int i = 0; i < nworkers; i++)
+    // the slices must outlive every pool worker, respawned ones included.
+    int maxslices = 0;
+    for (int d = 0; d < dirs->n; d++)
     {
-        worker_start_run(workers[i]);
+        maxslices += sizes[d] / target + 1;
     }
+    IndexSlice *slices = panic_malloc(sizeof(IndexSlice) * (maxslices + 1));
+    int nslices = 0;
 
-    // create the non-blocking exit signaller
-    int pipefd_sentinel[2];
-    if (pipe(pipefd_sentinel) == -1)
+    *shards = panic_realloc(*shards, sizeof(Shard) * (*nshards + maxslices + 1));
+    for (int d = 0; d < dirs->n; d++)
     {
-        perror("pipe");
-        exit(1);
+        int n = split_index(heads[d], names[d], sizes[d], target, &slices[nslices]);
+        for (int k = 0; k < n; k++)
+        {
+            Shard *shard = &(*shards)[*nshards];
+            memset(shard, 0, sizeof(Shard));
+            shard->first = *nworkers;
+            shard->nreplicas = npool;
+            shard->pooled = 1;
+            shard->slice = nslices + k;
+            shard->label = panic_malloc(strlen(dirs->paths[d]) + 32);
+            if (n == 1)
+            {
+                strcpy(shard->label, dirs->paths[d]);
+            }
+            else
+            {
+                sprintf(shard->label, "%s[%d/%d]", dirs->paths[d], k + 1, n);
+            }
+            (*nshards)++;
+        }
+        nslices += n;
     }
-    fcntl(pipefd_sentinel[0], F_SETFL, O_NONBLOCK);
 
-    // fork a process to listen to STDIN
-    int pid = fork();
-    if (pid == -1)
+    *workers = panic_realloc(*workers, sizeof(Worker *) * (*nworkers + npool + 1));
+    for (int i = 0; i < npool; i++)
     {
-        perror("fork");
-        exit(1);
+        char label[32];
+        snprintf(label, sizeof(label), "pool/%d", i);
+        (*workers)[(*nworkers)++] = worker_create_pool(label, slices, nslices);
     }
-    if (pid == 0)
+
+    free(heads);
+    free(names);
+    free(sizes);
+}
+
+/* Starts a worker for every index directory in the given directory, then
+ * reads one query word per line from standard input, and prints the most
+ * frequent occurrences of that word across every directory.
+ *
+ * By default only the immediate subdirectories are searched; with -r, the
+ * whole tree is. -j scans the tree with several threads, and -c caches the
+ * directories found so that a restart can skip the scan if nothing changed.
+ *
+ * With -R N, every directory is searched by N replica workers. Each query
+ * is sent to one replica, and if it has not answered within the -H
+ * percentile (95 by default, 0 to disable) of the directory's recent
+ * answer times, a hedged duplicate is sent to another replica. The first
+ * complete answer is used.
+ *
+ * With -P N, the indexes are instead loaded up front and cut into slices
+ * of about the same number of words (at most -s WORDS each, if given),
+ * which are searched by a pool of N workers (0 for one per CPU). Every
+ * query is split into one task per slice, and idle pool workers take the
+ * next task, so the work spreads evenly across the pool however the
+ * words are spread across directories. Replicas (-R) do not apply to
+ * the pool, since any pool worker can search any slice.
+ *
+ * With -t, every query is given a deadline in milliseconds. Once it
+ * expires, the answer is printed with the results of the workers that
+ * have answered, and is marked as partial.
+ *
+ * With -e, every answer is followed by machine-readable timing lines
+ * and an end marker (see finish_round). An answer copied for a repeat
+ * of an earlier word in the same batch is marked "# cached" instead of
+ * having timing lines (see answer_repeat).
+ *
+ * With -p K, the K best records found so far are printed every time a
+ * directory answers, each batch headed by "# provisional ANSWERED of
+ * TOTAL", so that front ends can show results before the slowest
+ * directory answers. The final answer is then printed as usual, and
+ * followed by "# final".
+ *
+ * On SIGUSR1, and with -M SECONDS also periodically, the latency histogram,
+ * traffic and error counts of every worker are dumped to the file given
+ * with -m (standard error by default, or with -m -).
+ *
+ * Workers that die are reaped and respawned with exponential backoff,
+ * and are resent the query in flight. Until then, their directory is
+ * reported as degraded.
+ *
+ * Several query processes can search a corpus spread across hosts. With
+ * -l PORT, query runs as a node: instead of reading standard input, it
+ * serves its index directories to coordinators connecting on PORT, one
+ * coordinator at a time. With -n HOST:PORT[,HOST:PORT...], query runs as
+ * a coordinator, sending every query to those nodes (and to the local
+ * index directories, if -d is also given) and merging their answers.
+ */
+int main(int argc, char **argv)
+{
+    char ch;
+    char *startdir = ".";
+    int have_dir = 0;
+    int maxdepth = 1;
+    int nthreads = 1;
+    char *cachefile = NULL;
+    int port = 0;
+    char *nodes = NULL;
+    int nreplicas = 1;
+    int npool = -1;
+    int slice_words = 0;
+    QueryMaster m;
+    memset(&m, 0, sizeof(m));
+    m.out = STDOUT_FILENO;
+    m.hedge_pct = 95;
+
+    /* this models using getopt to process command-line flags and arguments */
+    while ((ch = getopt(argc, argv, "d:t:ep:rj:c:l:n:R:H:m:M:P:s:")) != -1)
     {
-        char buf[32];
-        char sentinel_value = 1;
-        int readbytes;
-        close(pipefd_sentinel[0]);
-        DEBUG_PRINTF("from sentinel process\n");
-        while ((readbytes = read(STDIN_FILENO, buf, MAXWORD)) <= MAXWORD && readbytes > 0)
+        switch (ch)
         {
-            DEBUG_PRINTF("Found data to be sent: %s\n", buf);
-            
-            // strip any newlines while sending
-            int length = strlen(buf) - 1;
-            while (length > 0 && buf[length] == '\n')
+        case 'd':
+            startdir = optarg;
+            have_dir = 1;
+            break;
+        case 't':
+            m.deadline = atoi(optarg);
+            break;
+        case 'e':
+            m.markers = 1;
+            break;
+        case 'm':
+            m.metrics_file = optarg;
+            break;
+        case 'M':
+            m.metrics_interval = atoi(optarg);
+            break;
+        case 'p':
+            m.provisional = atoi(optarg) > 0 ? atoi(optarg) : MAXRECORDS;
+            break;
+        case 'r':
+            maxdepth = DISCOVER_RECURSIVE;
+            break;
+        case 'j':
+            nthreads = atoi(optarg);
+            break;
+        case 'c':
+            cachefile = optarg;
+            break;
+        case 'l':
+            port = atoi(optarg);
+            break;
+        case 'n':
+            nodes = optarg;
+            break;
+        case 'P':
+            npool = atoi(optarg);
+            if (npool <= 0)
             {
-                buf[length--] = '\0';
+                npool = sysconf(_SC_NPROCESSORS_ONLN) > 0 ? sysconf(_SC_NPROCESSORS_ONLN) : 1;
             }
-            
+            break;
+        case 's':
+            slice_words = atoi(optarg);
+            break;
+        case 'R':
+            nreplicas = atoi(optarg) > 0 ? atoi(optarg) : 1;
+            break;
+        case 'H':
+            m.hedge_pct = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: query [-d DIRECTORY_NAME] [-t DEADLINE_MS] [-e] [-p K] [-r] [-j THREADS] [-c CACHEFILE]\n"
+                            "             [-R REPLICAS] [-H HEDGE_PERCENTILE] [-m METRICSFILE] [-M SECONDS]\n"
+                            "             [-P POOLSIZE [-s SLICE_WORDS]]\n"
+                            "             [-l PORT | -n HOST:PORT[,HOST:PORT...]]\n");
+            exit(1);
+        }
+    }
+
+    Worker **workers = panic_malloc(sizeof(Worker *));
+    int nworkers = 0;
+    Shard *shards = panic_malloc(sizeof(Shard));
+    int nshards = 0;
 
-            for (int i = 0; i < nworkers; i++)
+    // Find every index directory under the directory provided by the user
+    // (or current working directory). A coordinator only searches its own
+    // directories if asked to.
+    if (nodes == NULL || have_dir)
+    {
+        DirList *dirs = discover_index_dirs(startdir, maxdepth, nthreads, cachefile);
+        if (dirs == NULL)
+        {
+            exit(1);
+        }
+        if (npool > 0)
+        {
+            create_pool(dirs, npool, slice_words, &workers, &nworkers, &shards, &nshards);
+        }
+        else
+        {
+            workers = panic_realloc(workers, sizeof(Worker *) * (dirs->n * nreplicas + 1));
+            shards = panic_realloc(shards, sizeof(Shard) * (dirs->n + 1));
+        }
+        for (int i = 0; npool <= 0 && i < dirs->n; i++)
+        {
+            if (strlen(dirs->paths[i]) >= PATHLENGTH)
             {
-                // worker_send will null terminate the string..
-                // if bigger than 32 chars
-                worker_send(workers[i], buf);
+                fprintf(stderr, "query: %s: path too long, skipping\n", dirs->paths[i]);
+                continue;
             }
 
-            memset(buf, 0, 32);
+            // create workers...
+            memset(&shards[nshards], 0, sizeof(Shard));
+            shards[nshards].first = nworkers;
+            shards[nshards].nreplicas = nreplicas;
+            nshards++;
+            for (int r = 0; r < nreplicas; r++)
+            {
+                workers[nworkers] = worker_create(dirs->paths[i]);
+                nworkers++;
+            }
         }
+        dl_free(dirs);
+    }
 
-        DEBUG_PRINTF("eof received. freeing workers\n");
-        for (int i = 0; i < nworkers; i++)
+    // every node is searched by a remote worker.
+    for (char *node = nodes != NULL ? strtok(nodes, ",") : NULL; node != NULL; node = strtok(NULL, ","))
+    {
+        Worker *w = worker_connect(node);
+        if (w == NULL)
         {
-            worker_free(workers[i]);
+            exit(1);
         }
+        workers = panic_realloc(workers, sizeof(Worker *) * (nworkers + 1));
+        shards = panic_realloc(shards, sizeof(Shard) * (nshards + 1));
+        memset(&shards[nshards], 0, sizeof(Shard));
+        shards[nshards].first = nworkers;
+        shards[nshards].nreplicas = 1;
+        nshards++;
+        workers[nworkers] = w;
+        nworkers++;
+    }
+
+    // init management objects...
+    m.workers = workers;
+    m.nworkers = nworkers;
+    m.shards = shards;
+    m.nshards = nshards;
+    m.poll = workerp_create_poll(workers, nworkers);
+    m.metrics_at = monotonic_ms() + m.metrics_interval * 1000LL;
 
-        write(pipefd_sentinel[1], &sentinel_value, sizeof(char));
-        DEBUG_PRINTF("wrote end signal to main process\n");
-        exit(0);
+    // a dead worker is noticed through SIGCHLD or its closed pipe,
+    // so writing to it must not kill the master.
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_sigchld;
+    sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGCHLD, &sa, NULL) == -1)
+    {
+        perror("sigaction");
+        exit(1);
+    }
+    sa.sa_handler = on_sigusr1;
+    sa.sa_flags = SA_RESTART;
+    if (sigaction(SIGUSR1, &sa, NULL) == -1)
+    {
+        perror("sigaction");
+        exit(1);
     }
+    signal(SIGPIPE, SIG_IGN);
 
-    close(pipefd_sentinel[1]);
+    // Start workers
+    m.slots = panic_malloc(sizeof(WorkerSlot) * (nworkers + 1));
+    memset(m.slots, 0, sizeof(WorkerSlot) * (nworkers + 1));
+    for (int s = 0; s < nshards; s++)
+    {
+        for (int i = shards[s].first; i < shards[s].first + shards[s].nreplicas; i++)
+        {
+            m.slots[i].shard = s;
+        }
+    }
+    for (int i = 0; i < nworkers; i++)
+    {
+        m.slots[i].worker = workers[i];
+        if (worker_start_run(workers[i]) == -1)
+        {
+            slot_fail(&m, i);
+            continue;
+        }
+        workerp_set_worker(m.poll, i, workers[i]);
+    }
 
     // main process handles the master array
-    MasterArray *master = ma_init();
+    m.master = ma_init();
 
-    char quit = 0;
-    FreqRecord freqbuf;
-    int workerstat = 1;
-    int sentinel_count = 0;
-    while ((read(pipefd_sentinel[0], &quit, sizeof(char))) == -1 && quit == 0)
+    if (port > 0)
     {
-
-        workerp_poll(poll);
-        for (int i = 0; i < nworkers; i++)
+        // serve one coordinator at a time, for as long as it stays connected.
+        int listen_fd = wire_listen(port);
+        m.framed = 1;
+        while (1)
         {
-            if ((workerstat = workerp_check_after_poll(poll, i)) == 0)
+            int client_fd = accept(listen_fd, NULL, NULL);
+            if (client_fd < 0)
             {
-                if (worker_recv(workers[i], &freqbuf) != 0)
+                if (errno == EINTR)
                 {
-                    if (is_sentinel(&freqbuf))
-                    {
-                        DEBUG_PRINTF("received sentinel\n");
-                        sentinel_count++;
-                        continue;
-                    }
-                    ma_insert_record(master, &freqbuf);
+                    continue;
                 }
+                perror("accept");
+                exit(1);
             }
-            else if (workerstat == -1)
-            {
-                perror("poll: worker failed");
-            }
-        }
-
-        if (sentinel_count >= nworkers) {
-            sentinel_count = 0;
-            ma_print_array(master);
-            ma_clear(master);
+            m.out = client_fd;
+            serve_queries(&m, client_fd);
+            close(client_fd);
         }
     }
 
+    serve_queries(&m, STDIN_FILENO);
+
     // release all pipes
     for (int i = 0; i < nworkers; i++)
     {
@@ -8,12 +8,39 @@
 
 #include "freq_list.h"
 #include "worker.h"
+#include "wire.h"
+
+/* Read every line of standard input as a query word, and frame it as
+ * run_worker expects its queries (see wire.h), in a temporary file that
+ * every directory's worker reads from the start. Returns the file's
+ * descriptor.
+ */
+int frame_queries() {
+    FILE *queries;
+    if ((queries = tmpfile()) == NULL) {
+        perror("tmpfile");
+        exit(1);
+    }
+
+    char line[MAXLINE + 2];
+    while (fgets(line, sizeof(line), stdin) != NULL) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] != '\0' && wire_send_query(fileno(queries), line) == -1) {
+            perror("writing queries");
+            exit(1);
+        }
+    }
+    return fileno(queries);
+}
 
 /* A program to model calling run_worker and to test it. Notice that run_worker
  * produces binary output, so the output from this program to STDOUT will 
  * not be human readable.  You will need to work out how to save it and view 
  * it (or process it) so that you can confirm that your run_worker 
  * is working properly.
+ *
+ * Every line of standard input is searched for in every directory, the
+ * answers of each directory following those of the one before.
  */
 int main(int argc, char **argv) {
     char ch;
@@ -32,6 +59,8 @@ int main(int argc, char **argv) {
         }
     }
 
+    int queries = frame_queries();
+
     // Open the directory provided by the user (or current working directory)
     DIR *dirp;
     if ((dirp = opendir(startdir)) == NULL) {
@@ -43,8 +72,8 @@ int main(int argc, char **argv) {
      * to make sure that the entry is a directory, then call run_worker
      * to process the index file contained in the directory.
      * Note that this implementation of the query engine iterates
-     * sequentially through the directories, and will expect to read
-     * a word from standard input for each index it checks.
+     * sequentially through the directories, replaying every query
+     * for each index it checks.
      */
     struct dirent *dp;
     while ((dp = readdir(dirp)) != NULL) {
@@ -71,7 +100,11 @@ int main(int argc, char **argv) {
         // Only call run_worker if it is a directory
         // Otherwise ignore it.
         if (S_ISDIR(sbuf.st_mode)) {
-            run_worker(path, STDIN_FILENO, STDOUT_FILENO);
+            if (lseek(queries, 0, SEEK_SET) == -1) {
+                perror("lseek");
+                exit(1);
+            }
+            run_worker(path, queries, STDOUT_FILENO);
         }
     }
 
@@ -0,0 +1,370 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "wire.h"
+
+#define MAX_BACKLOG 16
+
+/**
+ * Writes all n bytes of buf to fd, retrying partial writes.
+ * Returns n, or -1 if the write fails.
+ */
+ssize_t write_full(int fd, const void *buf, size_t n)
+{
+    size_t written = 0;
+    while (written < n)
+    {
+        ssize_t nbytes = write(fd, (const char *)buf + written, n - written);
+        if (nbytes == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        written += nbytes;
+    }
+    return n;
+}
+
+/**
+ * Reads exactly n bytes from fd into buf, retrying partial reads.
+ * Returns n, 0 if the end of file is reached first, or -1 if the
+ * read fails.
+ */
+ssize_t read_full(int fd, void *buf, size_t n)
+{
+    size_t nread = 0;
+    while (nread < n)
+    {
+        ssize_t nbytes = read(fd, (char *)buf + nread, n - nread);
+        if (nbytes == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        if (nbytes == 0)
+        {
+            return 0;
+        }
+        nread += nbytes;
+    }
+    return n;
+}
+
+/**
+ * Builds a query frame for the word in a newly allocated buffer,
+ * storing its size in len.
+ */
+char *wire_query_frame(const char *word, size_t *len)
+{
+    uint32_t wordlen = strlen(word);
+    char *frame = panic_malloc(sizeof(uint32_t) + wordlen);
+    uint32_t netlen = htonl(wordlen);
+
+    memcpy(frame, &netlen, sizeof(uint32_t));
+    memcpy(frame + sizeof(uint32_t), word, wordlen);
+    *len = sizeof(uint32_t) + wordlen;
+    return frame;
+}
+
+/**
+ * Sends a query frame for the word. Returns the number of bytes
+ * written, or -1 on error.
+ */
+ssize_t wire_send_query(int fd, const char *word)
+{
+    size_t len;
+    char *frame = wire_query_frame(word, &len);
+    ssize_t nbytes = write_full(fd, frame, len);
+    free(frame);
+    return nbytes;
+}
+
+/**
+ * Builds a task frame for the slice and word in a newly allocated
+ * buffer, storing its size in len.
+ */
+char *wire_task_frame(int slice, const char *word, size_t *len)
+{
+    uint32_t wordlen = strlen(word);
+    char *frame = panic_malloc(2 * sizeof(uint32_t) + wordlen);
+    uint32_t header[2] = {htonl(slice), htonl(wordlen)};
+
+    memcpy(frame, header, sizeof(header));
+    memcpy(frame + sizeof(header), word, wordlen);
+    *len = sizeof(header) + wordlen;
+    return frame;
+}
+
+/**
+ * Sends a task frame, asking a pool worker to search the given slice
+ * for the word: the slice number, followed by a query frame. Returns
+ * the number of bytes written, or -1 on error.
+ */
+ssize_t wire_send_task(int fd, int slice, const char *word)
+{
+    size_t len;
+    char *frame = wire_task_frame(slice, word, &len);
+
+    // written at once, so that a task is never split across writes.
+    ssize_t nbytes = write_full(fd, frame, len);
+    free(frame);
+    return nbytes;
+}
+
+/**
+ * Waits for and receives a single task frame, storing its slice number
+ * in slice and copying its word into word, which must hold wordcap bytes.
+ *
+ * Returns the number of bytes read, 0 if the connection was closed,
+ * or -1 on error or if the word does not fit.
+ */
+ssize_t wire_recv_task(int fd, int *slice, char *word, int wordcap)
+{
+    uint32_t netslice;
+    ssize_t nbytes;
+    if ((nbytes = read_full(fd, &netslice, sizeof(uint32_t))) <= 0)
+    {
+        return nbytes;
+    }
+    *slice = ntohl(netslice);
+
+    if ((nbytes = wire_recv_query(fd, word, wordcap)) <= 0)
+    {
+        return nbytes;
+    }
+    return sizeof(uint32_t) + nbytes;
+}
+
+/**
+ * Waits for and receives a single query frame, copying the word into
+ * word, which must hold wordcap bytes.
+ *
+ * Returns the number of bytes read, 0 if the connection was closed,
+ * or -1 on error or if the word does not fit.
+ */
+ssize_t wire_recv_query(int fd, char *word, int wordcap)
+{
+    uint32_t wordlen;
+    ssize_t nbytes;
+    if ((nbytes = read_full(fd, &wordlen, sizeof(uint32_t))) <= 0)
+    {
+        return nbytes;
+    }
+    wordlen = ntohl(wordlen);
+
+    if (wordlen > MAXLINE || (int)wordlen >= wordcap)
+    {
+        fprintf(stderr, "wire_recv_query: word of %u bytes is too long\n", wordlen);
+        return -1;
+    }
+    if (wordlen > 0 && (nbytes = read_full(fd, word, wordlen)) <= 0)
+    {
+        return nbytes;
+    }
+    word[wordlen] = '\0';
+    return sizeof(uint32_t) + wordlen;
+}
+
+/**
+ * Parses a query frame at the start of the len bytes of buf, copying
+ * the word into word, truncated to fit in wordcap bytes.
+ *
+ * Returns the number of bytes the frame took up, 0 if buf does not
+ * hold a whole frame yet, or -1 if the frame is malformed.
+ */
+int wire_parse_query(const char *buf, int len, char *word, int wordcap)
+{
+    uint32_t wordlen;
+    if (len < (int)sizeof(uint32_t))
+    {
+        return 0;
+    }
+    memcpy(&wordlen, buf, sizeof(uint32_t));
+    wordlen = ntohl(wordlen);
+
+    if (wordlen > MAXLINE)
+    {
+        return -1;
+    }
+    if (len < (int)(sizeof(uint32_t) + wordlen))
+    {
+        return 0;
+    }
+
+    int copy = wordlen < wordcap - 1 ? wordlen : wordcap - 1;
+    memcpy(word, buf + sizeof(uint32_t), copy);
+    word[copy] = '\0';
+    return sizeof(uint32_t) + wordlen;
+}
+
+/**
+ * Sends a record frame for each of the n records, followed by the
+ * frame ending the answer. Returns 0 on success, -1 on error.
+ */
+int wire_send_records(int fd, const FreqRecord *records, int n)
+{
+    // the whole answer is written at once, so that it is never
+    // interleaved with a partial write.
+    char *frames = panic_malloc((n + 1) * (2 * sizeof(uint32_t) + PATHLENGTH));
+    size_t size = 0;
+    uint32_t header[2];
+
+    for (int i = 0; i <= n; i++)
+    {
+        uint32_t namelen = i < n ? strnlen(records[i].filename, PATHLENGTH - 1) : 0;
+        header[0] = htonl(i < n ? records[i].freq : 0);
+        header[1] = htonl(namelen);
+        memcpy(frames + size, header, sizeof(header));
+        size += sizeof(header);
+        if (namelen > 0)
+        {
+            memcpy(frames + size, records[i].filename, namelen);
+            size += namelen;
+        }
+    }
+
+    ssize_t nbytes = write_full(fd, frames, size);
+    free(frames);
+    return nbytes == -1 ? -1 : 0;
+}
+
+/**
+ * Parses a record frame at the start of the len bytes of buf into frp.
+ * The frame ending an answer is parsed as a sentinel FreqRecord.
+ *
+ * Returns the number of bytes the frame took up, 0 if buf does not
+ * hold a whole frame yet, or -1 if the frame is malformed.
+ */
+int wire_parse_record(const char *buf, int len, FreqRecord *frp)
+{
+    uint32_t header[2];
+    if (len < (int)sizeof(header))
+    {
+        return 0;
+    }
+    memcpy(header, buf, sizeof(header));
+    uint32_t namelen = ntohl(header[1]);
+
+    if (namelen > MAXLINE)
+    {
+        return -1;
+    }
+    if (len < (int)(sizeof(header) + namelen))
+    {
+        return 0;
+    }
+
+    // names too long to fit are truncated, but the whole frame is consumed.
+    memset(frp, 0, sizeof(FreqRecord));
+    frp->freq = ntohl(header[0]);
+    uint32_t keep = namelen < PATHLENGTH - 1 ? namelen : PATHLENGTH - 1;
+    memcpy(frp->filename, buf + sizeof(header), keep);
+    return sizeof(header) + namelen;
+}
+
+/**
+ * Connects to a node given as host:port. Returns the connected
+ * socket, or -1 on failure.
+ */
+int wire_connect(const char *hostport)
+{
+    char host[PATHLENGTH];
+    strncpy(host, hostport, PATHLENGTH - 1);
+    host[PATHLENGTH - 1] = '\0';
+
+    char *port = strrchr(host, ':');
+    if (port == NULL)
+    {
+        fprintf(stderr, "wire_connect: %s is not of the form host:port\n", hostport);
+        return -1;
+    }
+    *port++ = '\0';
+
+    struct addrinfo hints;
+    struct addrinfo *result;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    int status;
+    if ((status = getaddrinfo(host, port, &hints, &result)) != 0)
+    {
+        fprintf(stderr, "wire_connect: %s: %s\n", hostport, gai_strerror(status));
+        return -1;
+    }
+
+    int sock_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock_fd == -1)
+    {
+        perror("socket");
+        freeaddrinfo(result);
+        return -1;
+    }
+    if (connect(sock_fd, result->ai_addr, result->ai_addrlen) == -1)
+    {
+        perror("connect");
+        close(sock_fd);
+        freeaddrinfo(result);
+        return -1;
+    }
+    freeaddrinfo(result);
+
+    // queries are tiny, and should not wait around to be batched.
+    int on = 1;
+    setsockopt(sock_fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    return sock_fd;
+}
+
+/**
+ * Creates a socket listening for coordinators on the given port on
+ * every interface. Exits on failure.
+ */
+int wire_listen(int port)
+{
+    int sock_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock_fd < 0)
+    {
+        perror("socket");
+        exit(1);
+    }
+
+    // Ensure port is freed when process terminates
+    int on = 1;
+    if (setsockopt(sock_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) == -1)
+    {
+        perror("setsockopt -- REUSEADDR");
+        exit(1);
+    }
+
+    struct sockaddr_in server;
+    memset(&server, 0, sizeof(server));
+    server.sin_family = AF_INET;
+    server.sin_port = htons(port);
+    server.sin_addr.s_addr = INADDR_ANY;
+
+    if (bind(sock_fd, (struct sockaddr *)&server, sizeof(server)) < 0)
+    {
+        perror("bind");
+        exit(1);
+    }
+    if (listen(sock_fd, MAX_BACKLOG) < 0)
+    {
+        perror("listen");
+        exit(1);
+    }
+    return sock_fd;
+}
@@ -0,0 +1,119 @@
+#ifndef WIRE_H
+#define WIRE_H
+
+#include <stdio.h>
+#include <sys/types.h>
+
+#include "freq_list.h"
+#include "worker.h"
+
+/*
+ * The framed protocol spoken over TCP between a query coordinator and
+ * the query nodes serving their local index directories.
+ *
+ * Every integer is a 32-bit unsigned integer in network byte order.
+ * Workers are sent the same query frames over their pipes, and pool
+ * workers are sent task frames: a slice number, then a query frame.
+ *
+ *   query frame:   length, then length bytes of the query word.
+ *   record frame:  freq, length, then length bytes of the filename.
+ *
+ * The coordinator sends one query frame per query. The node answers
+ * every query in order with its records, followed by a record frame
+ * with a freq and length of 0 that ends the answer, mirroring the
+ * sentinel FreqRecord that workers send over their pipes.
+ */
+
+/**
+ * Writes all n bytes of buf to fd, retrying partial writes.
+ * Returns n, or -1 if the write fails.
+ */
+ssize_t write_full(int fd, const void *buf, size_t n);
+
+/**
+ * Reads exactly n bytes from fd into buf, retrying partial reads.
+ * Returns n, 0 if the end of file is reached first, or -1 if the
+ * read fails.
+ */
+ssize_t read_full(int fd, void *buf, size_t n);
+
+/**
+ * Builds a query frame for the word in a newly allocated buffer,
+ * storing its size in len.
+ */
+char *wire_query_frame(const char *word, size_t *len);
+
+/**
+ * Sends a query frame for the word. Returns the number of bytes
+ * written, or -1 on error.
+ */
+ssize_t wire_send_query(int fd, const char *word);
+
+/**
+ * Waits for and receives a single query frame, copying the word into
+ * word, which must hold wordcap bytes.
+ *
+ * Returns the number of bytes read, 0 if the connection was closed,
+ * or -1 on error or if the word does not fit.
+ */
+ssize_t wire_recv_query(int fd, char *word, int wordcap);
+
+/**
+ * Builds a task frame for the slice and word in a newly allocated
+ * buffer, storing its size in len.
+ */
+char *wire_task_frame(int slice, const char *word, size_t *len);
+
+/**
+ * Sends a task frame, asking a pool worker to search the given slice
+ * for the word: the slice number, followed by a query frame. Returns
+ * the number of bytes written, or -1 on error.
+ */
+ssize_t wire_send_task(int fd, int slice, const char *word);
+
+/**
+ * Waits for and receives a single task frame, storing its slice number
+ * in slice and copying its word into word, which must hold wordcap bytes.
+ *
+ * Returns the number of bytes read, 0 if the connection was closed,
+ * or -1 on error or if the word does not fit.
+ */
+ssize_t wire_recv_task(int fd, int *slice, char *word, int wordcap);
+
+/**
+ * Parses a query frame at the start of the len bytes of buf, copying
+ * the word into word, truncated to fit in wordcap bytes.
+ *
+ * Returns the number of bytes the frame took up, 0 if buf does not
+ * hold a whole frame yet, or -1 if the frame is malformed.
+ */
+int wire_parse_query(const char *buf, int len, char *word, int wordcap);
+
+/**
+ * Sends a record frame for each of the n records, followed by the
+ * frame ending the answer. Returns 0 on success, -1 on error.
+ */
+int wire_send_records(int fd, const FreqRecord *records, int n);
+
+/**
+ * Parses a record frame at the start of the len bytes of buf into frp.
+ * The frame ending an answer is parsed as a sentinel FreqRecord.
+ *
+ * Returns the number of bytes the frame took up, 0 if buf does not
+ * hold a whole frame yet, or -1 if the frame is malformed.
+ */
+int wire_parse_record(const char *buf, int len, FreqRecord *frp);
+
+/**
+ * Connects to a node given as host:port. Returns the connected
+ * socket, or -1 on failure.
+ */
+int wire_connect(const char *hostport);
+
+/**
+ * Creates a socket listening for coordinators on the given port on
+ * every interface. Exits on failure.
+ */
+int wire_listen(int port);
+
+#endif /* WIRE_H */
@@ -5,8 +5,15 @@
 #include <dirent.h>
 #include <sys/stat.h>
 #include <assert.h>
+#include <time.h>
+#include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/socket.h>
 #include "freq_list.h"
 #include "worker.h"
+#include "wire.h"
+#include "lookup.h"
 
 const FreqRecord record_sentinel = {0, ""};
 
@@ -53,6 +60,8 @@ int is_sentinel(FreqRecord *frp)
 
 // FreqRecord APIs
 
+static FreqRecord *node_records(Node *head, char **file_names);
+
 /**
  * Retrives the frequency of the given word in the provided filename
  * and indices. If the word is not found, returns a record with
@@ -64,14 +73,31 @@ FreqRecord *get_word(char *word, Node *head, char **file_names)
     while (head)
     {
         // if we break
-        if (!strcmp(head->word, word))
+        if (!strcmp(node_word(head), word))
         {
             break;
         }
 
         head = head->next;
     }
+    return node_records(head, file_names);
+}
+
+/**
+ * Same as get_word, but finds the word with a lookup in the table
+ * instead of walking the list.
+ */
+FreqRecord *lookup_word(char *word, const WordTable *table, char **file_names)
+{
+    return node_records(wt_find(table, word), file_names);
+}
 
+/**
+ * Returns the records of the given node, followed by the sentinel.
+ * A NULL node has no records.
+ */
+static FreqRecord *node_records(Node *head, char **file_names)
+{
     // return an empty sentinel
     if (!head)
     {
@@ -122,13 +148,11 @@ void print_freq_records(FreqRecord *frp)
 }
 
 /**
- * Reads from the in file descriptor for a given word,
- * searches for it on the index for the given directory, then
- * writes the result to the out file descriptor.
+ * Loads the index of the given directory, returning the number of words
+ * in it. See read_list.
  */
-void run_worker(char *dirname, int in, int out)
+int load_index(const char *dirname, Node **head, char ***filenames)
 {
-
     // some padding bytes for safety
     // 32 seems like a good number.
 
@@ -138,40 +162,135 @@ void run_worker(char *dirname, int in, int out)
     sprintf(listfile, "%s/%s", dirname, "index");
     sprintf(namefile, "%s/%s", dirname, "filenames");
 
-    Node *head = NULL;
-    char **filenames = init_filenames();
+    *head = NULL;
+    *filenames = init_filenames();
+    read_list(listfile, namefile, head, *filenames);
 
-    read_list(listfile, namefile, &head, filenames);
+    free(listfile);
+    free(namefile);
 
-    int readbytes = 0;
-    char buf[MAXWORD];
-    memset(buf, 0, MAXWORD);
-    DEBUG_PRINTF("from worker thread, in: %d, out: %d\n", in, out);
+    int nwords = 0;
+    for (Node *cur = *head; cur != NULL; cur = cur->next)
+    {
+        nwords++;
+    }
+    return nwords;
+}
 
-    while ((readbytes = read(in, buf, MAXWORD)) <= MAXWORD && readbytes > 0)
+/**
+ * Cuts the list of nwords words into slices of at most target words each,
+ * splitting the list in place, and stores them in slices.
+ *
+ * See worker.h for details.
+ */
+int split_index(Node *head, char **filenames, int nwords, int target, IndexSlice *slices)
+{
+    if (target <= 0)
     {
-        DEBUG_PRINTF("from worker thread inside loop: %s\n", buf);
-        int i = 0;
-        FreqRecord *records = get_word(buf, head, filenames);
-        while (records != NULL && records[i].freq != 0)
+        target = 1;
+    }
+
+    // spread the words evenly, rather than leaving a short last slice.
+    int nslices = nwords > 0 ? (nwords + target - 1) / target : 1;
+    Node *cur = head;
+    for (int s = 0; s < nslices; s++)
+    {
+        int size = nwords / nslices + (s < nwords % nslices ? 1 : 0);
+        slices[s].head = cur;
+        slices[s].filenames = filenames;
+        slices[s].nwords = size;
+        slices[s].table = NULL;
+
+        for (int i = 0; i < size - 1; i++)
+        {
+            cur = cur->next;
+        }
+        if (size > 0)
         {
-            write(out, &records[i], sizeof(FreqRecord));
-            DEBUG_PRINTF("sent to out %d: %s\n", records[i].freq, records[i].filename);
-            i++;
+            Node *last = cur;
+            cur = cur->next;
+            last->next = NULL;
         }
+    }
+
+    // built once the list is cut, so that each table only holds its slice.
+    for (int s = 0; s < nslices; s++)
+    {
+        slices[s].table = wt_build(slices[s].head);
+    }
+    return nslices;
+}
+
+/**
+ * Writes the records found for the word in the list to the out
+ * file descriptor, followed by the sentinel.
+ */
+static void answer_query(char *word, const WordTable *table, char **filenames, int out)
+{
+    int i = 0;
+    FreqRecord *records = lookup_word(word, table, filenames);
+    while (records != NULL && records[i].freq != 0)
+    {
+        write(out, &records[i], sizeof(FreqRecord));
+        DEBUG_PRINTF("sent to out %d: %s\n", records[i].freq, records[i].filename);
+        i++;
+    }
 
-        DEBUG_PRINTF("records gotten finsihed\n");
+    DEBUG_PRINTF("records gotten finsihed\n");
 
-        memset(buf, 0, MAXWORD); // better safe than sorry, flush the buffer.
+    // write the sentinel
+    write(out, &record_sentinel, sizeof(FreqRecord));
+    free(records);
+}
 
-        // write the sentinel
-        write(out, &record_sentinel, sizeof(FreqRecord));
-        free(records);
+/**
+ * Reads from the in file descriptor for a given word,
+ * searches for it on the index for the given directory, then
+ * writes the result to the out file descriptor.
+ */
+void run_worker(char *dirname, int in, int out)
+{
+    Node *head = NULL;
+    char **filenames = NULL;
+    load_index(dirname, &head, &filenames);
+    WordTable *table = wt_build(head);
+
+    int readbytes = 0;
+    char buf[MAXLINE + 1];
+    memset(buf, 0, sizeof(buf));
+    DEBUG_PRINTF("from worker thread, in: %d, out: %d\n", in, out);
+
+    // queries arrive as query frames (see wire.h), so words of any
+    // length up to MAXLINE are searched whole.
+    while ((readbytes = wire_recv_query(in, buf, sizeof(buf))) > 0)
+    {
+        DEBUG_PRINTF("from worker thread inside loop: %s\n", buf);
+        answer_query(buf, table, filenames, out);
     }
+    wt_free(table);
 
     DEBUG_PRINTF("all gone! %d in: %d, out: %d buf: %s\n", readbytes, in, out, buf);
-    free(listfile);
-    free(namefile);
+}
+
+/**
+ * Reads tasks from the in file descriptor, searches the slice each
+ * task names for its word, then writes the result to the out file
+ * descriptor, exactly as run_worker does.
+ */
+void run_pool_worker(const IndexSlice *slices, int nslices, int in, int out)
+{
+    char buf[MAXLINE + 1];
+    int slice;
+    while (wire_recv_task(in, &slice, buf, sizeof(buf)) > 0)
+    {
+        if (slice < 0 || slice >= nslices)
+        {
+            fprintf(stderr, "run_pool_worker: no slice %d\n", slice);
+            write(out, &record_sentinel, sizeof(FreqRecord));
+            continue;
+        }
+        answer_query(buf, slices[slice].table, slices[slice].filenames, out);
+    }
 }
 
 // --- Master Array APIs
@@ -241,6 +360,28 @@ void ma_print_array(MasterArray *arr)
     print_freq_records(arr->records);
 }
 
+/**
+ * Returns the number of records in the master array.
+ */
+int ma_count(const MasterArray *arr)
+{
+    int n = 0;
+    while (n < MAXRECORDS && arr->records[n].freq != 0)
+    {
+        n++;
+    }
+    return n;
+}
+
+/**
+ * Returns the records of the master array, sorted from most
+ * to least frequent. Only the first ma_count records are valid.
+ */
+const FreqRecord *ma_records(const MasterArray *arr)
+{
+    return arr->records;
+}
+
 // -- Worker APIs
 
 /**
@@ -267,11 +408,49 @@ typedef struct worker_s
     // should contain an index and filenames file.
     char path[128];
 
-    // buffer used for sending messages to this worker
-    char sendbuf[32];
+    // PID of the process running this worker, or -1 if not running.
+    int pid;
+
+    // set if this worker is a remote query node, in which case path
+    // is its host:port, and both the send and recv ends are a socket.
+    int remote;
+
+    // every Worker created on this process, so that a spawned
+    // process can close the pipes belonging to the other workers.
+    struct worker_s *next_live;
+    struct worker_s *prev_live;
+
+    // counters about the traffic to and from this worker.
+    WorkerStats stats;
+
+    // for a pool worker, the slices it searches instead of path.
+    const IndexSlice *slices;
+    int nslices;
+
+    // when each query that has not been answered yet was sent, oldest
+    // first. Answers arrive in the order queries were sent.
+    long long sent_at[WORKER_MAX_OUTSTANDING];
+    int sent_head;
+
+    // frames sent to this worker that the send end could not take yet,
+    // written by worker_flush once it can.
+    char *outbuf;
+    size_t outlen;
+    size_t outcap;
+
+    // for a remote worker, bytes read from the node that do not make up
+    // a whole record frame yet.
+    char *inbuf;
+    int inlen;
+    int incap;
 
 } worker_s;
 
+/**
+ * Head of the list of every Worker that has not been freed.
+ */
+static Worker *live_workers = NULL;
+
 /**
  * Struct definition for Opaque type WorkerPoll.
  * 
@@ -284,12 +463,37 @@ typedef struct worker_s
  */
 typedef struct workerpoll_s
 {
-    // number of file descriptors to poll
+    // number of workers to poll
     nfds_t nfds;
-    // pollfd for each file descriptor
+    // pollfd for each file descriptor, followed by
+    // one slot for the watched input.
     struct pollfd fds[];
 } workerpoll_s;
 
+/**
+ * Opens a fresh pair of send and recv pipes for the worker.
+ */
+static void worker_open_pipes(Worker *w)
+{
+    int send_pipefd[2];
+    int recv_pipefd[2];
+
+    if (pipe(send_pipefd) == -1 || pipe(recv_pipefd) == -1)
+    {
+        perror("pipe");
+        exit(1);
+    }
+
+    w->fd_send_read = send_pipefd[0];
+    w->fd_send_write = send_pipefd[1];
+
+    // a worker that stops reading must never block the master.
+    fcntl(w->fd_send_write, F_SETFL, fcntl(w->fd_send_write, F_GETFL) | O_NONBLOCK);
+
+    w->fd_recv_read = recv_pipefd[0];
+    w->fd_recv_write = recv_pipefd[1];
+}
+
 /**
  * Creates a heap-allocated worker for the given directory.
  * 
@@ -314,37 +518,73 @@ typedef struct workerpoll_s
  * Instead, Workers should be manipulated only by the worker_* APIs
  * in worker.h to prevent any resource leaks.
  * 
+ * Returns NULL if the path does not fit in PATHLENGTH.
+ *
  * Remember to always free this worker after use with
  * worker_free.
  */
 Worker *worker_create(const char *path)
 {
-    if (strlen(path) >= 128)
+    if (strlen(path) >= PATHLENGTH)
     {
-        perror("worker_create: dirname too long");
+        fprintf(stderr, "worker_create: %s: dirname too long\n", path);
+        return NULL;
     }
 
     Worker *w = panic_malloc(sizeof(Worker));
-    int send_pipefd[2];
-    int recv_pipefd[2];
-
-    // should be safe from strlen check before.
-    memset(w->path, 0, 128);
+    memset(w, 0, sizeof(Worker));
     strcpy(w->path, path);
 
-    // create pipes
+    w->pid = -1;
+    w->remote = 0;
+    worker_open_pipes(w);
 
-    if (pipe(send_pipefd) == -1 || pipe(recv_pipefd) == -1)
+    w->prev_live = NULL;
+    w->next_live = live_workers;
+    if (live_workers != NULL)
     {
-        perror("pipe");
-        exit(1);
+        live_workers->prev_live = w;
     }
+    live_workers = w;
 
-    w->fd_send_read = send_pipefd[0];
-    w->fd_send_write = send_pipefd[1];
+    return w;
+}
 
-    w->fd_recv_read = recv_pipefd[0];
-    w->fd_recv_write = recv_pipefd[1];
+/**
+ * Creates a heap-allocated worker for a remote query node listening on
+ * hostport (of the form host:port), that serves its own index directories
+ * over TCP. See wire.h for the protocol.
+ *
+ * The connection is only made once the worker is started with
+ * worker_start_run, and is remade by worker_restart. Otherwise, a remote
+ * worker is used exactly like a local one.
+ */
+Worker *worker_connect(const char *hostport)
+{
+    if (strlen(hostport) >= 128)
+    {
+        fprintf(stderr, "worker_connect: %s: address too long\n", hostport);
+        return NULL;
+    }
+
+    Worker *w = panic_malloc(sizeof(Worker));
+    memset(w, 0, sizeof(Worker));
+    strcpy(w->path, hostport);
+
+    w->pid = -1;
+    w->remote = 1;
+    w->fd_send_read = -1;
+    w->fd_send_write = -1;
+    w->fd_recv_read = -1;
+    w->fd_recv_write = -1;
+
+    w->prev_live = NULL;
+    w->next_live = live_workers;
+    if (live_workers != NULL)
+    {
+        live_workers->prev_live = w;
+    }
+    live_workers = w;
 
     return w;
 }
@@ -365,6 +605,9 @@ void worker_close_send_write(Worker *w)
         return;
     close(w->fd_send_write);
     w->fd_send_write = -1;
+
+    // whatever was still queued can never be sent.
+    w->outlen = 0;
 }
 
 /**
@@ -419,22 +662,131 @@ void worker_close_recv_read(Worker *w)
         return;
     close(w->fd_recv_read);
     w->fd_recv_read = -1;
+
+    // a record cut short can never be finished.
+    w->inlen = 0;
+}
+
+/**
+ * Creates a heap-allocated pool worker, which can search any of the
+ * nslices slices instead of a single directory, named label.
+ *
+ * See worker.h for details.
+ */
+Worker *worker_create_pool(const char *label, const IndexSlice *slices, int nslices)
+{
+    Worker *w = worker_create(label);
+    if (w == NULL)
+    {
+        return NULL;
+    }
+    w->slices = slices;
+    w->nslices = nslices;
+    return w;
+}
+
+/**
+ * Updates the counters of the worker after a query of nbytes
+ * was sent to it.
+ */
+static ssize_t worker_sent(Worker *w, ssize_t nbytes)
+{
+    WorkerStats *stats = &w->stats;
+    stats->last_send_us = monotonic_us();
+    if (nbytes <= 0)
+    {
+        stats->errors++;
+        return nbytes;
+    }
+    stats->sent++;
+    stats->bytes_out += nbytes;
+
+    // past the limit, the oldest sends are dropped from the histogram.
+    if (stats->outstanding == WORKER_MAX_OUTSTANDING)
+    {
+        w->sent_head = (w->sent_head + 1) % WORKER_MAX_OUTSTANDING;
+        stats->outstanding--;
+    }
+    w->sent_at[(w->sent_head + stats->outstanding) % WORKER_MAX_OUTSTANDING] = stats->last_send_us;
+    stats->outstanding++;
+    return nbytes;
+}
+
+/**
+ * Writes as much of the frames queued for the worker as its send end
+ * takes without blocking.
+ *
+ * Returns 0 once nothing is left queued, 1 if some of it still has to
+ * wait for the send end to be writable, or -1 on error.
+ */
+int worker_flush(Worker *w)
+{
+    size_t written = 0;
+    while (written < w->outlen)
+    {
+        // a node that has gone away must not raise SIGPIPE in whoever
+        // runs the master.
+        ssize_t nbytes = w->remote
+                             ? send(w->fd_send_write, w->outbuf + written, w->outlen - written, MSG_NOSIGNAL)
+                             : write(w->fd_send_write, w->outbuf + written, w->outlen - written);
+        if (nbytes == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                break;
+            }
+            return -1;
+        }
+        written += nbytes;
+    }
+
+    memmove(w->outbuf, w->outbuf + written, w->outlen - written);
+    w->outlen -= written;
+    return w->outlen > 0;
+}
+
+/**
+ * Returns whether frames sent to the worker are still queued, waiting
+ * for its send end to be writable.
+ */
+int worker_flush_pending(const Worker *w)
+{
+    return w->outlen > 0;
+}
+
+/**
+ * Queues the frame of len bytes for the worker, taking ownership of it,
+ * and writes as much as it can right away.
+ * Returns len, or -1 if the send end failed.
+ */
+static ssize_t worker_queue(Worker *w, char *frame, size_t len)
+{
+    if (w->outlen + len > w->outcap)
+    {
+        w->outcap = w->outlen + len > 2 * w->outcap ? w->outlen + len : 2 * w->outcap;
+        w->outbuf = panic_realloc(w->outbuf, w->outcap);
+    }
+    memcpy(w->outbuf + w->outlen, frame, len);
+    w->outlen += len;
+    free(frame);
+
+    return worker_flush(w) == -1 ? -1 : (ssize_t)len;
 }
 
 /**
  * Send a word to the given worker.
  * 
- * This method returns the result of the underlying
- * write call that writes to the input pipe created for
- * the given worker by worker_create: the number of bytes
- * written to the pipe.
- * 
- * If the word written is greater than 31 characters, it 
- * will be truncated. This method mutates the worker
- * due to reusing an underlying buffer for the write.
+ * The word is sent whole as a query frame (see wire.h), so it
+ * must be at most MAXLINE characters long for the worker to accept it.
+ * The send never blocks: whatever the send end can not take right away
+ * is queued, and written by worker_flush once it can.
  * 
- * If the pipe has been closed previously,
- * this method returns 0.
+ * Returns the size of the frame, 0 if the pipe has been closed
+ * previously, or -1 on error.
  */
 ssize_t worker_send(Worker *w, const char *word)
 {
@@ -443,15 +795,84 @@ ssize_t worker_send(Worker *w, const char *word)
         DEBUG_PRINTF("failed to send\n");
         return 0;
     }
-    // prepare buffer for a safe send
-    // instead of allocating a new buffer on the stack,
-    // have one reused for performance and safety reasons.
-    memset(w->sendbuf, 0, 32);
-    strncpy(w->sendbuf, word, 31);
-    w->sendbuf[31] = '\0';
+    // local and remote workers both take query frames.
+    DEBUG_PRINTF("sending value %s\n", word);
+    size_t len;
+    char *frame = wire_query_frame(word, &len);
+    return worker_sent(w, worker_queue(w, frame, len));
+}
 
-    DEBUG_PRINTF("sending value %s\n", w->sendbuf);
-    return write(w->fd_send_write, w->sendbuf, 32);
+/**
+ * Sends a pool worker the task of searching the given slice for the word,
+ * without blocking, like worker_send.
+ *
+ * Returns the size of the frame, 0 if the pipe has been closed
+ * previously, or -1 on error.
+ */
+ssize_t worker_send_task(Worker *w, int slice, const char *word)
+{
+    if (w->fd_send_write == -1)
+    {
+        DEBUG_PRINTF("failed to send\n");
+        return 0;
+    }
+    size_t len;
+    char *frame = wire_task_frame(slice, word, &len);
+    return worker_sent(w, worker_queue(w, frame, len));
+}
+
+/**
+ * Takes the next whole record frame from a remote worker, reading what
+ * the socket has without blocking until there is one.
+ *
+ * Returns the size of the frame, 0 if the node closed the connection,
+ * WORKER_RECV_AGAIN if it has not sent a whole frame yet, or -1 on
+ * error or if the frame is malformed.
+ */
+static ssize_t worker_recv_frame(Worker *w, FreqRecord *frp)
+{
+    int len;
+    while ((len = wire_parse_record(w->inbuf, w->inlen, frp)) == 0)
+    {
+        if (w->inlen == w->incap)
+        {
+            w->incap = w->incap > 0 ? 2 * w->incap : 4096;
+            w->inbuf = panic_realloc(w->inbuf, w->incap);
+        }
+        ssize_t nbytes = read(w->fd_recv_read, w->inbuf + w->inlen, w->incap - w->inlen);
+        if (nbytes == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (nbytes == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            return WORKER_RECV_AGAIN;
+        }
+        if (nbytes <= 0)
+        {
+            return nbytes;
+        }
+        w->inlen += nbytes;
+    }
+    if (len == -1)
+    {
+        return -1;
+    }
+
+    memmove(w->inbuf, w->inbuf + len, w->inlen - len);
+    w->inlen -= len;
+    return len;
+}
+
+/**
+ * Returns whether a whole record from the worker is already buffered,
+ * so that worker_recv returns it without reading. Polling the worker
+ * does not report it, since it has already been read.
+ */
+int worker_recv_buffered(const Worker *w)
+{
+    FreqRecord record;
+    return w->remote && wire_parse_record(w->inbuf, w->inlen, &record) != 0;
 }
 
 /**
@@ -464,16 +885,126 @@ ssize_t worker_send(Worker *w, const char *word)
  * 
  * If the pipe has been closed previously,
  * this method returns 0.
+ *
+ * A remote worker is read without blocking, so a node that stalls
+ * halfway through a record never holds up the caller: the part read so
+ * far is kept, and WORKER_RECV_AGAIN is returned until the rest arrives.
+ * Several records may be read at once; check worker_recv_buffered
+ * before polling again.
  */
-ssize_t worker_recv(const Worker *w, FreqRecord *frp)
+ssize_t worker_recv(Worker *w, FreqRecord *frp)
 {
     if (w->fd_recv_read == -1)
     {
         perror("worker_recv: recv read closed :(\n");
         return 1;
     }
-    memset(frp, 0, sizeof(FreqRecord));
-    return read(w->fd_recv_read, frp, sizeof(FreqRecord));
+
+    ssize_t nbytes;
+    if (w->remote)
+    {
+        nbytes = worker_recv_frame(w, frp);
+        if (nbytes == WORKER_RECV_AGAIN)
+        {
+            return nbytes;
+        }
+    }
+    else
+    {
+        memset(frp, 0, sizeof(FreqRecord));
+        nbytes = read(w->fd_recv_read, frp, sizeof(FreqRecord));
+    }
+
+    WorkerStats *stats = &w->stats;
+    stats->last_recv_us = monotonic_us();
+    if (nbytes <= 0)
+    {
+        stats->errors++;
+        return nbytes;
+    }
+    stats->bytes_in += nbytes;
+
+    if (!is_sentinel(frp))
+    {
+        stats->records++;
+    }
+    else if (stats->outstanding > 0)
+    {
+        long long latency = stats->last_recv_us - w->sent_at[w->sent_head];
+        w->sent_head = (w->sent_head + 1) % WORKER_MAX_OUTSTANDING;
+        stats->outstanding--;
+        stats->answered++;
+        stats->latency_sum_us += latency;
+        if (latency > stats->latency_max_us)
+        {
+            stats->latency_max_us = latency;
+        }
+
+        // bucket i counts latencies below 2^i microseconds.
+        int bucket = 0;
+        while (bucket < WORKER_LATENCY_BUCKETS - 1 && latency >= (1LL << bucket))
+        {
+            bucket++;
+        }
+        stats->latency_hist[bucket]++;
+    }
+    return nbytes;
+}
+
+/**
+ * Returns the counters kept about the traffic to and from this worker.
+ */
+const WorkerStats *worker_stats(const Worker *w)
+{
+    return &w->stats;
+}
+
+/**
+ * Writes the counters of this worker to fp as a "worker" line of
+ * key=value pairs, followed by a "latency" line listing the non-empty
+ * buckets of its latency histogram as le_<bound>us=count, where a
+ * query took less than bound microseconds to answer.
+ *
+ * Times are given relative to now, in microseconds of the monotonic
+ * clock (see monotonic_us).
+ */
+void worker_print_stats(const Worker *w, FILE *fp, long long now)
+{
+    const WorkerStats *stats = &w->stats;
+    fprintf(fp, "worker path=%s pid=%d sent=%lld answered=%lld outstanding=%d records=%lld "
+                "bytes_out=%lld bytes_in=%lld errors=%lld restarts=%lld "
+                "latency_mean_us=%lld latency_max_us=%lld last_send_ago_us=%lld last_recv_ago_us=%lld\n",
+            w->path, w->pid, stats->sent, stats->answered, stats->outstanding, stats->records,
+            stats->bytes_out, stats->bytes_in, stats->errors, stats->restarts,
+            stats->answered ? stats->latency_sum_us / stats->answered : 0, stats->latency_max_us,
+            stats->last_send_us ? now - stats->last_send_us : -1,
+            stats->last_recv_us ? now - stats->last_recv_us : -1);
+
+    fprintf(fp, "latency path=%s", w->path);
+    for (int i = 0; i < WORKER_LATENCY_BUCKETS; i++)
+    {
+        if (stats->latency_hist[i] == 0)
+        {
+            continue;
+        }
+        if (i == WORKER_LATENCY_BUCKETS - 1)
+        {
+            fprintf(fp, " le_inf=%lld", stats->latency_hist[i]);
+        }
+        else
+        {
+            fprintf(fp, " le_%lldus=%lld", 1LL << i, stats->latency_hist[i]);
+        }
+    }
+    fprintf(fp, "\n");
+}
+
+/**
+ * Returns the directory that this worker searches on.
+ */
+const char *worker_path(const Worker *w)
+{
+    return w->path;
 }
 
 /**
@@ -497,9 +1028,31 @@ ssize_t worker_recv(const Worker *w, FreqRecord *frp)
  * 
  * This method will never return on the spawned process, and instead
  * will exit early.
+ *
+ * For a remote worker, this method connects to the node instead,
+ * returning 0 on success.
+ *
+ * Returns -1 if the worker could not be started.
  */
 int worker_start_run(Worker *w)
 {
+    if (w->remote)
+    {
+        int sock_fd = wire_connect(w->path);
+        if (sock_fd == -1)
+        {
+            return -1;
+        }
+        // a node that stalls must never block the master, whether on
+        // a send or halfway through a record.
+        fcntl(sock_fd, F_SETFL, fcntl(sock_fd, F_GETFL) | O_NONBLOCK);
+
+        // the two ends are closed separately, so each gets its own descriptor.
+        w->fd_send_write = sock_fd;
+        w->fd_recv_read = dup(sock_fd);
+        return 0;
+    }
+
     int pid = fork();
 
     if (pid == -1)
@@ -512,15 +1065,40 @@ int worker_start_run(Worker *w)
         // close unused pipes.
         worker_close_send_read(w);
         worker_close_recv_write(w);
+        w->pid = pid;
         return pid;
     }
 
     // -- child process
     DEBUG_PRINTF("starting child process...\n");
+    // the pipes of every other worker were inherited too. Holding on to
+    // their write ends would keep those workers from ever seeing an EOF.
+    for (Worker *other = live_workers; other != NULL; other = other->next_live)
+    {
+        if (other != w)
+        {
+            worker_close_send_read(other);
+            worker_close_send_write(other);
+            worker_close_recv_read(other);
+            worker_close_recv_write(other);
+        }
+    }
+
+    // the master ignores SIGPIPE, but a worker should still die quietly
+    // when the master goes away.
+    signal(SIGPIPE, SIG_DFL);
+
     // close unused pipes.
     worker_close_recv_read(w);
     worker_close_send_write(w);
-    run_worker(w->path, w->fd_send_read, w->fd_recv_write);
+    if (w->slices != NULL)
+    {
+        run_pool_worker(w->slices, w->nslices, w->fd_send_read, w->fd_recv_write);
+    }
+    else
+    {
+        run_worker(w->path, w->fd_send_read, w->fd_recv_write);
+    }
     worker_free(w);
     exit(0);
     return pid;
@@ -537,10 +1115,81 @@ void worker_free(Worker *w)
 
     worker_close_recv_read(w);
     worker_close_recv_write(w);
+    free(w->outbuf);
+    free(w->inbuf);
+
+    if (w->prev_live != NULL)
+    {
+        w->prev_live->next_live = w->next_live;
+    }
+    else if (live_workers == w)
+    {
+        live_workers = w->next_live;
+    }
+    if (w->next_live != NULL)
+    {
+        w->next_live->prev_live = w->prev_live;
+    }
 
     free(w);
 }
 
+/**
+ * Returns the PID of the process running this worker, or -1
+ * if the worker is not running.
+ */
+int worker_pid(const Worker *w)
+{
+    return w->pid;
+}
+
+/**
+ * Forcefully stops the process running this worker, and closes
+ * every pipe to it. The process is not reaped; it is expected to
+ * be reaped by the caller's SIGCHLD handling.
+ *
+ * The Worker itself remains valid and may be restarted with
+ * worker_restart.
+ */
+void worker_kill(Worker *w)
+{
+    if (w->pid > 0)
+    {
+        kill(w->pid, SIGKILL);
+    }
+    w->pid = -1;
+
+    worker_close_send_read(w);
+    worker_close_send_write(w);
+    worker_close_recv_read(w);
+    worker_close_recv_write(w);
+}
+
+/**
+ * Starts a replacement process for a worker that has died or was
+ * stopped with worker_kill, using a fresh pair of pipes.
+ *
+ * Since the pipes are replaced, any WorkerPoll containing this
+ * Worker must be updated with workerp_set_worker afterwards.
+ *
+ * Returns the PID of the replacement process, 0 for a remote worker
+ * that reconnected, or -1 on failure.
+ */
+int worker_restart(Worker *w)
+{
+    worker_kill(w);
+
+    // queries sent to the old process will never be answered.
+    w->stats.restarts++;
+    w->stats.outstanding = 0;
+    w->sent_head = 0;
+    if (!w->remote)
+    {
+        worker_open_pipes(w);
+    }
+    return worker_start_run(w);
+}
+
 /**
  * Creates a worker poll, parallel to the provided worker array.
  * 
@@ -555,7 +1204,7 @@ void worker_free(Worker *w)
  */
 WorkerPoll *workerp_create_poll(Worker **ws, int n)
 {
-    WorkerPoll *poll = panic_malloc(sizeof(WorkerPoll) + n * sizeof(struct pollfd));
+    WorkerPoll *poll = panic_malloc(sizeof(WorkerPoll) + (2 * n + 1) * sizeof(struct pollfd));
 
     poll->nfds = n;
 
@@ -564,6 +1213,20 @@ WorkerPoll *workerp_create_poll(Worker **ws, int n)
         poll->fds[i].fd = ws[i]->fd_recv_read;
         poll->fds[i].events = POLLIN;
     }
+
+    // poll ignores negative file descriptors, so the input
+    // slot is inert until workerp_watch_input is called.
+    poll->fds[n].fd = -1;
+    poll->fds[n].events = POLLIN;
+    poll->fds[n].revents = 0;
+
+    // likewise, a send end is only polled while frames are queued for it.
+    for (int i = n + 1; i < 2 * n + 1; i++)
+    {
+        poll->fds[i].fd = -1;
+        poll->fds[i].events = POLLOUT;
+        poll->fds[i].revents = 0;
+    }
     return poll;
 }
 
@@ -588,7 +1251,17 @@ WorkerPoll *workerp_create_poll(Worker **ws, int n)
  */
 int workerp_poll(WorkerPoll *p)
 {
-    return poll(p->fds, p->nfds, 500);
+    return workerp_poll_timeout(p, 500);
+}
+
+/**
+ * Same as workerp_poll, but waits at most timeout milliseconds
+ * instead of the default 500ms. A negative timeout waits
+ * indefinitely.
+ */
+int workerp_poll_timeout(WorkerPoll *p, int timeout)
+{
+    return poll(p->fds, 2 * p->nfds + 1, timeout);
 }
 
 /**
@@ -596,7 +1269,7 @@ int workerp_poll(WorkerPoll *p)
  * Returns:
  *  0 if reading from this worker will not block (perhaps data is available).
  *  1 if reading from this worker will block (no data available).
- *  -1 if reading from the worker errored.
+ *  -1 if reading from the worker errored, or the worker hung up.
  * 
  * This method relies on the parallel between the array of Workers this
  * WorkerPoll was created for. If the Worker array changed between then and
@@ -609,7 +1282,92 @@ int workerp_check_after_poll(const WorkerPoll *p, int i)
         return 0;
     }
 
-    if (p->fds[i].revents & POLLERR)
+    // the worker closed its end of the pipe, most likely by dying.
+    if (p->fds[i].revents & (POLLERR | POLLHUP | POLLNVAL))
+    {
+        return -1;
+    }
+
+    return 1;
+}
+
+/**
+ * Replaces the i-th Worker polled on by this WorkerPoll, for example
+ * after it was restarted with worker_restart.
+ */
+void workerp_set_worker(WorkerPoll *p, int i, const Worker *w)
+{
+    p->fds[i].fd = w->fd_recv_read;
+    p->fds[i].revents = 0;
+    p->fds[p->nfds + 1 + i].fd = -1;
+    p->fds[p->nfds + 1 + i].revents = 0;
+}
+
+/**
+ * Polls the send end of the i-th Worker for writability if frames sent
+ * to it are still queued, and stops polling it otherwise. Call before
+ * every poll.
+ */
+void workerp_watch_send(WorkerPoll *p, int i, const Worker *w)
+{
+    struct pollfd *pfd = &p->fds[p->nfds + 1 + i];
+    pfd->fd = worker_flush_pending(w) ? w->fd_send_write : -1;
+    pfd->revents = 0;
+}
+
+/**
+ * Checks the send end of the i-th Worker after polled.
+ * Returns 0 if worker_flush can write to it, 1 if it can not or
+ * is not being watched, and -1 if it errored.
+ */
+int workerp_check_send(const WorkerPoll *p, int i)
+{
+    const struct pollfd *pfd = &p->fds[p->nfds + 1 + i];
+    if (pfd->fd == -1)
+    {
+        return 1;
+    }
+    if (pfd->revents & POLLOUT)
+    {
+        return 0;
+    }
+    if (pfd->revents & (POLLERR | POLLHUP | POLLNVAL))
+    {
+        return -1;
+    }
+    return 1;
+}
+
+/**
+ * Adds an input file descriptor (for example STDIN_FILENO) to be polled
+ * alongside the workers of this WorkerPoll. Only one input can be
+ * watched at a time; passing -1 stops watching the input.
+ */
+void workerp_watch_input(WorkerPoll *p, int fd)
+{
+    p->fds[p->nfds].fd = fd;
+    p->fds[p->nfds].revents = 0;
+}
+
+/**
+ * Checks the status of the watched input after polled.
+ * Returns the same values as workerp_check_after_poll, and
+ * 1 if no input is being watched.
+ */
+int workerp_check_input(const WorkerPoll *p)
+{
+    if (p->fds[p->nfds].fd == -1)
+    {
+        return 1;
+    }
+
+    // a hangup on the input still needs to be read to observe the EOF.
+    if (p->fds[p->nfds].revents & (POLLIN | POLLHUP))
+    {
+        return 0;
+    }
+
+    if (p->fds[p->nfds].revents & POLLERR)
     {
         return -1;
     }
@@ -6,8 +6,20 @@
 
 #define MAXWORKERS 10
 
+// number of power-of-two buckets in the latency histogram of a worker,
+// and the most unanswered queries whose send time is remembered.
+#define WORKER_LATENCY_BUCKETS 32
+#define WORKER_MAX_OUTSTANDING 64
+
+// returned by worker_recv when a remote worker has not sent a whole
+// record yet.
+#define WORKER_RECV_AGAIN (-2)
+
 #include <sys/poll.h>
 
+#include "lookup.h"
+#include "monotime.h"
+
 // FreqRecord APIs
 
 /**
@@ -27,6 +39,12 @@ typedef struct
  */
 FreqRecord *get_word(char *word, Node *head, char **file_names);
 
+/**
+ * Same as get_word, but finds the word with a lookup in the table
+ * instead of walking the list.
+ */
+FreqRecord *lookup_word(char *word, const WordTable *table, char **file_names);
+
 /**
  * Pretty-prints the frequency records for the provided FreqRecord
  * array.
@@ -40,6 +58,46 @@ void print_freq_records(FreqRecord *frp);
  */
 void run_worker(char *dirname, int in, int out);
 
+/**
+ * A contiguous run of the words of an index directory. Large indexes are
+ * cut into slices of about the same number of words, so that searching
+ * them can be spread evenly across a pool of workers.
+ *
+ * Every slice has its own list, holding only its words, but shares the
+ * filenames array of its directory with the other slices.
+ */
+typedef struct
+{
+    Node *head;
+    char **filenames;
+    int nwords;
+    WordTable *table;
+} IndexSlice;
+
+/**
+ * Loads the index of the given directory, returning the number of words
+ * in it. See read_list.
+ */
+int load_index(const char *dirname, Node **head, char ***filenames);
+
+/**
+ * Cuts the list of nwords words into slices of at most target words each,
+ * splitting the list in place, and stores them in slices, which must have
+ * room for nwords / target + 1 slices. A lookup table is built for
+ * every slice.
+ *
+ * Returns the number of slices stored. An empty list is a single
+ * empty slice.
+ */
+int split_index(Node *head, char **filenames, int nwords, int target, IndexSlice *slices);
+
+/**
+ * Reads tasks (see wire_send_task) from the in file descriptor, searches
+ * the slice each task names for its word, then writes the result to the
+ * out file descriptor, exactly as run_worker does.
+ */
+void run_pool_worker(const IndexSlice *slices, int nslices, int in, int out);
+
 // -- Utility APIs
 
 /**
@@ -90,6 +148,17 @@ void ma_clear(MasterArray *array);
  */
 void ma_print_array(MasterArray *array);
 
+/**
+ * Returns the number of records in the master array.
+ */
+int ma_count(const MasterArray *array);
+
+/**
+ * Returns the records of the master array, sorted from most
+ * to least frequent. Only the first ma_count records are valid.
+ */
+const FreqRecord *ma_records(const MasterArray *array);
+
 // --- Worker APIs
 
 /**
@@ -136,11 +205,39 @@ typedef struct workerpoll_s WorkerPoll;
  * Instead, Workers should be manipulated only by the worker_* APIs
  * in worker.h to prevent any resource leaks.
  * 
+ * Returns NULL if the dirname does not fit in PATHLENGTH.
+ *
  * Remember to always free this worker after use with
  * worker_free.
  */
 Worker *worker_create(const char *dirname);
 
+/**
+ * Creates a heap-allocated worker for a remote query node listening on
+ * hostport (of the form host:port), that serves its own index directories
+ * over TCP. See wire.h for the protocol.
+ *
+ * The connection is only made once the worker is started with
+ * worker_start_run, and is remade by worker_restart. Otherwise, a remote
+ * worker is used exactly like a local one.
+ */
+Worker *worker_connect(const char *hostport);
+
+/**
+ * Creates a heap-allocated pool worker, which can search any of the
+ * nslices slices instead of a single directory, named label.
+ *
+ * The slices are searched by the worker's process from the memory of
+ * the process that starts it, so they must stay valid and unchanged for
+ * as long as the worker may be (re)started. Since processes are forked,
+ * every pool worker shares the same copy of the slices.
+ *
+ * Pool workers are sent tasks with worker_send_task, and are otherwise
+ * used exactly like any other worker. Returns NULL if the label does not
+ * fit in PATHLENGTH.
+ */
+Worker *worker_create_pool(const char *label, const IndexSlice *slices, int nslices);
+
 /**
  * Asynchronously begins the run loop for this worker. The worker will 
  * have its pipes remained open for write and read from the calling 
@@ -162,6 +259,11 @@ Worker *worker_create(const char *dirname);
  * 
  * This method will never return on the spawned process, and instead
  * will exit early.
+ *
+ * For a remote worker, this method connects to the node instead,
+ * returning 0 on success.
+ *
+ * Returns -1 if the worker could not be started.
  */
 int worker_start_run(Worker *w);
 
@@ -170,23 +272,71 @@ int worker_start_run(Worker *w);
  */
 void worker_free(Worker *w);
 
+/**
+ * Returns the PID of the process running this worker, or -1
+ * if the worker is not running.
+ */
+int worker_pid(const Worker *w);
+
+/**
+ * Forcefully stops the process running this worker, and closes
+ * every pipe to it. The process is not reaped; it is expected to
+ * be reaped by the caller's SIGCHLD handling.
+ *
+ * The Worker itself remains valid and may be restarted with
+ * worker_restart.
+ */
+void worker_kill(Worker *w);
+
+/**
+ * Starts a replacement process for a worker that has died or was
+ * stopped with worker_kill, using a fresh pair of pipes.
+ *
+ * Since the pipes are replaced, any WorkerPoll containing this
+ * Worker must be updated with workerp_set_worker afterwards.
+ *
+ * Returns the PID of the replacement process, 0 for a remote worker
+ * that reconnected, or -1 on failure.
+ */
+int worker_restart(Worker *w);
+
 /**
  * Send a word to the given worker.
  * 
- * This method returns the result of the underlying
- * write call that writes to the input pipe created for
- * the given worker by worker_create: the number of bytes
- * written to the pipe.
- * 
- * If the word written is greater than 31 characters, it 
- * will be truncated. This method mutates the worker
- * due to reusing an underlying buffer for the write.
+ * The word is sent whole as a query frame (see wire.h), so it
+ * must be at most MAXLINE characters long for the worker to accept it.
+ * The send never blocks: whatever the send end can not take right away
+ * is queued, and written by worker_flush once it can.
  * 
- * If the pipe has been closed previously,
- * this method returns 0.
+ * Returns the size of the frame, 0 if the pipe has been closed
+ * previously, or -1 on error.
  */
 ssize_t worker_send(Worker *w, const char *word);
 
+/**
+ * Sends a pool worker the task of searching the given slice for the word,
+ * without blocking, like worker_send.
+ *
+ * Returns the size of the frame, 0 if the pipe has been closed
+ * previously, or -1 on error.
+ */
+ssize_t worker_send_task(Worker *w, int slice, const char *word);
+
+/**
+ * Writes as much of the frames queued for the worker as its send end
+ * takes without blocking.
+ *
+ * Returns 0 once nothing is left queued, 1 if some of it still has to
+ * wait for the send end to be writable, or -1 on error.
+ */
+int worker_flush(Worker *w);
+
+/**
+ * Returns whether frames sent to the worker are still queued, waiting
+ * for its send end to be writable.
+ */
+int worker_flush_pending(const Worker *w);
+
 /**
  * Waits and receives for a FreqRecord from this worker.
  *
@@ -197,8 +347,68 @@ ssize_t worker_send(Worker *w, const char *word);
  * 
  * If the pipe has been closed previously,
  * this method returns 0.
+ *
+ * A remote worker is read without blocking, so a node that stalls
+ * halfway through a record never holds up the caller: the part read so
+ * far is kept, and WORKER_RECV_AGAIN is returned until the rest arrives.
+ * Several records may be read at once; check worker_recv_buffered
+ * before polling again.
  */
-ssize_t worker_recv(const Worker *w, FreqRecord *record);
+ssize_t worker_recv(Worker *w, FreqRecord *record);
+
+/**
+ * Returns whether a whole record from the worker is already buffered,
+ * so that worker_recv returns it without reading. Polling the worker
+ * does not report it, since it has already been read.
+ */
+int worker_recv_buffered(const Worker *w);
+
+/**
+ * Counters kept by worker_send and worker_recv about the traffic to
+ * and from a worker. Times are in microseconds of the monotonic clock.
+ *
+ * A query's latency runs from the completion of its worker_send to the
+ * worker_recv of the sentinel ending its answer. Bucket i of the
+ * histogram counts latencies below 2^i microseconds, and the last
+ * bucket counts every longer one.
+ */
+typedef struct
+{
+    long long sent;
+    long long answered;
+    long long records;
+    long long bytes_out;
+    long long bytes_in;
+    long long errors;
+    long long restarts;
+    int outstanding;
+    long long last_send_us;
+    long long last_recv_us;
+    long long latency_sum_us;
+    long long latency_max_us;
+    long long latency_hist[WORKER_LATENCY_BUCKETS];
+} WorkerStats;
+
+/**
+ * Returns the counters kept about the traffic to and from this worker.
+ */
+const WorkerStats *worker_stats(const Worker *w);
+
+/**
+ * Writes the counters of this worker to fp as a "worker" line of
+ * key=value pairs, followed by a "latency" line listing the non-empty
+ * buckets of its latency histogram as le_<bound>us=count, where a
+ * query took less than bound microseconds to answer.
+ *
+ * Times are given relative to now, in microseconds of the monotonic
+ * clock (see monotonic_us).
+ */
+void worker_print_stats(const Worker *w, FILE *fp, long long now);
+
+/**
+ * Returns the directory that this worker searches on.
+ */
+const char *worker_path(const Worker *w);
 
 /**
  * Creates a worker poll, parallel to the provided worker array.
@@ -235,12 +445,19 @@ WorkerPoll *workerp_create_poll(Worker **ws, int n);
  */
 int workerp_poll(WorkerPoll *w);
 
+/**
+ * Same as workerp_poll, but waits at most timeout milliseconds
+ * instead of the default 500ms. A negative timeout waits
+ * indefinitely.
+ */
+int workerp_poll_timeout(WorkerPoll *w, int timeout);
+
 /**
  * Checks the status of workers after polled.
  * Returns:
  *  0 if reading from this worker will not block (perhaps data is available).
  *  1 if reading from this worker will block (no data available).
- *  -1 if reading from the worker errored.
+ *  -1 if reading from the worker errored, or the worker hung up.
  * 
  * This method relies on the parallel between the array of Workers this
  * WorkerPoll was created for. If the Worker array changed between then and
@@ -248,6 +465,40 @@ int workerp_poll(WorkerPoll *w);
  */
 int workerp_check_after_poll(const WorkerPoll *w, int i);
 
+/**
+ * Replaces the i-th Worker polled on by this WorkerPoll, for example
+ * after it was restarted with worker_restart.
+ */
+void workerp_set_worker(WorkerPoll *w, int i, const Worker *worker);
+
+/**
+ * Polls the send end of the i-th Worker for writability if frames sent
+ * to it are still queued, and stops polling it otherwise. Call before
+ * every poll.
+ */
+void workerp_watch_send(WorkerPoll *w, int i, const Worker *worker);
+
+/**
+ * Checks the send end of the i-th Worker after polled.
+ * Returns 0 if worker_flush can write to it, 1 if it can not or
+ * is not being watched, and -1 if it errored.
+ */
+int workerp_check_send(const WorkerPoll *w, int i);
+
+/**
+ * Adds an input file descriptor (for example STDIN_FILENO) to be polled
+ * alongside the workers of this WorkerPoll. Only one input can be
+ * watched at a time; passing -1 stops watching the input.
+ */
+void workerp_watch_input(WorkerPoll *w, int fd);
+
+/**
+ * Checks the status of the watched input after polled.
+ * Returns the same values as workerp_check_after_poll, and
+ * 1 if no input is being watched.
+ */
+int workerp_check_input(const WorkerPoll *w);
+
 
 // print macro for debug
 
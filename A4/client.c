@@ -1,45 +1,134 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <fcntl.h>
+#include <errno.h>
 #include <assert.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
 
 #include "client.h"
-#include "dynstr.h"
+#include "hcq.h"
+#include "panic.h"
 
 #define INPUT_BUFFER_SIZE 30
-#define OUTPUT_BUFFER_SIZE 2048
+
+// The size of the ring buffer holding input read from a client, and
+// the longest line a client may send. A client sending a longer
+// line is disconnected.
+#define INPUT_RING_SIZE 4096
+#define MAX_LINE_LENGTH 512
+#define OUTPUT_CHUNK_SIZE 4096
 #define INPUT_ARG_MAX_NUM 3
 #define DELIM " \n"
 
+// The most events handled for a single call to epoll_wait.
+#define MAX_EVENTS 64
+
+// The most output a client may leave unsent before being written to
+// again. A client this far behind is disconnected.
+#define OUTPUT_QUEUE_MAX (1 << 20)
+
+// The most output chunks sent by a single call to sendmsg.
+#define OUTPUT_IOV_MAX 16
+
+/**
+ * A chunk of output waiting to be sent to a client. The output queue of
+ * a client is a chain of chunks, so queueing a message never moves the
+ * output already queued.
+ */
+typedef struct output_chunk_s
+{
+    struct output_chunk_s *next;
+
+    // the bytes of data from start to end are still to be sent.
+    size_t start;
+    size_t end;
+    char data[OUTPUT_CHUNK_SIZE];
+} OutputChunk;
+
+/**
+ * A parting message posted to a ClientList by client_send_off, for the
+ * thread waiting on it to write to one of its clients. The client is
+ * named by its socket and serial number rather than by pointer, as it
+ * may be gone by the time the message is delivered.
+ */
+typedef struct notice_s
+{
+    struct notice_s *next;
+    int sock_fd;
+    unsigned long serial;
+    char *message;
+} Notice;
+
+// the serial number of the last client created, in any thread.
+static unsigned long last_serial = 0;
+
 /** forward declaration for find_network_newline */
-int find_network_newline(const char *buf, int n);
+int find_network_newline(Client *c);
 
 typedef struct client_s
 {
     // The file descriptor to the socket this client manages
     int sock_fd;
 
+    // A number given to no other client, so that the client can be told
+    // apart from a later one that happens to reuse its socket.
+    unsigned long serial;
+
     // The type of the client.
     ClientType type;
 
     // The client's username.
     char name[INPUT_BUFFER_SIZE + 1];
 
-    // The write buffer used to write to the owned socket.
-    char wbuffer[OUTPUT_BUFFER_SIZE];
+    // The queue of output not yet accepted by the owned socket,
+    // and the number of bytes in it.
+    OutputChunk *out_head;
+    OutputChunk *out_tail;
+    size_t out_bytes;
+
+    // whether the socket is watched for becoming writable.
+    bool watch_write;
+
+    // The ring buffer of input read from the owned socket but not yet
+    // consumed as messages: inlen bytes, starting at inhead. The first
+    // inscan of them are known to hold no network newline.
+    char input[INPUT_RING_SIZE];
+    int inhead;
+    int inlen;
+    int inscan;
 
-    // The buffer used to store overflow reads.
-    char roverflow[INPUT_BUFFER_SIZE];
+    // whether the peer has shut down its side of the connection. The
+    // lines it sent before are still served, and the client is closed
+    // once none is left.
+    bool eof;
 
-    // The DynamicString buffer used to store in progress reads.
-    DynamicString *rbuffer;
+    // The length of the first message in the input, including its
+    // network newline, once the client is RS_RECV_RDY.
+    int msglen;
 
     // doubly-linked list members
     Client *next;
     Client *prev;
 
+    // the ClientList this client is attached to, and its neighbours in
+    // the list of clients closed since the last client_list_collect.
+    ClientList *list;
+    Client *next_closed;
+    Client *prev_closed;
+    bool closing;
+
+    // called by client_list_wait when the socket is ready to be read.
+    ClientCallback on_ready;
+    void *on_ready_data;
+
     // client state tracking.
     ClientRecvState recv;
     ClientPromptState state;
@@ -49,35 +138,102 @@ typedef struct client_list_s
 {
     // doubly-inked list members
     Client *root;
+    Client *tail;
+
+    // clients closed since the last client_list_collect.
+    Client *closed;
+
+    // every attached client, indexed by its socket file descriptor,
+    // which the kernel always picks as low as possible.
+    Client **by_fd;
+    int by_fd_cap;
 
-    // the set of file descrptors to monitor for each client in this ClientList.
-    fd_set fds;
-    int max_fd;
+    // the epoll instance every socket of this ClientList is registered with.
+    int epoll_fd;
 
     // the listener socket that this ClientList listens for new connections on.
     int sock_fd;
+
+    // called by client_list_wait for every newly accepted client.
+    ClientCallback on_accept;
+    void *on_accept_data;
+
+    // parting messages posted by client_send_off, in order, and the
+    // eventfd that wakes client_list_wait up to deliver them.
+    pthread_mutex_t inbox_lock;
+    Notice *inbox_head;
+    Notice *inbox_tail;
+    int wake_fd;
 } client_list_s;
 
 ClientList *client_list_new(int sock_fd)
 {
     ClientList *ptr = calloc(1, sizeof(ClientList));
     ptr->root = NULL;
+    ptr->tail = NULL;
+    ptr->closed = NULL;
+    ptr->by_fd = NULL;
+    ptr->by_fd_cap = 0;
     ptr->sock_fd = sock_fd;
-    ptr->max_fd = sock_fd;
-    FD_ZERO(&ptr->fds);
-    FD_SET(sock_fd, &ptr->fds);
+
+    if ((ptr->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+    {
+        perror("server: epoll_create1");
+        exit(1);
+    }
+
+    // the listener is edge-triggered too, so it is drained on every
+    // wakeup and must never block.
+    int flags = fcntl(sock_fd, F_GETFL);
+    if (flags == -1 || fcntl(sock_fd, F_SETFL, flags | O_NONBLOCK) == -1)
+    {
+        perror("server: fcntl");
+        exit(1);
+    }
+
+    // the listener is told apart from the clients by its NULL pointer,
+    // and the wakeup eventfd by the pointer to the list itself.
+    struct epoll_event ev = {.events = EPOLLIN | EPOLLET, .data.ptr = NULL};
+    if (epoll_ctl(ptr->epoll_fd, EPOLL_CTL_ADD, sock_fd, &ev) == -1)
+    {
+        perror("server: epoll_ctl");
+        exit(1);
+    }
+
+    pthread_mutex_init(&ptr->inbox_lock, NULL);
+    if ((ptr->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1)
+    {
+        perror("server: eventfd");
+        exit(1);
+    }
+    ev.data.ptr = ptr;
+    if (epoll_ctl(ptr->epoll_fd, EPOLL_CTL_ADD, ptr->wake_fd, &ev) == -1)
+    {
+        perror("server: epoll_ctl");
+        exit(1);
+    }
     return ptr;
 }
 
+ClientList *client_list_on_accept(ClientList *l, ClientCallback cb, void *data)
+{
+    l->on_accept = cb;
+    l->on_accept_data = data;
+    return l;
+}
+
 Client *client_new(int sock_fd)
 {
     Client *ptr = calloc(1, sizeof(Client));
     ptr->sock_fd = sock_fd;
+    ptr->serial = __atomic_add_fetch(&last_serial, 1, __ATOMIC_RELAXED);
     ptr->type = CLIENT_UNSET;
     ptr->state = S_PROMPT_USERNAME;
     ptr->next = NULL;
     ptr->prev = NULL;
-    ptr->rbuffer = NULL;
+    ptr->inhead = 0;
+    ptr->inlen = 0;
+    ptr->inscan = 0;
     ptr->recv = RS_RECV_PREP;
     return ptr;
 }
@@ -128,31 +284,49 @@ Client *client_set_type(Client *c, ClientType type)
     c->type = type;
     return c;
 }
+
+Client *client_on_ready(Client *c, ClientCallback cb, void *data)
+{
+    c->on_ready = cb;
+    c->on_ready_data = data;
+    return c;
+}
+
 ClientList *client_list_append(ClientList *l, Client *c)
 {
-    if (l->root == NULL)
+    c->prev = l->tail;
+    c->next = NULL;
+    if (l->tail == NULL)
     {
         l->root = c;
     }
     else
     {
+        l->tail->next = c;
+    }
+    l->tail = c;
+    c->list = l;
 
-        Client *last = l->root;
-        while (last->next != NULL)
+    if (c->sock_fd >= l->by_fd_cap)
+    {
+        int cap = l->by_fd_cap ? l->by_fd_cap : 64;
+        while (cap <= c->sock_fd)
         {
-            last = last->next;
+            cap *= 2;
         }
-        // at this point last is the last real student in the overall list
-        last->next = c;
-        c->prev = last;
-        c->next = NULL;
+        l->by_fd = parealloc(l->by_fd, sizeof(Client *) * cap);
+        memset(&l->by_fd[l->by_fd_cap], 0, sizeof(Client *) * (cap - l->by_fd_cap));
+        l->by_fd_cap = cap;
     }
+    l->by_fd[c->sock_fd] = c;
 
-    FD_SET(c->sock_fd, &l->fds);
-
-    if (c->sock_fd > l->max_fd)
+    // hang-ups are reported as readable, and noticed by the next read.
+    // Sockets are only watched for becoming writable while output is queued.
+    struct epoll_event ev = {.events = EPOLLIN | EPOLLRDHUP | EPOLLET, .data.ptr = c};
+    if (epoll_ctl(l->epoll_fd, EPOLL_CTL_ADD, c->sock_fd, &ev) == -1)
     {
-        l->max_fd = c->sock_fd;
+        perror("server: epoll_ctl");
+        client_close(c);
     }
     return l;
 }
@@ -165,34 +339,173 @@ int client_fd(Client *c)
 void client_close(Client *c)
 {
     c->recv = RS_DISCONNECTED;
+
+    // queue the client up to be freed by client_list_collect, so that
+    // collecting does not have to look at every client.
+    if (c->list != NULL && !c->closing)
+    {
+        c->closing = true;
+        c->prev_closed = NULL;
+        c->next_closed = c->list->closed;
+        if (c->next_closed != NULL)
+        {
+            c->next_closed->prev_closed = c;
+        }
+        c->list->closed = c;
+    }
 }
 
-ClientSocketSet client_list_fdset_clone(ClientList *l)
+void client_send_off(Client *c, const char *message)
 {
-    return l->fds;
+    ClientList *l = c->list;
+    Notice *n = pamalloc(sizeof(Notice));
+    n->next = NULL;
+    n->sock_fd = c->sock_fd;
+    n->serial = c->serial;
+    n->message = pamalloc(strlen(message) + 1);
+    strcpy(n->message, message);
+
+    pthread_mutex_lock(&l->inbox_lock);
+    if (l->inbox_tail == NULL)
+    {
+        l->inbox_head = n;
+    }
+    else
+    {
+        l->inbox_tail->next = n;
+    }
+    l->inbox_tail = n;
+    pthread_mutex_unlock(&l->inbox_lock);
+
+    uint64_t one = 1;
+    if (write(l->wake_fd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+    {
+        perror("server: write to eventfd");
+    }
 }
 
-int client_list_select(ClientList *l, ClientSocketSet *out_fds)
+// helper function delivering the parting messages posted to the list
+// with client_send_off.
+void deliver_notices(ClientList *l)
 {
-    return select(l->max_fd + 1, out_fds, NULL, NULL, NULL);
+    uint64_t count;
+    while (read(l->wake_fd, &count, sizeof(count)) > 0)
+    {
+        // the eventfd is edge-triggered, so it is drained.
+    }
+
+    pthread_mutex_lock(&l->inbox_lock);
+    Notice *n = l->inbox_head;
+    l->inbox_head = l->inbox_tail = NULL;
+    pthread_mutex_unlock(&l->inbox_lock);
+
+    while (n != NULL)
+    {
+        Client *c = client_list_find(l, n->sock_fd);
+        if (c != NULL && c->serial == n->serial && c->recv != RS_DISCONNECTED)
+        {
+            client_write(c, n->message);
+            c->state = S_INVALID;
+            client_close(c);
+        }
+        Notice *next = n->next;
+        free(n->message);
+        free(n);
+        n = next;
+    }
+}
+
+int client_list_wait(ClientList *l, int timeout)
+{
+    struct epoll_event events[MAX_EVENTS];
+    int nready = epoll_wait(l->epoll_fd, events, MAX_EVENTS, timeout);
+    if (nready == -1)
+    {
+        return errno == EINTR ? 0 : -1;
+    }
+
+    for (int i = 0; i < nready; i++)
+    {
+        Client *c = events[i].data.ptr;
+        if (c == NULL)
+        {
+            client_list_accept_connection(l);
+            continue;
+        }
+        if (events[i].data.ptr == l)
+        {
+            deliver_notices(l);
+            continue;
+        }
+
+        // clients closed by an earlier callback are only freed
+        // by client_list_collect, so c is still valid here.
+        if (c->recv != RS_DISCONNECTED && c->out_head != NULL && (events[i].events & EPOLLOUT))
+        {
+            client_flush(c);
+        }
+        if (c->recv != RS_DISCONNECTED && c->on_ready != NULL &&
+            (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)))
+        {
+            c->on_ready(l, c, c->on_ready_data);
+        }
+    }
+    return nready;
 }
 
 // helper function to extract the client from the list
 void route_around_client(ClientList *l, Client *c)
 {
-    Client *current = l->root;
-    if (current == c)
+    if (c->prev == NULL)
     {
         l->root = c->next;
     }
     else
     {
-        while (current->next != c)
+        c->prev->next = c->next;
+    }
+
+    if (c->next == NULL)
+    {
+        l->tail = c->prev;
+    }
+    else
+    {
+        c->next->prev = c->prev;
+    }
+
+    // a client still queued up for collection is unqueued too.
+    if (c->closing)
+    {
+        if (c->prev_closed == NULL)
         {
-            current = current->next;
+            l->closed = c->next_closed;
         }
-        current->next = c->next;
+        else
+        {
+            c->prev_closed->next_closed = c->next_closed;
+        }
+        if (c->next_closed != NULL)
+        {
+            c->next_closed->prev_closed = c->prev_closed;
+        }
+        c->closing = false;
+    }
+
+    if (c->sock_fd >= 0 && c->sock_fd < l->by_fd_cap)
+    {
+        l->by_fd[c->sock_fd] = NULL;
+    }
+    c->next = c->prev = NULL;
+}
+
+Client *client_list_find(ClientList *l, int fd)
+{
+    if (fd < 0 || fd >= l->by_fd_cap)
+    {
+        return NULL;
     }
+    return l->by_fd[fd];
 }
 
 Client *client_list_remove(ClientList *l, Client *c, Ta **ta_list, Student **student_list)
@@ -210,8 +523,15 @@ Client *client_list_remove(ClientList *l, Client *c, Ta **ta_list, Student **stu
     route_around_client(l, c);
 
     // Free and remove from queue any
-    // associated students or TAs.
+    // associated students or TAs. A student who has already been
+    // taken by a TA is no longer waiting, and another student may
+    // have joined the queue under the same name since.
+    Student *waiting = NULL;
     if (c->type == CLIENT_STUDENT && c->state != S_INVALID)
+    {
+        waiting = find_student(*student_list, c->name);
+    }
+    if (waiting != NULL && waiting->client == c)
     {
         give_up_waiting(student_list, c->name);
     }
@@ -220,12 +540,26 @@ Client *client_list_remove(ClientList *l, Client *c, Ta **ta_list, Student **stu
         remove_ta(ta_list, student_list, c->name);
     }
 
-    // Clear the socket from the set to listen to,
+    // Give queued output, such as a parting message, a last chance
+    // to be sent, then drop whatever is left.
+    bool sending = c->sock_fd >= 0;
+    while (c->out_head != NULL)
+    {
+        OutputChunk *chunk = c->out_head;
+        size_t left = chunk->end - chunk->start;
+        if (sending && send(c->sock_fd, chunk->data + chunk->start, left, MSG_NOSIGNAL) != (ssize_t)left)
+        {
+            sending = false;
+        }
+        c->out_head = chunk->next;
+        free(chunk);
+    }
+
+    // Remove the socket from the epoll instance,
     // if the socket is still valid.
-    // Not checking for this may cause a segfault...
-    if (c->sock_fd <= FD_SETSIZE && c->sock_fd >= 0)
+    if (c->sock_fd >= 0)
     {
-        FD_CLR(c->sock_fd, &l->fds);
+        epoll_ctl(l->epoll_fd, EPOLL_CTL_DEL, c->sock_fd, NULL);
 
         // We do not care about the return value of this close call.
         // If it fails, the client is destroyed regardless.
@@ -245,44 +579,66 @@ Client *client_list_remove(ClientList *l, Client *c, Ta **ta_list, Student **stu
 
 ClientList *client_list_collect(ClientList *l, Ta **ta_list, Student **student_list)
 {
-
-    for (Client *c = client_iter_begin(l); c != NULL;)
+    while (l->closed != NULL)
     {
-        if (c ->recv == RS_DISCONNECTED) {
-            Client *next = client_iter_next(c);
-            client_list_remove(l, c, ta_list, student_list);
-            c = next;
-        } else {
-            c = client_iter_next(c);
-        }
-
+        Client *c = l->closed;
+        client_list_remove(l, c, ta_list, student_list);
     }
     return l;
 }
 
 void client_list_accept_connection(ClientList *l)
 {
-    int client_fd = accept(l->sock_fd, NULL, NULL);
-    if (client_fd < 0)
+    // the listener is edge-triggered, so accept until nothing is pending.
+    while (1)
     {
-        perror("server: accept");
-        close(l->sock_fd);
-        exit(1);
-    }
+        int client_fd = accept4(l->sock_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_fd < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return;
+            }
+            if (errno == EINTR || errno == ECONNABORTED)
+            {
+                continue;
+            }
+            // out of descriptors, for example; the connections left pending
+            // are accepted once the next one arrives.
+            perror("server: accept");
+            return;
+        }
 
-    Client *c = client_new(client_fd);
-    client_list_append(l, c);
+        Client *c = client_new(client_fd);
+        client_list_append(l, c);
+        if (l->on_accept != NULL && c->recv != RS_DISCONNECTED)
+        {
+            l->on_accept(l, c, l->on_accept_data);
+        }
+    }
 }
 
 char *client_ready_message(Client *c)
 {
-    // ds_into_raw_* will consume the DynamicString, returning
-    // the string contents.
-    char *ptr = ds_into_raw_truncate(c->rbuffer, INPUT_BUFFER_SIZE);
-    c->recv = RS_RECV_PREP;
+    if (c->recv != RS_RECV_RDY)
+    {
+        return NULL;
+    }
+
+    // the message is truncated, but the whole line is consumed.
+    int len = c->msglen - 2 < INPUT_BUFFER_SIZE ? c->msglen - 2 : INPUT_BUFFER_SIZE;
+    char *ptr = pamalloc(len + 1);
+    for (int i = 0; i < len; i++)
+    {
+        ptr[i] = c->input[(c->inhead + i) % INPUT_RING_SIZE];
+    }
+    ptr[len] = '\0';
 
-    // rbuffer was freed by the call to ds_into_raw, so we set it to NULL.
-    c->rbuffer = NULL;
+    c->inhead = (c->inhead + c->msglen) % INPUT_RING_SIZE;
+    c->inlen -= c->msglen;
+    c->inscan = 0;
+    c->msglen = 0;
+    c->recv = RS_RECV_PREP;
     return ptr;
 }
 
@@ -291,40 +647,195 @@ ClientRecvState client_recv_state(Client *c)
     return c->recv;
 }
 
-int client_write(Client *c, const char *message)
+// helper function to watch the socket for becoming writable
+// only while there is output queued for it.
+void watch_writable(Client *c, bool watch)
+{
+    if (c->watch_write == watch || c->list == NULL)
+    {
+        return;
+    }
+
+    uint32_t events = EPOLLIN | EPOLLRDHUP | EPOLLET | (watch ? EPOLLOUT : 0);
+    struct epoll_event ev = {.events = events, .data.ptr = c};
+    if (epoll_ctl(c->list->epoll_fd, EPOLL_CTL_MOD, c->sock_fd, &ev) == -1)
+    {
+        perror("server: epoll_ctl");
+        client_close(c);
+        return;
+    }
+    c->watch_write = watch;
+}
+
+// helper function to append n bytes to the end of the output queue.
+void queue_output(Client *c, const char *buf, size_t n)
+{
+    while (n > 0)
+    {
+        if (c->out_tail == NULL || c->out_tail->end == OUTPUT_CHUNK_SIZE)
+        {
+            OutputChunk *chunk = pamalloc(sizeof(OutputChunk));
+            chunk->next = NULL;
+            chunk->start = 0;
+            chunk->end = 0;
+            if (c->out_tail == NULL)
+            {
+                c->out_head = chunk;
+            }
+            else
+            {
+                c->out_tail->next = chunk;
+            }
+            c->out_tail = chunk;
+        }
+
+        size_t room = OUTPUT_CHUNK_SIZE - c->out_tail->end;
+        size_t copy = n < room ? n : room;
+        memcpy(c->out_tail->data + c->out_tail->end, buf, copy);
+        c->out_tail->end += copy;
+        c->out_bytes += copy;
+        buf += copy;
+        n -= copy;
+    }
+}
+
+int client_flush(Client *c)
 {
     if (c->sock_fd == -1 || c->recv == RS_DISCONNECTED)
         return -1;
 
-    memset(c->wbuffer, 0, OUTPUT_BUFFER_SIZE);
-    snprintf(c->wbuffer, OUTPUT_BUFFER_SIZE - 1, "%s", message);
-    int nbytes = write(c->sock_fd, c->wbuffer, strlen(c->wbuffer));
-
-    if (nbytes == -1)
+    while (c->out_head != NULL)
     {
-        printf("Tried to write to broken pipe, marking client as dead\n");
-        c->recv = RS_DISCONNECTED;
+        // send as many chunks as possible at once.
+        struct iovec iov[OUTPUT_IOV_MAX];
+        int niov = 0;
+        for (OutputChunk *chunk = c->out_head; chunk != NULL && niov < OUTPUT_IOV_MAX; chunk = chunk->next)
+        {
+            iov[niov].iov_base = chunk->data + chunk->start;
+            iov[niov].iov_len = chunk->end - chunk->start;
+            niov++;
+        }
+
+        struct msghdr msg = {.msg_iov = iov, .msg_iovlen = niov};
+        ssize_t nbytes = sendmsg(c->sock_fd, &msg, MSG_NOSIGNAL);
+        if (nbytes == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                // the rest is sent once the socket is writable again.
+                watch_writable(c, true);
+                return 0;
+            }
+            printf("Tried to write to broken pipe, marking client as dead\n");
+            client_close(c);
+            return -1;
+        }
+
+        c->out_bytes -= nbytes;
+        while (nbytes > 0)
+        {
+            OutputChunk *chunk = c->out_head;
+            size_t left = chunk->end - chunk->start;
+            if ((size_t)nbytes < left)
+            {
+                chunk->start += nbytes;
+                break;
+            }
+            nbytes -= left;
+            c->out_head = chunk->next;
+            free(chunk);
+        }
+        if (c->out_head == NULL)
+        {
+            c->out_tail = NULL;
+        }
     }
-    return nbytes;
+
+    watch_writable(c, false);
+    return 0;
 }
 
-int client_prep_read(Client *c)
+int client_write(Client *c, const char *message)
 {
-    if (c->recv != RS_RECV_PREP || c->rbuffer != NULL)
+    if (c->sock_fd == -1 || c->recv == RS_DISCONNECTED)
+        return -1;
+
+    // a client that has not taken in what it was sent before is
+    // not sent any more.
+    if (c->out_bytes > OUTPUT_QUEUE_MAX)
     {
+        printf("Client %d fell too far behind, marking client as dead\n", c->sock_fd);
+        client_close(c);
         return -1;
     }
-    c->rbuffer = ds_new();
 
-    // push overflow into the read buffer.
-    if (c->roverflow[0] != '\0')
+    size_t len = strlen(message);
+    size_t sent = 0;
+
+    // with nothing queued, the message is sent straight from the
+    // caller, and only what the socket does not take is queued.
+    if (c->out_head == NULL)
     {
-        printf("Refreshed overflow |%s|\n", c->roverflow);
-        ds_append(c->rbuffer, c->roverflow);
-        memset(c->roverflow, 0, INPUT_BUFFER_SIZE);
+        ssize_t nbytes;
+        do
+        {
+            nbytes = send(c->sock_fd, message, len, MSG_NOSIGNAL);
+        } while (nbytes == -1 && errno == EINTR);
+
+        if (nbytes == -1 && errno != EAGAIN && errno != EWOULDBLOCK)
+        {
+            printf("Tried to write to broken pipe, marking client as dead\n");
+            client_close(c);
+            return -1;
+        }
+        sent = nbytes > 0 ? nbytes : 0;
+    }
+
+    if (sent < len)
+    {
+        queue_output(c, message + sent, len - sent);
+        watch_writable(c, true);
     }
+    return len;
+}
+
+// helper function to mark the client as ready if a whole message has
+// been read, or as disconnected if it sent a line that is too long.
+// Returns whether a message is ready.
+bool check_ready(Client *c)
+{
+    int newline = find_network_newline(c);
+    if ((newline == -1 && c->inlen > MAX_LINE_LENGTH + 1) || newline > MAX_LINE_LENGTH + 2)
+    {
+        printf("Client %d sent a line that is too long, marking client as dead\n", c->sock_fd);
+        client_write(c, "Line too long. Good-bye.\r\n");
+        client_close(c);
+        return false;
+    }
+    if (newline == -1)
+    {
+        return false;
+    }
+
+    c->msglen = newline;
+    c->recv = RS_RECV_RDY;
+    return true;
+}
 
+int client_prep_read(Client *c)
+{
+    if (c->recv != RS_RECV_PREP)
+    {
+        return -1;
+    }
     c->recv = RS_RECV_NOT_RDY;
+
+    // a message pipelined behind the last one may already be here.
+    check_ready(c);
     return 0;
 }
 
@@ -341,52 +852,87 @@ int client_read(Client *c)
     {
         return -1;
     }
-
-    char buf[INPUT_BUFFER_SIZE + 3] = {'\0'};
-    int nbytes = read(c->sock_fd, buf, INPUT_BUFFER_SIZE);
-    if (nbytes <= 0)
+    if (c->eof)
     {
-        printf("Tried to read from broken pipe, marking client as dead\n");
-        c->recv = RS_DISCONNECTED;
+        // nothing more will arrive, and no whole line is left.
+        printf("Client %d hung up, marking client as dead\n", c->sock_fd);
+        client_close(c);
         return -1;
     }
-    int crlf = -1;
-    if ((crlf = find_network_newline(buf, INPUT_BUFFER_SIZE)) == -1)
-    {
-        // no newline found, append the entire thing
-        ds_append(c->rbuffer, buf);
-    }
-    else
+
+    // read as much as there is, and as fits, into the free part of the
+    // ring, which wraps around at most once.
+    int total = 0;
+    while (c->inlen < INPUT_RING_SIZE)
     {
-        buf[crlf - 2] = '\0';
+        int tail = (c->inhead + c->inlen) % INPUT_RING_SIZE;
+        int free_bytes = INPUT_RING_SIZE - c->inlen;
+        struct iovec iov[2];
+        int niov = 1;
+        iov[0].iov_base = c->input + tail;
+        iov[0].iov_len = tail + free_bytes <= INPUT_RING_SIZE ? free_bytes : INPUT_RING_SIZE - tail;
+        if (iov[0].iov_len < (size_t)free_bytes)
+        {
+            iov[1].iov_base = c->input;
+            iov[1].iov_len = free_bytes - iov[0].iov_len;
+            niov = 2;
+        }
 
-        // put overflow reads into the overflow buffer.
-        memset(c->roverflow, 0, INPUT_BUFFER_SIZE);
-        memcpy(c->roverflow, &buf[crlf], INPUT_BUFFER_SIZE - crlf);
+        struct msghdr msg = {.msg_iov = iov, .msg_iovlen = niov};
+        ssize_t nbytes = recvmsg(c->sock_fd, &msg, MSG_DONTWAIT);
+        if (nbytes == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (nbytes == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            // drained; wait for the socket to become ready again.
+            break;
+        }
+        if (nbytes == 0)
+        {
+            // a client may send its last lines and shut down its side
+            // straight away; they are served before it is closed.
+            c->eof = true;
+            break;
+        }
+        if (nbytes == -1)
+        {
+            printf("Tried to read from broken pipe, marking client as dead\n");
+            client_close(c);
+            return -1;
+        }
+        c->inlen += nbytes;
+        total += nbytes;
+    }
 
-        //todo: put remainin stuff in buffer.
-        ds_append(c->rbuffer, buf);
-        // flag as ready
-        c->recv = RS_RECV_RDY;
+    // with the ring full, the rest is read once the messages in it
+    // have been consumed.
+    if (!check_ready(c) && c->eof && c->recv != RS_DISCONNECTED)
+    {
+        printf("Client %d hung up, marking client as dead\n", c->sock_fd);
+        client_close(c);
     }
-    return nbytes;
+    return c->recv == RS_DISCONNECTED ? -1 : total;
 }
 
 /*
- * Search the first n characters of buf for a network newline (\r\n).
- * Return one plus the index of the '\n' of the first network newline,
- * or -1 if no network newline is found.
- * Definitely do not use strchr or other string functions to search here. (Why not?)
+ * Search the input of the client for a network newline (\r\n), starting
+ * where the last search left off.
+ * Return one plus the offset of the '\n' of the first network newline
+ * from the start of the input, or -1 if no network newline is found.
  */
-int find_network_newline(const char *buf, int n)
+int find_network_newline(Client *c)
 {
-    for (int i = 0; i < n - 1; i++)
+    for (int i = c->inscan; i < c->inlen - 1; i++)
     {
-        // if buf[i] is not CR, then we don't care about buf[i+1]
-        // if we're at buf[n -1], and buf[n-1] is not CR, then we don't care if buf[n] is CR.
-
-        if (buf[i] == '\r' && buf[i + 1] == '\n')
+        // if input[i] is not CR, then we don't care about input[i+1]
+        if (c->input[(c->inhead + i) % INPUT_RING_SIZE] == '\r' &&
+            c->input[(c->inhead + i + 1) % INPUT_RING_SIZE] == '\n')
             return i + 2; //LF is at i+1
     }
+
+    // the last byte may be a CR whose LF has not arrived yet.
+    c->inscan = c->inlen > 0 ? c->inlen - 1 : 0;
     return -1;
-}
\ No newline at end of file
+}
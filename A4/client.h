@@ -1,6 +1,5 @@
 #ifndef SRVMAN_H
 #define SRVMAN_H
-#include <sys/select.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -52,28 +51,39 @@ int remove_ta(Ta **ta_list_ptr, Student **stu_list_ptr, char *ta_name);
  * 
  * Each Client also implements a doubly linked list of other clients, but 
  * operations on this linked list of clients should be done within the 
- * context of a ClientList or the client_iter_* APIs.
+ * context of a ClientList or the client_iter_* APIs. Adding a Client to,
+ * removing a Client from, and finding a Client in a ClientList all take
+ * constant time.
  */
 typedef struct client_s Client;
 
 /**
- * A ClientList encapsulates a collection of Clients and their socket file 
- * descriptor set. 
+ * A ClientList encapsulates a collection of Clients and the epoll
+ * instance their sockets are registered with.
  * 
  * The Clients in this ClientList can not be manipulated on directly, and
  * should only be iterated on through the client_iter_* APIs. 
  * 
- * This list also serves as the context within which clients are selected
+ * This list also serves as the context within which clients are waited
  * on and their sockets kept track of, as well as being self-cleaning, 
  * ensuring that dead Clients are removed on the list.
+ * 
+ * Sockets are registered edge-triggered, so a Client is only reported
+ * ready when new data arrives. A readiness callback must therefore keep
+ * reading until client_read reports that nothing is left to read.
+ * 
+ * A ClientList and its Clients belong to the one thread waiting on it
+ * with client_list_wait. Other threads may only reach its Clients
+ * through client_send_off.
  */
 typedef struct client_list_s ClientList;
 
 /**
- * Type alias for fd_set returned by ClientList socket select
- * functions.
- */ 
-typedef fd_set ClientSocketSet;
+ * A callback run by client_list_wait for a Client that is ready
+ * to be read from, or for a Client that was just accepted. The data
+ * is the pointer given along with the callback.
+ */
+typedef void (*ClientCallback)(ClientList *l, Client *c, void *data);
 
 /**
  * The possible types of Client that the connected client could
@@ -280,15 +290,17 @@ Client *client_set_state(Client *c, ClientPromptState s);
 ClientRecvState client_recv_state(Client *c);
 
 /**
- * Writes a message to the Client's socket, returning
- * the number of bytes written.
+ * Writes a message to the Client's socket without blocking,
+ * returning the length of the message.
  * 
- * The message is automatically truncated to 2048 
- * characters before being sent to the socket for
- * security reasons.
+ * Whatever part of the message the socket does not take at once
+ * is queued, in order after any output queued before it, and sent
+ * by client_list_wait whenever the socket becomes writable. Messages
+ * are never truncated.
  * 
- * This function does not retry the write if the
- * message was not fully sent.
+ * A Client that still has more than a megabyte of earlier output
+ * queued is too far behind to be written to. Such a Client is marked
+ * as disconnected instead.
  * 
  * If the message fails to send, the given client is
  * marked as disconnected, and further communication
@@ -299,28 +311,51 @@ ClientRecvState client_recv_state(Client *c);
  */
 int client_write(Client *c, const char *message);
 
+/**
+ * Sends as much of the Client's queued output as its socket takes
+ * without blocking. Called by client_list_wait when the socket becomes
+ * writable; there is normally no need to call it directly.
+ * 
+ * Returns 0, or -1 if the Client is disconnected or the send fails,
+ * in which case the Client is marked as disconnected.
+ */
+int client_flush(Client *c);
+
 /**
  * Prepares the Client's socket read buffers for
  * reading, updating the Client's socket communication
  * state to RS_RECV_NOT_RDY.
  * 
+ * If a whole message was already read along with an
+ * earlier one, the state goes straight on to RS_RECV_RDY,
+ * and the message can be consumed without reading again.
+ * 
  * If the Client is not in the RS_RECV_PREP state, 
  * this function will return -1 and do nothing.
  */ 
 int client_prep_read(Client *c);
 
 /**
- * Reads up to 30 bytes from the client socket. If the read is
- * incomplete, or a network newline is not found, then
- * the resulting data is saved in an internal buffer for the
- * next read.
+ * Reads everything available from the client socket, without
+ * blocking, into a ring buffer of input, returning the number of
+ * bytes read. Several messages may be read at once; they are
+ * consumed one at a time, in order, with client_ready_message.
  * 
- * If the read has completed, then any overflow data will be saved
- * to a separate buffer for the next read. The Client will have its 
- * communication state changed to RS_RECV_RDY, and no further
+ * Once the first message in the buffer is complete, the Client will 
+ * have its communication state changed to RS_RECV_RDY, and no further
  * reads will be possible from this Client until client_ready_message
  * is called to retrieve the fully sent message.
  * 
+ * If nothing is available to read, 0 is returned and the Client
+ * is left as it is, to be read from again once it is ready.
+ * 
+ * A Client that sends a line longer than 512 characters is sent
+ * a parting message and marked as disconnected.
+ * 
+ * If the client has shut down its side of the connection, the
+ * lines it sent before are still served one at a time, and it is
+ * marked as disconnected once no whole line is left.
+ * 
  * If the read fails, the client will be marked as disconnected,
  * and further communication with the client is disabled.
  * 
@@ -331,17 +366,18 @@ int client_read(Client *c);
 
 /**
  * Retrieves (and consumes from the internal buffer), the
- * message that was read from the Client socket, returning
+ * first message that was read from the Client socket, returning
  * a pointer to the message.
  * 
  * Once the message is processed, it should be freed. Calling
- * this function automatically invalidates the Client's internal
- * read buffers until client_prep_read is called. It will also
- * change the socket communication state to RS_RECV_PREP, and
- * as such, can only be called once per fully-read message.
- * 
- * The returned string has newline characters stripped, and
- * is guaranteed to be null terminated.
+ * this function changes the socket communication state to 
+ * RS_RECV_PREP, and as such, can only be called once per
+ * fully-read message. Any messages read after it are kept
+ * for the following calls to client_prep_read.
+ * 
+ * The returned string has newline characters stripped, is
+ * truncated to 30 characters, and is guaranteed to be null
+ * terminated. Returns NULL if no message is ready.
  */
 char *client_ready_message(Client *c);
 
@@ -361,6 +397,24 @@ char *client_ready_message(Client *c);
  */ 
 void client_close(Client *c);
 
+/**
+ * Writes a parting message to the Client and then closes it, setting
+ * its state to S_INVALID, like a student who has been taken by a TA.
+ * 
+ * Unlike every other Client function, this may be called from any
+ * thread: the message is handed to the thread waiting on the Client's
+ * ClientList, and delivered by its next client_list_wait. The Client
+ * must not be freed while this function runs, but if it is disconnected
+ * before the message is delivered, the message is dropped.
+ */
+void client_send_off(Client *c, const char *message);
+
+/**
+ * Sets the callback run by client_list_wait whenever the Client
+ * becomes ready to be read from, replacing any previous one.
+ */
+Client *client_on_ready(Client *c, ClientCallback cb, void *data);
+
 /**
  * Returns the client at the root of the ClientList.
  *  
@@ -400,10 +454,18 @@ Client *client_iter_next(Client *c);
 
 /**
  * Creates a new ClientList context with the listener
- * socket file descriptor. 
+ * socket file descriptor. The listener is made non-blocking,
+ * and registered with the epoll instance of the ClientList.
  */
 ClientList *client_list_new(int sock_fd);
 
+/**
+ * Sets the callback run by client_list_wait for every newly
+ * accepted Client, typically to set its readiness callback with
+ * client_on_ready and to greet it.
+ */
+ClientList *client_list_on_accept(ClientList *l, ClientCallback cb, void *data);
+
 /**
  * Appends a Client to the end of this ClientList context,
  * attaching it to the context. 
@@ -426,19 +488,19 @@ ClientList *client_list_append(ClientList *l, Client *c);
  * with the same name as the Client's username will be removed
  * from the list and freed. 
  * 
- * The Client's socket file descriptor will also be cleared from
- * the set of file descriptors to be selected on from 
- * client_list_select.
+ * The Client's socket file descriptor will also be removed from
+ * the epoll instance waited on by client_list_wait.
  * 
  * If the Client's state is S_INVALID, and it has a ClientType of 
- * CLIENT_STUDENT, no attempt will be made to free the student.
+ * CLIENT_STUDENT, no attempt will be made to free the student. Nor
+ * will there be if the waiting student of that name is another Client's.
  */ 
 Client *client_list_remove(ClientList *l, Client *c, Ta **ta_list, Student **student_list);
 
 /**
- * Iterates through all Clients in the ClientList context,
- * and removes those that have a socket communication state
- * of RS_DISCONNECTED. 
+ * Removes every Client in the ClientList context that has
+ * a socket communication state of RS_DISCONNECTED. Only the
+ * Clients closed since the last collection are visited.
  * 
  * client_list_remove will be called on such sockets, freeing
  * all owned resources. See client_list_remove for a full
@@ -453,27 +515,35 @@ ClientList *client_list_collect(ClientList *l, Ta **ta_list, Student **student_l
 int client_fd(Client *c);
 
 /**
- * Waits until one or more Clients (their underlying sockets)
- * are ready to be read from, returning the number of file
- * descriptors ready to be read.
- * 
- * The provied ClientSocketSet is simply a type alias for
- * an fd_set, and standard FD_* macros can and should be used
- * to query the set.
+ * Returns the Client of the ClientList context communicating
+ * over the given socket file descriptor, or NULL if there is
+ * none.
  */
-int client_list_select(ClientList *l, ClientSocketSet *out_fds);
+Client *client_list_find(ClientList *l, int fd);
 
 /**
- * Returns a copy of the ClientList's internal file descriptor
- * set for use with client_list_select.
- */ 
-ClientSocketSet client_list_fdset_clone(ClientList *l);
+ * Waits up to timeout milliseconds (forever if -1) until one or more
+ * Clients (their underlying sockets) are ready to be read from, or new
+ * connections are pending, and runs the callbacks of those that are.
+ * 
+ * Pending connections are accepted with client_list_accept_connection,
+ * and the accept callback run for each of them. Clients with queued
+ * output whose sockets became writable have it sent (see client_flush),
+ * and every Client ready to be read from has its readiness callback run,
+ * unless it was closed in the meantime. Messages posted with
+ * client_send_off are delivered.
+ * 
+ * The cost of a call depends only on the number of ready sockets,
+ * not on the number of Clients in the ClientList. Returns the number
+ * of ready sockets, or -1 on error.
+ */
+int client_list_wait(ClientList *l, int timeout);
 
 /**
- * Accepts a pending connection on the listening socket
+ * Accepts every pending connection on the listening socket
  * managed by the ClientList, creating a new Client
- * to encapsulate socket communication with the
- * new connection.
+ * to encapsulate socket communication with each
+ * new connection, and running the accept callback on it.
  */
 void client_list_accept_connection(ClientList *l);
 
@@ -0,0 +1,148 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "hcq.h"
+#include "dynstr.h"
+#include "panic.h"
+
+/**
+ * A benchmark of building the full queue listing sent for the TA stats
+ * command, with a queue of many students.
+ *
+ * The listing is built three ways: by copying the whole string on every
+ * append, as DynamicString used to; with print_full_queue; and by reusing
+ * a single DynamicString for every listing. Results are reported as
+ * key=value lines on standard output.
+ */
+
+long long now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+// Appends s to *raw the way ds_append used to: by formatting a
+// brand-new string out of the old one and s.
+void copying_append(char **raw, const char *s)
+{
+    char *new_ptr;
+    paasprintf(&new_ptr, "%s%s", *raw, s);
+    free(*raw);
+    *raw = new_ptr;
+}
+
+char *copying_full_queue(Student *stu_list)
+{
+    char *raw = strdup("Full Queue\r\n");
+    char *buf;
+    while (stu_list != NULL)
+    {
+        paasprintf(&buf, "Student %s:%s\r\n", stu_list->name, stu_list->course->code);
+        copying_append(&raw, buf);
+        free(buf);
+        stu_list = stu_list->next_overall;
+    }
+    return raw;
+}
+
+// Builds the listing into ds, reusing its capacity.
+void reused_full_queue(DynamicString *ds, Student *stu_list)
+{
+    ds_clear(ds);
+    ds_append(ds, "Full Queue\r\n");
+    while (stu_list != NULL)
+    {
+        ds_appendf(ds, "Student %s:%s\r\n", stu_list->name, stu_list->course->code);
+        stu_list = stu_list->next_overall;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    int nstudents = 10000;
+    int repeats = 5;
+    int ch;
+
+    while ((ch = getopt(argc, argv, "n:r:")) != -1)
+    {
+        switch (ch)
+        {
+        case 'n':
+            nstudents = atoi(optarg);
+            break;
+        case 'r':
+            repeats = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: dsbench [-n STUDENTS] [-r REPEATS]\n");
+            exit(1);
+        }
+    }
+    if (nstudents <= 0 || repeats <= 0)
+    {
+        fprintf(stderr, "dsbench: counts must be positive\n");
+        exit(1);
+    }
+
+    Course courses[3];
+    memset(courses, 0, sizeof(courses));
+    strcpy(courses[0].code, "CSC108");
+    strcpy(courses[1].code, "CSC148");
+    strcpy(courses[2].code, "CSC209");
+
+    // the queue is built directly, in arrival order, so that only
+    // building the listing is timed.
+    Student *stu_list = NULL;
+    for (int i = nstudents - 1; i >= 0; i--)
+    {
+        Student *s = pacalloc(1, sizeof(Student));
+        paasprintf(&s->name, "student%05d", i);
+        s->course = &courses[i % 3];
+        s->next_overall = stu_list;
+        stu_list = s;
+    }
+
+    long long started = now_us();
+    size_t len = 0;
+    for (int r = 0; r < repeats; r++)
+    {
+        char *listing = copying_full_queue(stu_list);
+        len = strlen(listing);
+        free(listing);
+    }
+    long long copying = (now_us() - started) / repeats;
+
+    started = now_us();
+    for (int r = 0; r < repeats; r++)
+    {
+        char *listing = print_full_queue(stu_list);
+        if (strlen(listing) != len)
+        {
+            fprintf(stderr, "dsbench: listings differ\n");
+            exit(1);
+        }
+        free(listing);
+    }
+    long long growing = (now_us() - started) / repeats;
+
+    DynamicString *ds = ds_new();
+    started = now_us();
+    for (int r = 0; r < repeats; r++)
+    {
+        reused_full_queue(ds, stu_list);
+    }
+    long long reused = (now_us() - started) / repeats;
+    ds_free(ds);
+
+    printf("students=%d\n", nstudents);
+    printf("listing.bytes=%zu\n", len);
+    printf("copying.us_per_listing=%lld\n", copying);
+    printf("growing.us_per_listing=%lld\n", growing);
+    printf("reused.us_per_listing=%lld\n", reused);
+    return 0;
+}
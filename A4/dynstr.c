@@ -1,18 +1,26 @@
 #define _GNU_SOURCE
+#include <stdarg.h>
 #include "dynstr.h"
 #include "panic.h"
 
+// The capacity of a new, empty DynamicString.
+#define DS_INITIAL_CAPACITY 64
+
 typedef struct dynstr_s
 {
     char *raw;
     ssize_t len;
+
+    // the number of bytes allocated for raw, always more than len.
+    ssize_t cap;
 } dynstr_s;
 
 DynamicString *ds_new()
 {
     DynamicString *ptr = pacalloc(1, sizeof(DynamicString));
-    ptr->raw = pacalloc(1, sizeof(char));
+    ptr->raw = pacalloc(DS_INITIAL_CAPACITY, sizeof(char));
     ptr->len = 0;
+    ptr->cap = DS_INITIAL_CAPACITY;
     return ptr;
 }
 
@@ -22,26 +30,84 @@ DynamicString *ds_from_cstr(const char *s)
     DynamicString *ptr = pacalloc(1, sizeof(DynamicString));
     ptr->raw = pacalloc(len + 1, sizeof(char));
     ptr->len = len;
+    ptr->cap = len + 1;
 
-    strcpy(ptr->raw, s);
+    memcpy(ptr->raw, s, len + 1);
     return ptr;
 }
 
+DynamicString *ds_reserve(DynamicString *ds, ssize_t n)
+{
+    if (ds->len + n < ds->cap)
+    {
+        return ds;
+    }
+
+    // grow geometrically, so that appending n bytes one
+    // append at a time copies O(n) bytes overall.
+    ssize_t cap = ds->cap * 2;
+    while (cap <= ds->len + n)
+    {
+        cap *= 2;
+    }
+    ds->raw = parealloc(ds->raw, cap);
+    ds->cap = cap;
+    return ds;
+}
+
+DynamicString *ds_append_n(DynamicString *ds, const char *s, ssize_t n)
+{
+    ds_reserve(ds, n);
+    memcpy(ds->raw + ds->len, s, n);
+    ds->len += n;
+    ds->raw[ds->len] = '\0';
+    return ds;
+}
+
 DynamicString *ds_append(DynamicString *ds, const char *s)
 {
-    char *new_ptr;
-    if (asprintf(&new_ptr, "%s%s", ds->raw, s) == -1)
+    return ds_append_n(ds, s, strlen(s));
+}
+
+DynamicString *ds_appendf(DynamicString *ds, const char *fmt, ...)
+{
+    va_list args;
+
+    // try formatting into the spare capacity first, and only
+    // format a second time if it did not fit.
+    va_start(args, fmt);
+    int n = vsnprintf(ds->raw + ds->len, ds->cap - ds->len, fmt, args);
+    va_end(args);
+    if (n < 0)
     {
-        // if asprintf fails, then nreturn th previous string.
+        // leave the string as it was if formatting fails.
+        ds->raw[ds->len] = '\0';
         return ds;
     }
 
-    free(ds->raw);
-    ds->raw = new_ptr;
-    ds->len = strlen(ds->raw);
+    if (n >= ds->cap - ds->len)
+    {
+        ds_reserve(ds, n);
+        va_start(args, fmt);
+        vsnprintf(ds->raw + ds->len, ds->cap - ds->len, fmt, args);
+        va_end(args);
+    }
+    ds->len += n;
     return ds;
 }
 
+DynamicString *ds_clear(DynamicString *ds)
+{
+    ds->len = 0;
+    ds->raw[0] = '\0';
+    return ds;
+}
+
+const char *ds_cstr(DynamicString *ds)
+{
+    return ds->raw;
+}
+
 ssize_t ds_len(DynamicString *ds)
 {
     return ds->len + 1;
@@ -73,4 +139,4 @@ void ds_free(DynamicString *ds)
 {
     free(ds->raw);
     free(ds);
-}
\ No newline at end of file
+}
@@ -14,7 +14,12 @@
  * Once written to, it can not be read back until 
  * it is turned back into a C-style string, consuming
  * itself in the process and giving up ownership of
- * the contents.
+ * the contents, or until it is borrowed with ds_cstr.
+ * 
+ * A DynamicString keeps spare capacity, which grows
+ * geometrically, so appending is amortised constant time
+ * per byte appended. It can be cleared with ds_clear and
+ * reused without giving up its capacity.
  */
 typedef struct dynstr_s DynamicString;
 
@@ -38,6 +43,40 @@ DynamicString *ds_from_cstr(const char *s);
  */
 DynamicString *ds_append(DynamicString *ds, const char *s);
 
+/**
+ * Appends the first n characters of the given string to
+ * this DynamicString. The string needs not be null-terminated.
+ */
+DynamicString *ds_append_n(DynamicString *ds, const char *s, ssize_t n);
+
+/**
+ * Appends a string formatted as by printf to this
+ * DynamicString, without any intermediate allocation.
+ */
+DynamicString *ds_appendf(DynamicString *ds, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+/**
+ * Ensures that n more characters can be appended to this
+ * DynamicString without it having to grow.
+ */
+DynamicString *ds_reserve(DynamicString *ds, ssize_t n);
+
+/**
+ * Empties this DynamicString so that it can be reused,
+ * keeping its capacity.
+ */
+DynamicString *ds_clear(DynamicString *ds);
+
+/**
+ * Returns the contents of this DynamicString as a
+ * null-terminated C-style string, without consuming it.
+ * 
+ * The pointer is only valid until the DynamicString is
+ * next written to, and must not be freed.
+ */
+const char *ds_cstr(DynamicString *ds);
+
 /**
  * Returns the length of this DynamicString.
  */ 
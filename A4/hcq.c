@@ -6,6 +6,70 @@
 #include "hcq.h"
 #include "dynstr.h"
 #include "panic.h"
+#include "namemap.h"
+
+/*
+ * The waiting students and the TAs of the help centre by name, kept in
+ * step with stu_list and ta_list by every function that changes them,
+ * so that finding either by name does not walk the lists. Students
+ * being served are no longer waiting, and are not in waiting_by_name.
+ */
+NameMap *waiting_by_name = NULL;
+NameMap *tas_by_name = NULL;
+
+/*
+ * The student who arrived last, at the end of stu_list, so that
+ * students join the queue without walking it.
+ */
+Student *last_waiting = NULL;
+
+/*
+ * The journal every change to the waiting queue is recorded in, if any:
+ * "J <course> <name>" for a student joining the queue, and "L <name>" for
+ * a student leaving it, whether they gave up or were taken by a TA.
+ */
+Journal *queue_journal = NULL;
+
+/*
+ * Helper method recording a change to the waiting queue, which is now
+ * stu_list, and compacting the journal down to the queue when it is due.
+ */
+void journal_change(Student *stu_list, const char *record)
+{
+    if (queue_journal == NULL)
+    {
+        return;
+    }
+    journal_record(queue_journal, record);
+
+    if (journal_snapshot_due(queue_journal))
+    {
+        DynamicString *snapshot = ds_new();
+        for (Student *s = stu_list; s != NULL; s = s->next_overall)
+        {
+            ds_appendf(snapshot, "J %s %s\n", s->course->code, s->name);
+        }
+        journal_snapshot(queue_journal, snapshot);
+    }
+}
+
+NameMap *waiting_students()
+{
+    if (waiting_by_name == NULL)
+    {
+        waiting_by_name = nm_new();
+    }
+    return waiting_by_name;
+}
+
+NameMap *tas()
+{
+    if (tas_by_name == NULL)
+    {
+        tas_by_name = nm_new();
+    }
+    return tas_by_name;
+}
 
 /*
  * Return a pointer to the struct student with name stu_name
@@ -13,15 +77,11 @@
  */
 Student *find_student(Student *stu_list, const char *student_name)
 {
-    while (stu_list != NULL)
+    if (stu_list == NULL)
     {
-        if (strcmp(stu_list->name, student_name) == 0)
-        {
-            return stu_list;
-        }
-        stu_list = stu_list->next_overall;
+        return NULL;
     }
-    return NULL;
+    return nm_get(waiting_students(), student_name);
 }
 
 /*   Return a pointer to the ta with name ta_name or NULL
@@ -29,18 +89,17 @@ Student *find_student(Student *stu_list, const char *student_name)
  */
 Ta *find_ta(Ta *ta_list, const char *ta_name)
 {
-    Ta *current = ta_list;
-    while (current != NULL && (strcmp(current->name, ta_name) != 0))
+    if (ta_list == NULL)
     {
-        current = current->next;
+        return NULL;
     }
-    return current;
+    return nm_get(tas(), ta_name);
 }
 
 /*  Return a pointer to the course with this code in the course list
  *  or NULL if there is no course in the list with this code.
  */
-Course *find_course(Course *courses, int num_courses, char *course_code)
+Course *find_course(Course *courses, int num_courses, const char *course_code)
 {
     for (int i = 0; i < num_courses; i++)
     {
@@ -84,50 +143,103 @@ int add_student(Student **stu_list_ptr, const char *student_name, char *course_c
         return 2;
     }
 
+    // put this student at the end of the overall list
     new_student->next_overall = NULL;
-
-    // find the end of the current list to put this student at the end
     if (*stu_list_ptr == NULL)
     {
         // there is currently no student in the list at all, so special case
         *stu_list_ptr = new_student;
+        new_student->prev_overall = NULL;
     }
     else
     {
-        // we have at least one student in the list so find last student
-        Student *last = *stu_list_ptr;
-        while (last->next_overall != NULL)
-        {
-            last = last->next_overall;
-        }
-        // at this point last is the last real student in the overall list
-        last->next_overall = new_student;
+        last_waiting->next_overall = new_student;
+        new_student->prev_overall = last_waiting;
+    }
+    last_waiting = new_student;
+
+    // and at the end of the queue for the course
+    Course *course = new_student->course;
+    new_student->next_course = NULL;
+    new_student->prev_course = course->tail;
+    if (course->tail == NULL)
+    {
+        course->head = new_student;
     }
+    else
+    {
+        course->tail->next_course = new_student;
+    }
+    course->tail = new_student;
+    course->waiting++;
 
+    char *record;
+    paasprintf(&record, "J %s %s", course->code, new_student->name);
+    journal_change(*stu_list_ptr, record);
+    free(record);
+
+    nm_put(waiting_students(), new_student->name, new_student);
     return 0;
 }
 
 /*
- * Helper method 
+ * Helper method recording that a student has left the waiting queue.
+ */
+void journal_leave(Student *stu_list, Student *thisstudent)
+{
+    char *record;
+    paasprintf(&record, "L %s", thisstudent->name);
+    journal_change(stu_list, record);
+    free(record);
+}
+
+/*
+ * Helper method taking a waiting student out of both the overall list
+ * and the queue for their course, in constant time.
  */
 void route_around_overall(Student **stu_list_ptr, Student *thisstudent)
 {
-    // find the previous student overall -- route around this removing one
-    Student *current = *stu_list_ptr;
-    if (current == thisstudent)
+    // route around this one in the overall list
+    if (thisstudent->prev_overall == NULL)
     {
         // this student is first in list
         *stu_list_ptr = thisstudent->next_overall;
     }
     else
     {
-        while (current->next_overall != thisstudent)
-        {
-            current = current->next_overall;
-        }
-        // now current points to previous student
-        current->next_overall = thisstudent->next_overall;
+        thisstudent->prev_overall->next_overall = thisstudent->next_overall;
+    }
+    if (thisstudent->next_overall == NULL)
+    {
+        last_waiting = thisstudent->prev_overall;
+    }
+    else
+    {
+        thisstudent->next_overall->prev_overall = thisstudent->prev_overall;
+    }
+
+    // and in the queue for the course
+    Course *course = thisstudent->course;
+    if (thisstudent->prev_course == NULL)
+    {
+        course->head = thisstudent->next_course;
+    }
+    else
+    {
+        thisstudent->prev_course->next_course = thisstudent->next_course;
+    }
+    if (thisstudent->next_course == NULL)
+    {
+        course->tail = thisstudent->prev_course;
     }
+    else
+    {
+        thisstudent->next_course->prev_course = thisstudent->prev_course;
+    }
+    course->waiting--;
+
+    thisstudent->next_overall = thisstudent->prev_overall = NULL;
+    thisstudent->next_course = thisstudent->prev_course = NULL;
 }
 
 /* Student student_name has given up waiting and left the help centre
@@ -145,6 +257,8 @@ int give_up_waiting(Student **stu_list_ptr, char *student_name)
         return 1;
     }
     route_around_overall(stu_list_ptr, thisstudent);
+    nm_remove(waiting_students(), thisstudent->name);
+    journal_leave(*stu_list_ptr, thisstudent);
 
     // free memory
     free(thisstudent->name);
@@ -167,6 +281,29 @@ void add_ta(Ta **ta_list_ptr, const char *ta_name, Client *client)
     // insert into front of list
     new_ta->next = *ta_list_ptr;
     *ta_list_ptr = new_ta;
+
+    // a TA sharing the name of an earlier one hides it, as in the list.
+    nm_put(tas(), new_ta->name, new_ta);
+}
+
+/* Stop finding the removed TA by name. If another TA has the same name,
+ * that TA is found by it from now on.
+ */
+void unmap_ta(Ta *ta_list, Ta *removed)
+{
+    if (nm_get(tas(), removed->name) != removed)
+    {
+        return;
+    }
+    nm_remove(tas(), removed->name);
+    for (Ta *ta = ta_list; ta != NULL; ta = ta->next)
+    {
+        if (strcmp(ta->name, removed->name) == 0)
+        {
+            nm_put(tas(), ta->name, ta);
+            return;
+        }
+    }
 }
 
 /* Remove this Ta from the ta_list and free the associated memory with
@@ -184,6 +321,7 @@ int remove_ta(Ta **ta_list_ptr, Student **stu_list_ptr, char *ta_name)
     {
         // TA is at the head so special case
         *ta_list_ptr = head->next;
+        unmap_ta(*ta_list_ptr, head);
         take_student(head, stu_list_ptr, NULL);
         // memory for the student has been freed. Now free memory for the TA.
         free(head->name);
@@ -201,6 +339,7 @@ int remove_ta(Ta **ta_list_ptr, Student **stu_list_ptr, char *ta_name)
             take_student(ta_tofree, stu_list_ptr, NULL);
 
             head->next = head->next->next;
+            unmap_ta(*ta_list_ptr, ta_tofree);
             // memory for the student has been freed. Now free memory for the TA.
             free(ta_tofree->name);
             free(ta_tofree);
@@ -238,6 +377,8 @@ int take_student(Ta *ta, Student **stu_list_ptr, Student *to_serve)
     if (to_serve != NULL)
     {
         route_around_overall(stu_list_ptr, to_serve);
+        nm_remove(waiting_students(), to_serve->name);
+        journal_leave(*stu_list_ptr, to_serve);
     }
     return 0;
 }
@@ -262,6 +403,28 @@ int next_overall(const char *ta_name, Ta **ta_list_ptr, Student **stu_list_ptr)
     return take_student(ta, stu_list_ptr, to_serve_next);
 }
 
+/* TA ta_name is finished with the student they are currently helping (if any)
+ * and are assigned to the student who has been waiting longest for the
+ * course with course_code, or to no student if nobody is waiting for it.
+ * If ta_name is not in ta_list, return 1 and do nothing.
+ * If course_code does not exist in the list, return 2 and do nothing.
+ */
+int next_course(const char *ta_name, const char *course_code, Ta **ta_list_ptr,
+                Student **stu_list_ptr, Course *courses, int num_courses)
+{
+    Ta *ta = find_ta(*ta_list_ptr, ta_name);
+    if (ta == NULL)
+    {
+        return 1;
+    }
+    Course *course = find_course(courses, num_courses, course_code);
+    if (course == NULL)
+    {
+        return 2;
+    }
+    return take_student(ta, stu_list_ptr, course->head);
+}
+
 // print a message about which TAs are serving which students
 char *print_currently_serving(Ta *ta_list)
 {
@@ -273,21 +436,18 @@ char *print_currently_serving(Ta *ta_list)
         return ds_into_raw(ds);
     }
 
-    char *buf;
     DynamicString *ds = ds_new();
     while (ta_list != NULL)
     {
         if (ta_list->current_student != NULL)
         {
-            paasprintf(&buf, "TA: %s is serving %s.\r\n",
+            ds_appendf(ds, "TA: %s is serving %s.\r\n",
                        ta_list->name,
                        ta_list->current_student->name);
-            ds_append(ds, buf);
         }
         else
         {
-            paasprintf(&buf, "TA: %s has no student\r\n", ta_list->name);
-            ds_append(ds, buf);
+            ds_appendf(ds, "TA: %s has no student\r\n", ta_list->name);
         }
         ta_list = ta_list->next;
     }
@@ -301,13 +461,11 @@ char *print_currently_serving(Ta *ta_list)
 char *print_full_queue(Student *stu_list)
 {
 
-    DynamicString *ds = ds_from_cstr("Full Queue\r\n");
-    char *buf;
+    DynamicString *ds = ds_new();
+    ds_append(ds, "Full Queue\r\n");
     while (stu_list != NULL)
     {
-        paasprintf(&buf, "Student %s:%s\r\n", stu_list->name, stu_list->course->code);
-        ds_append(ds, buf);
-        free(buf);
+        ds_appendf(ds, "Student %s:%s\r\n", stu_list->name, stu_list->course->code);
         stu_list = stu_list->next_overall;
     }
     return ds_into_raw(ds);
@@ -325,7 +483,7 @@ int config_course_list(Course **courselist_ptr, char *config_filename)
        the config_filename 
     */
 
-    *courselist_ptr = malloc(sizeof(Course) * 3);
+    *courselist_ptr = calloc(3, sizeof(Course));
     if (*courselist_ptr == NULL)
     {
         perror("Malloc for course list\n");
@@ -2,13 +2,22 @@
 #define HCQ_H
 
 #include "client.h"
+#include "journal.h"
 
 /* Students are kept in order by time with newest 
-   students at the end of the lists. */
+   students at the end of the lists: the overall list of every
+   waiting student, and the list of the students waiting for
+   their course. Both lists are doubly linked, so that a student
+   can leave either in constant time. */
 struct student{
     char *name;
     struct course *course;
     struct student *next_overall;
+    struct student *prev_overall;
+    struct student *next_course;
+    struct student *prev_course;
+    // NULL for a student put back in the queue from the journal who
+    // has not reconnected yet.
     Client *client;
 };
 
@@ -21,8 +30,13 @@ struct ta {
     Client *client;
 };
 
+/* A course, with the FIFO of students waiting for it.
+   Courses must start out zeroed. */
 struct course{
     char code[7];
+    struct student *head;
+    struct student *tail;
+    int waiting;
 };
 
 
@@ -30,6 +44,10 @@ typedef struct student Student;
 typedef struct course Course;
 typedef struct ta Ta;
 
+// the journal every change to the waiting queue is recorded in, or NULL
+// not to keep one. See hcq.c for the records kept.
+extern Journal *queue_journal;
+
 // helper functions not directly related to only one command in the API
 Student *find_student(Student *stu_list, const char *student_name);
 Ta *find_ta(Ta *ta_list, const char *ta_name);
@@ -48,6 +66,15 @@ int take_student(Ta *ta, Student **stu_list_ptr, Student *to_serve);
 //    set to null 
 int next_overall(const char *ta_name, Ta **ta_list_ptr, Student **stu_list_ptr);
 
+//  same as next_overall, but the next student is the one who has been
+//    waiting longest for the given course. Returns 2 if the course does
+//    not exist.
+int next_course(const char *ta_name, const char *course_code, Ta **ta_list_ptr,
+    Student **stu_list_ptr, Course *courses, int num_courses);
+
+// find a course by its code
+Course *find_course(Course *courses, int num_courses, const char *course_code);
+
 // list currently being served by current TAs
 char *print_currently_serving(Ta *ta_list);
 
@@ -3,7 +3,10 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <ctype.h>
 #include <time.h>
+#include <errno.h>
+#include <pthread.h>
 
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -16,7 +19,7 @@
 #ifndef PORT
 #define PORT 30000
 #endif
-#define MAX_BACKLOG 3
+#define MAX_BACKLOG SOMAXCONN
 #define DELIM " \n"
 
 /* Print a formatted error message to stderr.
@@ -34,11 +37,34 @@ Student *stu_list = NULL;
 Course *courses;
 int num_courses = 3;
 
+// Every reactor thread serves its own clients, but they all share the
+// one queue. Whatever touches the TA list, the student list or the
+// courses does so holding queue_lock, so the queue sees one change at a
+// time, in a single order: students are queued in the order they got
+// the lock, whichever thread they are served by.
+pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+
 // Process the response from the client as its username,
 // advancing the prompt to ask for the type of client.
+// A name holding a control character disconnects the client.
 int process_username(Client *c)
 {
     char *msg = client_ready_message(c);
+
+    // a name is written to the journal as part of a one-line record, so
+    // it must not hold a newline, or any other control character.
+    for (char *p = msg; *p != '\0'; p++)
+    {
+        if (iscntrl((unsigned char)*p))
+        {
+            client_write(c, "Names can not hold control characters. Good-bye.\r\n");
+            client_set_state(c, S_INVALID);
+            client_close(c);
+            free(msg);
+            return 0;
+        }
+    }
+
     client_set_username(c, msg);
     printf("Set client username to: %s\n", msg);
 
@@ -69,7 +95,31 @@ int process_type(Client *c)
         client_set_type(c, CLIENT_STUDENT);
         printf("Set client type to Student\n");
 
-        client_set_state(c, S_PROMPT_MOTD);
+        // A student put back in the queue after a restart takes their
+        // place back by giving the same name.
+        char *welcome = NULL;
+        pthread_mutex_lock(&queue_lock);
+        Student *waiting = find_student(stu_list, client_username(c));
+        if (waiting != NULL && waiting->client == NULL)
+        {
+            waiting->client = c;
+            paasprintf(&welcome, "Welcome back. You have kept your place in the queue for %s. "
+                                 "While you wait, you can use the command stats to see which TAs "
+                                 "are currently serving students.\r\n",
+                       waiting->course->code);
+        }
+        pthread_mutex_unlock(&queue_lock);
+
+        if (welcome != NULL)
+        {
+            client_write(c, welcome);
+            free(welcome);
+            client_set_state(c, S_PROMPT_COMMANDS);
+        }
+        else
+        {
+            client_set_state(c, S_PROMPT_MOTD);
+        }
     }
     else
     {
@@ -93,7 +143,10 @@ int process_course(Client *c)
 
             // Add the student to the student list now that we know what course
             // they want to queue for.
-            if (add_student(&stu_list, client_username(c), msg, courses, num_courses, c))
+            pthread_mutex_lock(&queue_lock);
+            int added = add_student(&stu_list, client_username(c), msg, courses, num_courses, c);
+            pthread_mutex_unlock(&queue_lock);
+            if (added)
             {
                 client_write(c, "You are already in the queue and cannot be added again for any course. Good-bye.\r\n");
 
@@ -123,6 +176,33 @@ int process_course(Client *c)
     return 0;
 }
 
+// Tell the student the TA on client c was just given that it is their
+// turn, and disconnect them. The student may be served by another
+// thread, so this must be called holding queue_lock, which keeps the
+// student's client from being freed.
+void send_off_student(Client *c)
+{
+    // Find the TA that this client is associated with
+    Ta *ta = find_ta(ta_list, client_username(c));
+
+    // If the TA has a student, disconnect the student, unless
+    // they have not reconnected since a restart.
+    if (ta->current_student && !ta->current_student->client)
+    {
+        char *msg;
+        paasprintf(&msg, "%s has not come back since the server restarted.\r\n", ta->current_student->name);
+        client_write(c, msg);
+        free(msg);
+    }
+    else if (ta->current_student)
+    {
+        // The student's state is set to invalid, which will result in the
+        // student not being freed, which we want.
+        client_send_off(ta->current_student->client, "Your turn to see the TA.\r\n"
+                        "We are disconnecting you from the server now. Press Ctrl-C to close nc\r\n");
+    }
+}
+
 int process_command(ClientList *l, Client *c)
 {
     // tokenize arguments
@@ -134,6 +214,7 @@ int process_command(ClientList *l, Client *c)
     {
         char *response = NULL;
 
+        pthread_mutex_lock(&queue_lock);
         if (client_type(c) == CLIENT_STUDENT)
         {
             response = print_currently_serving(ta_list);
@@ -143,27 +224,32 @@ int process_command(ClientList *l, Client *c)
         {
             response = print_full_queue(stu_list);
         }
+        pthread_mutex_unlock(&queue_lock);
         client_write(c, response);
         free(response);
     }
     else if (!strcmp("next", input) && client_type(c) == CLIENT_TA)
     {
         // Try and assign the TA a student
+        pthread_mutex_lock(&queue_lock);
         next_overall(client_username(c), &ta_list, &stu_list);
-
-        // Find the TA that this client is associated with
-        Ta *ta = find_ta(ta_list, client_username(c));
-
-        // If the TA has a student, disconnect the student.
-        if (ta->current_student)
+        send_off_student(c);
+        pthread_mutex_unlock(&queue_lock);
+    }
+    else if (!strncmp("next ", input, 5) && client_type(c) == CLIENT_TA)
+    {
+        // Try and assign the TA a student waiting for the course
+        pthread_mutex_lock(&queue_lock);
+        int status = next_course(client_username(c), input + 5, &ta_list, &stu_list, courses, num_courses);
+        if (status != 2)
         {
-            Client *st_client = ta->current_student->client;
-            client_write(st_client, "Your turn to see the TA.\r\nWe are disconnecting you from the server now. Press Ctrl-C to close nc\r\n");
+            send_off_student(c);
+        }
+        pthread_mutex_unlock(&queue_lock);
 
-            // Setting the state to invalid will result in the student not being freed.
-            // which we want.
-            client_set_state(st_client, S_INVALID);
-            client_close(st_client);
+        if (status == 2)
+        {
+            client_write(c, "This is not a valid course.\r\n");
         }
     }
     else
@@ -175,18 +261,150 @@ int process_command(ClientList *l, Client *c)
     return 0;
 }
 
-int main(void)
+// Send the prompt for the client's current prompt state, if it is
+// preparing to be read from.
+// Notice that client_prep_read must be called after the prompt,
+// without this call the client would not be able to be read from.
+// See the documentation for client_prep_read in client.h
+void prompt_client(Client *c)
 {
-    if ((courses = malloc(sizeof(Course) * 3)) == NULL)
+    if (client_recv_state(c) != RS_RECV_PREP)
     {
-        perror("malloc for course list\n");
-        exit(1);
+        return;
     }
 
-    strcpy(courses[0].code, "CSC108");
-    strcpy(courses[1].code, "CSC148");
-    strcpy(courses[2].code, "CSC209");
+    switch (client_state(c))
+    {
+    case S_INVALID:
+        return;
+
+    case S_PROMPT_USERNAME:
+        client_write(c, "Welcome to the Help Centre, what is your name?\r\n");
+        client_prep_read(c);
+        break;
+    case S_PROMPT_TYPE:
+        client_write(c, "Are you a TA or a Student (enter T or S)?\r\n");
+        client_prep_read(c);
+        break;
+    case S_PROMPT_TYPE_INVALID:
+        client_write(c, "Invalid role (enter T or S)?\r\n");
+        client_prep_read(c);
+        break;
+    case S_PROMPT_MOTD:
+        // Nested switch is sketchy, but the alternative are
+        // gotos.
+        switch (client_type(c))
+        {
+        case CLIENT_TA:
+            client_write(c, "Valid commands for TA:\r\n\tstats\r\n\tnext\r\n\tnext <course>\r\n\t(or use Ctrl-C to leave)\r\n");
+
+            // If the client is a TA, we have all the information we need to add the TA to the
+            // TA list.
+            pthread_mutex_lock(&queue_lock);
+            add_ta(&ta_list, client_username(c), c);
+            pthread_mutex_unlock(&queue_lock);
+
+            // prompt commands from now on.
+            client_set_state(c, S_PROMPT_COMMANDS);
+            break;
+        case CLIENT_STUDENT:
+            client_write(c, "Valid courses: ");
+            for (int i = 0; i < num_courses; i++)
+            {
+                client_write(c, courses[i].code);
+                if (i < num_courses - 1)
+                {
+                    client_write(c, ", ");
+                }
+            }
+            client_write(c, "\r\nWhich course are you asking about?\r\n");
+            client_set_state(c, S_PROMPT_COURSES);
+            // after this prompt, if the choice is valid, the student will be
+            // created and added to the student list.
+            break;
+        case CLIENT_UNSET:
+
+            // should never reach here
+            break;
+        }
+        client_prep_read(c);
+        break;
+    case S_PROMPT_COMMANDS:
+        client_prep_read(c);
+        break;
+    default:
+        break;
+    }
+}
 
+// Process a message fully read from the client according to
+// its prompt state.
+void process_message(ClientList *l, Client *c)
+{
+    switch (client_state(c))
+    {
+    case S_PROMPT_USERNAME:
+        process_username(c);
+        break;
+    case S_PROMPT_TYPE:
+    case S_PROMPT_TYPE_INVALID:
+        process_type(c);
+        break;
+    case S_PROMPT_COURSES:
+        process_course(c);
+        break;
+    case S_PROMPT_COMMANDS:
+        process_command(l, c);
+        break;
+    default:
+        break;
+    }
+}
+
+// Readiness callback of every client: prompt the client, then read
+// and process its messages in order, until its socket has nothing more
+// to read and every whole message read has been processed.
+// Sockets are edge-triggered, so stopping any earlier would leave
+// data unread until the client sends more.
+void serve_client(ClientList *l, Client *c, void *data)
+{
+    while (client_recv_state(c) != RS_DISCONNECTED && client_state(c) != S_INVALID)
+    {
+        // a message read along with the last one may be ready
+        // straight after the prompt, without reading again.
+        prompt_client(c);
+        if (client_recv_state(c) == RS_RECV_NOT_RDY && client_read(c) <= 0)
+        {
+            return;
+        }
+
+        // last read may have changed the recv state.
+        // if so, process the mesage.
+        if (client_recv_state(c) == RS_RECV_RDY)
+        {
+            process_message(l, c);
+        }
+        else if (client_recv_state(c) != RS_RECV_NOT_RDY)
+        {
+            return;
+        }
+    }
+}
+
+// Accept callback: greet the new client, and serve it whenever
+// it is ready from now on.
+void accept_client(ClientList *l, Client *c, void *data)
+{
+    printf("Accepted connection\n");
+    client_on_ready(c, serve_client, NULL);
+    serve_client(l, c, NULL);
+}
+
+// Create a socket listening on the port, or on any free port if it is
+// 0. Every reactor thread listens with its own socket, and the kernel
+// spreads new connections across them.
+int listen_on_port(int port)
+{
     // Create the socket FD.
     int sock_fd = socket(AF_INET, SOCK_STREAM, 0);
     if (sock_fd < 0)
@@ -198,7 +416,7 @@ int main(void)
     // Set information about the port (and IP) we want to be connected to.
     struct sockaddr_in server;
     server.sin_family = AF_INET;
-    server.sin_port = htons(PORT);
+    server.sin_port = htons(port);
     server.sin_addr.s_addr = INADDR_ANY;
 
     // This should always be zero. On some systems, it won't error if you
@@ -215,6 +433,15 @@ int main(void)
         exit(1);
     }
 
+    // Let every reactor thread bind its own socket to the port.
+    status = setsockopt(sock_fd, SOL_SOCKET, SO_REUSEPORT,
+                        (const char *)&on, sizeof(on));
+    if (status == -1)
+    {
+        perror("setsockopt -- REUSEPORT");
+        exit(1);
+    }
+
     // Bind the selected port to the socket.
     if (bind(sock_fd, (struct sockaddr *)&server, sizeof(server)) < 0)
     {
@@ -230,154 +457,164 @@ int main(void)
         close(sock_fd);
         exit(1);
     }
+    return sock_fd;
+}
 
-    // Initialize a list of clients to manage.
-    // All socket operations should now take place within this ClientList context.
-    ClientList *clients = client_list_new(sock_fd);
-
+// Body of a reactor thread: accept and serve clients on the given
+// ClientList, forever.
+void *run_reactor(void *arg)
+{
+    ClientList *clients = arg;
     while (1)
     {
-        // Garbage collect disconnected clients before trying to send prompts.
-        client_list_collect(clients, &ta_list, &stu_list);
-
-        // Send prompts for every client preparing to be ready for reading from.
-        // Notice that client_prep_read must be called after the prompt,
-        // without this call the client would not be able to be read from.
-
-        // See the documentation for client_prep_read in client.h
-        for (Client *c = client_iter_begin(clients); c != NULL; c = client_iter_next(c))
+        // Only the clients that are ready have their callbacks run,
+        // so a wakeup costs nothing for idle clients.
+        if (client_list_wait(clients, -1) == -1)
         {
-            if (client_recv_state(c) == RS_RECV_PREP)
-            {
-                switch (client_state(c))
-                {
-                case S_INVALID:
-                    continue;
-
-                case S_PROMPT_USERNAME:
-                    client_write(c, "Welcome to the Help Centre, what is your name?\r\n");
-                    client_prep_read(c);
-                    break;
-                case S_PROMPT_TYPE:
-                    client_write(c, "Are you a TA or a Student (enter T or S)?\r\n");
-                    client_prep_read(c);
-                    break;
-                case S_PROMPT_TYPE_INVALID:
-                    client_write(c, "Invalid role (enter T or S)?\r\n");
-                    client_prep_read(c);
-                    break;
-                case S_PROMPT_MOTD:
-                    // Nested switch is sketchy, but the alternative are
-                    // gotos.
-                    switch (client_type(c))
-                    {
-                    case CLIENT_TA:
-                        client_write(c, "Valid commands for TA:\r\n\tstats\r\n\tnext\r\n\t(or use Ctrl-C to leave)\r\n");
-
-                        // If the client is a TA, we have all the information we need to add the TA to the
-                        // TA list.
-                        add_ta(&ta_list, client_username(c), c);
-
-                        // prompt commands on next loop iteration.
-                        client_set_state(c, S_PROMPT_COMMANDS);
-                        break;
-                    case CLIENT_STUDENT:
-                        client_write(c, "Valid courses: ");
-                        for (int i = 0; i < num_courses; i++)
-                        {
-                            client_write(c, courses[i].code);
-                            if (i < num_courses - 1)
-                            {
-                                client_write(c, ", ");
-                            }
-                        }
-                        client_write(c, "\r\nWhich course are you asking about?\r\n");
-                        client_set_state(c, S_PROMPT_COURSES);
-                        // after this prompt, if the choice is valid, the student will be
-                        // created and added to the student list.
-                        break;
-                    case CLIENT_UNSET:
-
-                        // should never reach here
-                        break;
-                    }
-                    client_prep_read(c);
-                    break;
-                case S_PROMPT_COMMANDS:
-                    client_prep_read(c);
-                    break;
-                default:
-                    break;
-                }
-            }
+            perror("server: epoll_wait");
+            exit(1);
         }
 
-        // Prompts could have dropped some clients.
+        // Processing could have dropped some clients.
         // do garbage collection for dropped clients.
-        // any I/O operation on a dropped socket will set the recv state to RS_DISCONNECTED.
-        // this will mark the client as dead.
+        // any I/O operation on a dropped socket will mark the client as dead.
+        // Dropping a client takes its TA or student out of the queue.
+        pthread_mutex_lock(&queue_lock);
         client_list_collect(clients, &ta_list, &stu_list);
+        pthread_mutex_unlock(&queue_lock);
+    }
+    return NULL;
+}
 
-        ClientSocketSet listen_fds = client_list_fdset_clone(clients);
-        int nready = client_list_select(clients, &listen_fds);
-        if (nready == -1)
-        {
-            perror("server: select");
-            exit(1);
-        }
+// Apply a record replayed from the journal to the queue. Students put
+// back in the queue have no client until they reconnect.
+void replay_record(const char *record, void *data)
+{
+    char *copy = strdup(record);
+    char *name;
+    if (copy[0] == 'J' && copy[1] == ' ' && (name = strchr(copy + 2, ' ')) != NULL)
+    {
+        *name++ = '\0';
+        add_student(&stu_list, name, copy + 2, courses, num_courses, NULL);
+    }
+    else if (copy[0] == 'L' && copy[1] == ' ')
+    {
+        give_up_waiting(&stu_list, copy + 2);
+    }
+    else
+    {
+        fprintf(stderr, "server: ignoring journal record %s\n", record);
+    }
+    free(copy);
+}
+
+// Set up the courses, put the queue kept in the journal at the given
+// path back, unless it is NULL, and start nthreads reactor threads
+// serving the help centre on the port, or on any free port if it is 0.
+// Returns the port being served on.
+int start_server(int port, long nthreads, const char *journal_path)
+{
+    if ((courses = calloc(3, sizeof(Course))) == NULL)
+    {
+        perror("malloc for course list\n");
+        exit(1);
+    }
 
-        // Is it the original socket? Create a new connection ...
-        if (FD_ISSET(sock_fd, &listen_fds))
+    strcpy(courses[0].code, "CSC108");
+    strcpy(courses[1].code, "CSC148");
+    strcpy(courses[2].code, "CSC209");
+
+    // the queue is put back before anyone can change it. Changes are
+    // acknowledged as soon as they are handed to the journal, not once
+    // they are synced. A change is on disk at most two syncs after it
+    // was handed over, so a crash loses at most the changes handed over
+    // during the last two syncs.
+    if (journal_path != NULL)
+    {
+        Journal *journal = journal_open(journal_path, replay_record, NULL);
+        int waiting = 0;
+        for (int i = 0; i < num_courses; i++)
         {
-            client_list_accept_connection(clients);
-            printf("Accepted connection\n");
+            waiting += courses[i].waiting;
         }
+        printf("Replayed %s: %d students waiting\n", journal_path, waiting);
+        queue_journal = journal;
+    }
 
-        for (Client *c = client_iter_begin(clients); c != NULL; c = client_iter_next(c))
+    // Initialize a list of clients to manage for every reactor thread.
+    // All socket operations should now take place within these ClientList contexts.
+    // The listeners are all bound before any thread starts accepting, the
+    // first one picking the port if need be.
+    ClientList **reactors = pamalloc(sizeof(ClientList *) * nthreads);
+    for (int i = 0; i < nthreads; i++)
+    {
+        int sock_fd = listen_on_port(port);
+        if (port == 0)
         {
-            int fd = client_fd(c);
-            if (fd != -1 && FD_ISSET(fd, &listen_fds))
+            struct sockaddr_in bound;
+            socklen_t len = sizeof(bound);
+            if (getsockname(sock_fd, (struct sockaddr *)&bound, &len) == -1)
             {
-                // client_recv_state may change in between calls.
-                // Only do a read if the state is RS_RECV_NOT_RDY.
-                if (client_recv_state(c) == RS_RECV_NOT_RDY)
-                {
-                    client_read(c);
-                }
-
-                // last read may have changed the recv state.
-                // if so, process the mesage.
-                if (client_recv_state(c) == RS_RECV_RDY)
-                {
-                    switch (client_state(c))
-                    {
-                    case S_PROMPT_USERNAME:
-                        process_username(c);
-                        break;
-                    case S_PROMPT_TYPE:
-                    case S_PROMPT_TYPE_INVALID:
-                        process_type(c);
-                        break;
-                    case S_PROMPT_COURSES:
-                        process_course(c);
-                        break;
-                    case S_PROMPT_COMMANDS:
-                        process_command(clients, c);
-                        break;
-                    case S_INVALID:
-                        continue;
-                        break;
-                    default:
-                        break;
-                    }
-                }
+                perror("server: getsockname");
+                exit(1);
             }
+            port = ntohs(bound.sin_port);
         }
+        reactors[i] = client_list_new(sock_fd);
+        client_list_on_accept(reactors[i], accept_client, NULL);
+    }
 
-        // Processing could have dropped some clients.
-        // do garbage collection for dropped clients.
-        // any I/O operation on a dropped socket will set the recv state to RS_DISCONNECTED.
-        // this will mark the client as dead.
-        client_list_collect(clients, &ta_list, &stu_list);
+    for (int i = 0; i < nthreads; i++)
+    {
+        pthread_t thread;
+        if ((errno = pthread_create(&thread, NULL, run_reactor, reactors[i])) != 0)
+        {
+            perror("server: pthread_create");
+            exit(1);
+        }
+        pthread_detach(thread);
     }
+    free(reactors);
+    return port;
 }
+
+#ifndef HCQ_NO_MAIN
+int main(int argc, char **argv)
+{
+    // one reactor thread per processor, unless told otherwise.
+    long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    const char *journal_path = "hcq.journal";
+    int opt;
+    while ((opt = getopt(argc, argv, "t:j:")) != -1)
+    {
+        switch (opt)
+        {
+        case 't':
+            nthreads = atol(optarg);
+            break;
+        case 'j':
+            journal_path = optarg;
+            break;
+        default:
+            fprintf(stderr, "Usage: hcq_server [-t THREADS] [-j JOURNAL]\n"
+                            "  -t THREADS  reactor threads serving clients (default: one per processor)\n"
+                            "  -j JOURNAL  file the waiting queue is kept in across restarts\n"
+                            "              (default: hcq.journal). Students are told they have\n"
+                            "              joined before their place is synced to disk. A join or\n"
+                            "              departure is on disk at most two syncs after it was\n"
+                            "              handed over, so a crash can lose those handed over\n"
+                            "              during the last two syncs.\n");
+            exit(1);
+        }
+    }
+    if (nthreads < 1)
+    {
+        nthreads = 1;
+    }
+
+    start_server(PORT, nthreads, journal_path);
+
+    // the reactor threads serve forever.
+    pthread_exit(NULL);
+}
+#endif
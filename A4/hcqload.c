@@ -0,0 +1,588 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "panic.h"
+
+/**
+ * A load generator for hcq_server, speaking the help centre protocol
+ * over as many concurrent connections as it is asked for.
+ *
+ * Every student connects, gives its name, role and course, and sends
+ * stats a few times. Once every student is through that, the TAs send
+ * next until the queue has been served. Every TA sends stats too, while
+ * the students are joining. All connections are non-blocking and driven
+ * from a single epoll loop.
+ *
+ * Replies have no framing, and next sends none to the TA, so every
+ * command is followed by a line the server rejects: the Incorrect syntax
+ * reply to it marks the end of the reply to the command.
+ *
+ * With -l the server is run in this process, on a free port, with its
+ * own log discarded, so that the harness needs nothing else running.
+ *
+ * Results are reported as key=value lines on standard output.
+ */
+
+#ifndef PORT
+#define PORT 30000
+#endif
+
+// the most bytes of a reply kept while waiting for the text ending it,
+// which must be shorter.
+#define REPLY_TAIL 64
+
+#define MAX_EVENTS 256
+
+// Starts the help centre server in this process; see hcq_server.c.
+int start_server(int port, long nthreads, const char *journal_path);
+
+/**
+ * What a connection is waiting for the server to send.
+ */
+typedef enum step_e
+{
+    STEP_GREETING,
+    STEP_ROLE_PROMPT,
+    STEP_MOTD,
+    STEP_JOINED,
+    STEP_REPLY,
+    STEP_SERVED,
+    STEP_DONE,
+} Step;
+
+/**
+ * The kinds of exchange that are timed.
+ */
+enum
+{
+    T_CONNECT,
+    T_JOIN,
+    T_STATS,
+    T_NEXT,
+    T_KINDS,
+};
+
+const char *timing_names[T_KINDS] = {"connect", "join", "stats", "next"};
+
+/**
+ * A growable array of latencies, in microseconds.
+ */
+typedef struct
+{
+    long long *us;
+    int n;
+    int cap;
+} Timings;
+
+typedef struct
+{
+    int fd;
+    bool ta;
+    int id;
+    Step step;
+
+    // the text that ends the reply being waited for, and the end of
+    // the reply received so far.
+    const char *until;
+    char tail[REPLY_TAIL];
+    int taillen;
+
+    // when the exchange being waited for started, and what kind it is.
+    long long started;
+    int timing;
+
+    // stats commands left to send.
+    int stats_left;
+
+    // whether this is a student counted in students_joining, and in
+    // students_waiting.
+    bool joining;
+    bool waiting;
+} Conn;
+
+long long now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+const char *course_codes[] = {"CSC108", "CSC148", "CSC209"};
+
+Timings timings[T_KINDS];
+
+// students still joining or sending stats, and students not yet served.
+int students_joining = 0;
+int students_waiting = 0;
+int open_conns = 0;
+
+long long commands = 0;
+long long served = 0;
+long long disconnects = 0;
+long long goodbyes = 0;
+long long connect_errors = 0;
+
+void record(int kind, long long us)
+{
+    Timings *t = &timings[kind];
+    if (t->n == t->cap)
+    {
+        t->cap = t->cap ? 2 * t->cap : 1024;
+        t->us = parealloc(t->us, sizeof(long long) * t->cap);
+    }
+    t->us[t->n++] = us;
+}
+
+int compare_us(const void *a, const void *b)
+{
+    long long x = *(const long long *)a;
+    long long y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+void report_timings(FILE *out, int kind)
+{
+    Timings *t = &timings[kind];
+    fprintf(out, "%s.count=%d\n", timing_names[kind], t->n);
+    if (t->n == 0)
+    {
+        return;
+    }
+    qsort(t->us, t->n, sizeof(long long), compare_us);
+    int percentiles[] = {50, 90, 99};
+    for (int i = 0; i < 3; i++)
+    {
+        fprintf(out, "%s.p%d_us=%lld\n", timing_names[kind], percentiles[i],
+                t->us[(long long)(t->n - 1) * percentiles[i] / 100]);
+    }
+    fprintf(out, "%s.max_us=%lld\n", timing_names[kind], t->us[t->n - 1]);
+}
+
+// Sends a line (or lines) to the server. Commands are tiny, and only
+// sent once the reply to the one before has arrived, so they always fit
+// in the socket; if one does not, the connection counts as lost.
+bool send_line(Conn *c, const char *line)
+{
+    size_t len = strlen(line);
+    return send(c->fd, line, len, MSG_NOSIGNAL) == (ssize_t)len;
+}
+
+// Sends a command followed by the rejected line ending its reply.
+bool send_command(Conn *c, const char *command, int timing)
+{
+    char buf[64];
+    snprintf(buf, sizeof(buf), "%s\r\n-\r\n", command);
+    c->step = STEP_REPLY;
+    c->until = "Incorrect syntax\r\n";
+    c->started = now_us();
+    c->timing = timing;
+    commands++;
+    return send_line(c, buf);
+}
+
+// Closes a connection, which is not waited for any more.
+void finish(Conn *c)
+{
+    if (c->step == STEP_DONE)
+    {
+        return;
+    }
+    if (c->joining)
+    {
+        c->joining = false;
+        students_joining--;
+    }
+    if (c->waiting)
+    {
+        c->waiting = false;
+        students_waiting--;
+    }
+    c->step = STEP_DONE;
+    close(c->fd);
+    open_conns--;
+}
+
+// Sends a TA its next command: stats while students are still joining,
+// and next once they have all joined, until they have all been served.
+bool ta_continue(Conn *c)
+{
+    if (students_waiting == 0)
+    {
+        finish(c);
+        return true;
+    }
+    if (students_joining > 0)
+    {
+        if (c->stats_left > 0)
+        {
+            c->stats_left--;
+            return send_command(c, "stats", T_STATS);
+        }
+        // nothing to do until the students have joined.
+        c->step = STEP_REPLY;
+        c->until = NULL;
+        return true;
+    }
+    return send_command(c, "next", T_NEXT);
+}
+
+bool student_continue(Conn *c)
+{
+    if (c->stats_left > 0)
+    {
+        c->stats_left--;
+        return send_command(c, "stats", T_STATS);
+    }
+    if (c->joining)
+    {
+        c->joining = false;
+        students_joining--;
+    }
+    c->step = STEP_SERVED;
+    c->until = "Your turn";
+    return true;
+}
+
+// Moves a connection on once the text it was waiting for has arrived.
+bool advance(Conn *c)
+{
+    char buf[64];
+    long long took = now_us() - c->started;
+
+    switch (c->step)
+    {
+    case STEP_GREETING:
+        record(T_CONNECT, took);
+        snprintf(buf, sizeof(buf), "%s%05d\r\n", c->ta ? "ta" : "s", c->id);
+        c->step = STEP_ROLE_PROMPT;
+        c->until = "(enter T or S)?\r\n";
+        return send_line(c, buf);
+    case STEP_ROLE_PROMPT:
+        c->step = STEP_MOTD;
+        c->until = c->ta ? "leave)\r\n" : "asking about?\r\n";
+        return send_line(c, c->ta ? "T\r\n" : "S\r\n");
+    case STEP_MOTD:
+        if (c->ta)
+        {
+            return ta_continue(c);
+        }
+        snprintf(buf, sizeof(buf), "%s\r\n", course_codes[c->id % 3]);
+        c->step = STEP_JOINED;
+        c->until = "entered into the queue";
+        c->started = now_us();
+        commands++;
+        return send_line(c, buf);
+    case STEP_JOINED:
+        record(T_JOIN, took);
+        return student_continue(c);
+    case STEP_REPLY:
+        record(c->timing, took);
+        return c->ta ? ta_continue(c) : student_continue(c);
+    case STEP_SERVED:
+        served++;
+        finish(c);
+        return true;
+    default:
+        return true;
+    }
+}
+
+// Reads what the server sent to a connection, moving it on as the
+// replies it waits for arrive.
+void on_readable(Conn *c)
+{
+    char buf[4096];
+    while (c->step != STEP_DONE)
+    {
+        ssize_t n = recv(c->fd, buf, sizeof(buf), 0);
+        if (n == 0 || (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+        {
+            if (c->step == STEP_GREETING)
+            {
+                connect_errors++;
+            }
+            else
+            {
+                disconnects++;
+            }
+            finish(c);
+            return;
+        }
+        if (n == -1)
+        {
+            return;
+        }
+
+        // only the end of what has arrived is kept, enough to find the
+        // text being waited for across reads.
+        for (ssize_t i = 0; i < n && c->step != STEP_DONE;)
+        {
+            ssize_t take = n - i;
+            if (take > REPLY_TAIL - 1 - c->taillen)
+            {
+                take = REPLY_TAIL - 1 - c->taillen;
+            }
+            memcpy(c->tail + c->taillen, buf + i, take);
+            c->taillen += take;
+            c->tail[c->taillen] = '\0';
+            i += take;
+
+            if (strstr(c->tail, "Good-bye") != NULL)
+            {
+                goodbyes++;
+                finish(c);
+                return;
+            }
+            char *found = c->until != NULL ? strstr(c->tail, c->until) : NULL;
+            if (found != NULL)
+            {
+                char *rest = found + strlen(c->until);
+                c->taillen = strlen(rest);
+                memmove(c->tail, rest, c->taillen + 1);
+                if (!advance(c))
+                {
+                    disconnects++;
+                    finish(c);
+                    return;
+                }
+            }
+            else if (c->taillen == REPLY_TAIL - 1)
+            {
+                int keep = REPLY_TAIL / 2;
+                memmove(c->tail, c->tail + c->taillen - keep, keep + 1);
+                c->taillen = keep;
+            }
+        }
+    }
+}
+
+int open_conn(Conn *c, struct sockaddr_in *addr, int epoll_fd)
+{
+    c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (c->fd == -1)
+    {
+        perror("socket");
+        return -1;
+    }
+    int on = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+    c->step = STEP_GREETING;
+    c->until = "name?\r\n";
+    c->started = now_us();
+    if (connect(c->fd, (struct sockaddr *)addr, sizeof(*addr)) == -1 && errno != EINPROGRESS)
+    {
+        perror("connect");
+        close(c->fd);
+        return -1;
+    }
+
+    // a connection that fails is reported as readable, and its
+    // error picked up by the next read.
+    struct epoll_event ev = {.events = EPOLLIN | EPOLLRDHUP, .data.ptr = c};
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, c->fd, &ev) == -1)
+    {
+        perror("epoll_ctl");
+        close(c->fd);
+        return -1;
+    }
+    open_conns++;
+    return 0;
+}
+
+// Raises the limit on open files as far as it goes, as every connection
+// takes one, or two with the server in process.
+void raise_file_limit()
+{
+    struct rlimit lim;
+    if (getrlimit(RLIMIT_NOFILE, &lim) == 0 && lim.rlim_cur < lim.rlim_max)
+    {
+        lim.rlim_cur = lim.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &lim);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    const char *host = "127.0.0.1";
+    int port = PORT;
+    int nstudents = 1000;
+    int ntas = 10;
+    int nstats = 3;
+    int timeout_s = 60;
+    long server_threads = 0;
+    int ch;
+
+    while ((ch = getopt(argc, argv, "h:p:s:t:c:T:l:")) != -1)
+    {
+        switch (ch)
+        {
+        case 'h':
+            host = optarg;
+            break;
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 's':
+            nstudents = atoi(optarg);
+            break;
+        case 't':
+            ntas = atoi(optarg);
+            break;
+        case 'c':
+            nstats = atoi(optarg);
+            break;
+        case 'T':
+            timeout_s = atoi(optarg);
+            break;
+        case 'l':
+            server_threads = atol(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: hcqload [-h HOST] [-p PORT] [-s STUDENTS] [-t TAS] "
+                            "[-c STATS_PER_CLIENT] [-T TIMEOUT_SECONDS] [-l SERVER_THREADS]\n");
+            exit(1);
+        }
+    }
+    if (nstudents < 0 || ntas <= 0 || nstats < 0 || timeout_s <= 0)
+    {
+        fprintf(stderr, "hcqload: there must be a TA, and counts can not be negative\n");
+        exit(1);
+    }
+    raise_file_limit();
+
+    // the report goes to the real standard output, and the log of a
+    // server in this process nowhere.
+    FILE *out = stdout;
+    if (server_threads > 0)
+    {
+        fflush(stdout);
+        int null_fd = open("/dev/null", O_WRONLY);
+        if ((out = fdopen(dup(STDOUT_FILENO), "w")) == NULL || null_fd == -1 ||
+            dup2(null_fd, STDOUT_FILENO) == -1)
+        {
+            perror("hcqload: redirecting server log");
+            exit(1);
+        }
+        close(null_fd);
+        host = "127.0.0.1";
+        port = start_server(0, server_threads, NULL);
+    }
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, host, &addr.sin_addr) != 1)
+    {
+        fprintf(stderr, "hcqload: %s is not an IPv4 address\n", host);
+        exit(1);
+    }
+
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd == -1)
+    {
+        perror("epoll_create1");
+        exit(1);
+    }
+
+    // TAs connect first, so that they are in place for the students.
+    int nconns = ntas + nstudents;
+    Conn *conns = pacalloc(nconns, sizeof(Conn));
+    students_joining = students_waiting = nstudents;
+    long long started = now_us();
+    for (int i = 0; i < nconns; i++)
+    {
+        Conn *c = &conns[i];
+        c->ta = i < ntas;
+        c->id = c->ta ? i : i - ntas;
+        c->stats_left = nstats;
+        c->joining = c->waiting = !c->ta;
+        if (open_conn(c, &addr, epoll_fd) == -1)
+        {
+            connect_errors++;
+            c->joining = c->waiting = false;
+            students_joining--;
+            students_waiting--;
+            c->step = STEP_DONE;
+        }
+    }
+    long long opened = now_us();
+
+    long long deadline = started + timeout_s * 1000000LL;
+    struct epoll_event events[MAX_EVENTS];
+    while (open_conns > 0 && now_us() < deadline)
+    {
+        int nready = epoll_wait(epoll_fd, events, MAX_EVENTS, 100);
+        if (nready == -1 && errno != EINTR)
+        {
+            perror("epoll_wait");
+            exit(1);
+        }
+        for (int i = 0; i < nready; i++)
+        {
+            on_readable(events[i].data.ptr);
+        }
+
+        // TAs left idle while the students joined are set going once
+        // they have, or sent away once every student is served.
+        if (students_joining == 0)
+        {
+            for (int i = 0; i < ntas; i++)
+            {
+                Conn *c = &conns[i];
+                if (c->step == STEP_REPLY && c->until == NULL && !ta_continue(c))
+                {
+                    disconnects++;
+                    finish(c);
+                }
+            }
+        }
+    }
+    long long elapsed = now_us() - started;
+
+    int timed_out = 0;
+    for (int i = 0; i < nconns; i++)
+    {
+        if (conns[i].step != STEP_DONE)
+        {
+            timed_out++;
+            finish(&conns[i]);
+        }
+    }
+
+    fprintf(out, "students=%d\n", nstudents);
+    fprintf(out, "tas=%d\n", ntas);
+    fprintf(out, "open_us=%lld\n", opened - started);
+    fprintf(out, "elapsed_us=%lld\n", elapsed);
+    fprintf(out, "commands=%lld\n", commands);
+    fprintf(out, "commands_per_s=%.0f\n", elapsed > 0 ? commands * 1e6 / elapsed : 0.0);
+    fprintf(out, "served=%lld\n", served);
+    for (int k = 0; k < T_KINDS; k++)
+    {
+        report_timings(out, k);
+    }
+    fprintf(out, "errors.connect=%lld\n", connect_errors);
+    fprintf(out, "errors.disconnect=%lld\n", disconnects);
+    fprintf(out, "errors.goodbye=%lld\n", goodbyes);
+    fprintf(out, "errors.timeout=%d\n", timed_out);
+    fflush(out);
+
+    // a run in which the server dropped anyone, or did not serve every
+    // student, fails, so that it can gate CI.
+    return connect_errors + disconnects + goodbyes + timed_out > 0 || served != nstudents;
+}
@@ -0,0 +1,714 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "panic.h"
+
+/**
+ * Tests of hcq_server, run against a server started in a child process
+ * on a free port, with its log discarded and its journal in a directory
+ * of its own.
+ *
+ * Every test speaks the help centre protocol over real sockets: lines
+ * pipelined in a single write or split across writes, a client that
+ * shuts down its side straight after its last line, a TA taking
+ * students course by course, clients that connect and drop in bulk
+ * while others wait in the queue, and the queue surviving the server
+ * being killed, put back from the journal whether it was compacted or
+ * not.
+ *
+ * Each test is reported on standard output; the exit status is the
+ * number of tests that failed.
+ */
+
+// the most a reply is waited for before a test gives up on it.
+#define REPLY_TIMEOUT_MS 3000
+
+// clients opened by the connect and drop test, in each of two waves.
+#define CHURN_CLIENTS 150
+
+// students joining and leaving in the compaction test. hcqtest is built
+// with a journal compacting after 16 records, so this compacts it
+// several times over.
+#define COMPACT_CHANGES 40
+
+// the most students a journal read by the tests puts back in the queue.
+#define JOURNAL_MAX_WAITING 64
+
+int start_server(int port, long nthreads, const char *journal_path);
+
+// the server under test: its process, the port it listens on and the
+// journal it keeps the queue in.
+static pid_t server_pid;
+static int port;
+static const char *journal;
+
+// the number of checks that failed in the current test.
+static int failed;
+
+#define CHECK(cond, ...)                                \
+    do                                                  \
+    {                                                   \
+        if (!(cond))                                    \
+        {                                               \
+            printf("    %s:%d: ", __FILE__, __LINE__);  \
+            printf(__VA_ARGS__);                        \
+            printf("\n");                               \
+            failed++;                                   \
+        }                                               \
+    } while (0)
+
+/**
+ * Starts the server under test in a child process, on the journal, and
+ * waits until it is listening. The server logs every connection; its
+ * log is discarded.
+ */
+void server_start()
+{
+    int ready[2];
+    if (pipe(ready) == -1 || (server_pid = fork()) == -1)
+    {
+        perror("hcqtest: starting server");
+        exit(1);
+    }
+    if (server_pid == 0)
+    {
+        int null_fd = open("/dev/null", O_WRONLY);
+        if (null_fd == -1 || dup2(null_fd, STDOUT_FILENO) == -1)
+        {
+            perror("hcqtest: redirecting server log");
+            exit(1);
+        }
+        close(ready[0]);
+        int bound = start_server(0, 2, journal);
+        if (write(ready[1], &bound, sizeof(bound)) != sizeof(bound))
+        {
+            exit(1);
+        }
+        close(ready[1]);
+        // the reactor threads serve until the server is killed.
+        while (1)
+        {
+            pause();
+        }
+    }
+
+    close(ready[1]);
+    if (read(ready[0], &port, sizeof(port)) != sizeof(port))
+    {
+        fprintf(stderr, "hcqtest: server did not start\n");
+        exit(1);
+    }
+    close(ready[0]);
+}
+
+/**
+ * Kills the server under test, as a crash would.
+ */
+void server_kill()
+{
+    kill(server_pid, SIGKILL);
+    waitpid(server_pid, NULL, 0);
+}
+
+/**
+ * Connects to the server under test, exiting if it can not.
+ */
+int connect_server()
+{
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons(port)};
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+    {
+        perror("hcqtest: connect");
+        exit(1);
+    }
+    return fd;
+}
+
+/**
+ * Sends the whole string, exiting if it can not.
+ */
+void send_str(int fd, const char *s)
+{
+    size_t len = strlen(s);
+    while (len > 0)
+    {
+        ssize_t n = send(fd, s, len, MSG_NOSIGNAL);
+        if (n == -1)
+        {
+            perror("hcqtest: send");
+            exit(1);
+        }
+        s += n;
+        len -= n;
+    }
+}
+
+/**
+ * Reads from fd until what was read contains the needle, the server
+ * closes the connection, or the reply times out. A NULL needle reads
+ * until the connection is closed. Returns everything read, which must be
+ * freed, and sets closed if the connection was closed.
+ */
+char *read_until(int fd, const char *needle, bool *closed)
+{
+    size_t cap = 4096;
+    size_t len = 0;
+    char *buf = pamalloc(cap);
+    buf[0] = '\0';
+    *closed = false;
+
+    while (needle == NULL || strstr(buf, needle) == NULL)
+    {
+        struct pollfd pfd = {.fd = fd, .events = POLLIN};
+        if (poll(&pfd, 1, REPLY_TIMEOUT_MS) <= 0)
+        {
+            break;
+        }
+        if (len + 1 == cap)
+        {
+            cap *= 2;
+            buf = parealloc(buf, cap);
+        }
+        ssize_t n = recv(fd, buf + len, cap - len - 1, 0);
+        if (n <= 0)
+        {
+            *closed = true;
+            break;
+        }
+        len += n;
+        buf[len] = '\0';
+    }
+    return buf;
+}
+
+/**
+ * Sends the commands of a client that is already prompted for commands,
+ * followed by a line the server rejects, and returns the replies up to
+ * the rejection, which marks their end.
+ */
+char *command(int fd, const char *commands)
+{
+    bool closed;
+    send_str(fd, commands);
+    send_str(fd, "-\r\n");
+    return read_until(fd, "Incorrect syntax", &closed);
+}
+
+/**
+ * Connects a TA with the given name, and returns its socket once it is
+ * prompted for commands.
+ */
+int connect_ta(const char *name)
+{
+    char *login;
+    bool closed;
+    int fd = connect_server();
+    paasprintf(&login, "%s\r\nT\r\n", name);
+    send_str(fd, login);
+    free(login);
+    free(read_until(fd, "Valid commands for TA", &closed));
+    return fd;
+}
+
+/**
+ * Returns the number of students in the full queue listed by the TA,
+ * retrying for a while until it is the expected number, since the
+ * server notices clients closing in its own time.
+ */
+int queue_length(int ta, int expected)
+{
+    int n = -1;
+    for (int tries = 0; tries < 50 && n != expected; tries++)
+    {
+        if (tries > 0)
+        {
+            usleep(20000);
+        }
+        char *reply = command(ta, "stats\r\n");
+        n = 0;
+        for (char *s = strstr(reply, "Student "); s != NULL; s = strstr(s + 1, "Student "))
+        {
+            n++;
+        }
+        free(reply);
+    }
+    return n;
+}
+
+/**
+ * Returns the names of the students the journal puts back in the queue,
+ * in queue order, each followed by a space, replaying its records as the
+ * server does, and sets lines to the number of records in it. The
+ * result must be freed.
+ */
+char *journal_queue(int *lines)
+{
+    char *names[JOURNAL_MAX_WAITING];
+    int waiting = 0;
+    char line[256];
+    *lines = 0;
+
+    FILE *f = fopen(journal, "r");
+    while (f != NULL && fgets(line, sizeof(line), f) != NULL)
+    {
+        char *name;
+        (*lines)++;
+        line[strcspn(line, "\n")] = '\0';
+        if (line[0] == 'J' && (name = strchr(line + 2, ' ')) != NULL && waiting < JOURNAL_MAX_WAITING)
+        {
+            names[waiting++] = strdup(name + 1);
+        }
+        else if (line[0] == 'L')
+        {
+            for (int i = 0; i < waiting; i++)
+            {
+                if (strcmp(names[i], line + 2) == 0)
+                {
+                    free(names[i]);
+                    memmove(names + i, names + i + 1, (waiting - i - 1) * sizeof(char *));
+                    waiting--;
+                    break;
+                }
+            }
+        }
+    }
+    if (f != NULL)
+    {
+        fclose(f);
+    }
+
+    char *queue = strdup("");
+    for (int i = 0; i < waiting; i++)
+    {
+        char *longer;
+        paasprintf(&longer, "%s%s ", queue, names[i]);
+        free(queue);
+        free(names[i]);
+        queue = longer;
+    }
+    return queue;
+}
+
+/**
+ * Waits for a while until the journal puts back the expected queue,
+ * given as journal_queue returns it, since changes are acknowledged
+ * before they are synced. Returns whether it did, and sets lines as
+ * journal_queue does.
+ */
+bool journal_holds(const char *expected, int *lines)
+{
+    bool holds = false;
+    for (int tries = 0; tries < 50 && !holds; tries++)
+    {
+        if (tries > 0)
+        {
+            usleep(20000);
+        }
+        char *queue = journal_queue(lines);
+        holds = strcmp(queue, expected) == 0;
+        free(queue);
+    }
+    return holds;
+}
+
+// A client sending every line of its conversation in a single write is
+// answered line by line, as if it had typed them one at a time.
+void test_pipelined()
+{
+    bool closed;
+    int stu = connect_server();
+    send_str(stu, "pipelined\r\nS\r\nCSC108\r\nstats\r\n");
+    char *reply = read_until(stu, "currently working", &closed);
+    CHECK(strstr(reply, "what is your name?") != NULL, "no name prompt");
+    CHECK(strstr(reply, "TA or a Student") != NULL, "no role prompt");
+    CHECK(strstr(reply, "entered into the queue") != NULL, "student not queued: %s", reply);
+    CHECK(strstr(reply, "No TAs are currently working.") != NULL, "no stats reply: %s", reply);
+    free(reply);
+
+    int ta = connect_server();
+    send_str(ta, "tina\r\nT\r\nstats\r\nnext\r\n-\r\n");
+    reply = read_until(ta, "Incorrect syntax", &closed);
+    CHECK(strstr(reply, "Student pipelined:CSC108") != NULL, "student not listed: %s", reply);
+    free(reply);
+
+    reply = read_until(stu, NULL, &closed);
+    CHECK(strstr(reply, "Your turn to see the TA.") != NULL, "student not sent off: %s", reply);
+    CHECK(closed, "student not disconnected");
+    free(reply);
+
+    close(stu);
+    close(ta);
+}
+
+// A line split across writes, even between its \r and \n, is read whole.
+void test_split_line()
+{
+    bool closed;
+    int fd = connect_server();
+    free(read_until(fd, "what is your name?", &closed));
+    for (const char *c = "slowpoke\r"; *c != '\0'; c++)
+    {
+        char byte[2] = {*c, '\0'};
+        send_str(fd, byte);
+        usleep(5000);
+    }
+    usleep(50000);
+    send_str(fd, "\n");
+    char *reply = read_until(fd, "TA or a Student", &closed);
+    CHECK(strstr(reply, "TA or a Student") != NULL, "split line not read: %s", reply);
+    CHECK(!closed, "client disconnected");
+    free(reply);
+    close(fd);
+}
+
+// A client that shuts down its side straight after its last line is
+// served every line it sent, then closed, leaving the queue.
+void test_half_close()
+{
+    bool closed;
+    int fd = connect_server();
+    send_str(fd, "halfclose\r\nS\r\nCSC148\r\nstats\r\n");
+    shutdown(fd, SHUT_WR);
+    char *reply = read_until(fd, NULL, &closed);
+    CHECK(closed, "half-closed client never disconnected");
+    CHECK(strstr(reply, "entered into the queue") != NULL, "student not queued: %s", reply);
+    CHECK(strstr(reply, "No TAs are currently working.") != NULL ||
+              strstr(reply, "TA: ") != NULL,
+          "stats not answered: %s", reply);
+    free(reply);
+    close(fd);
+
+    int ta = connect_ta("hal");
+    CHECK(queue_length(ta, 0) == 0, "half-closed student still queued");
+    close(ta);
+}
+
+/**
+ * Connects a student with the given name, and returns its socket once
+ * it is queued for the course.
+ */
+int connect_student(const char *name, const char *course)
+{
+    char *login;
+    bool closed;
+    int fd = connect_server();
+    paasprintf(&login, "%s\r\nS\r\n%s\r\n", name, course);
+    send_str(fd, login);
+    free(login);
+    free(read_until(fd, "entered into the queue", &closed));
+    return fd;
+}
+
+// next <course> takes the student who has waited longest for that
+// course, passing over those waiting for others, and turns down a
+// course that does not exist without taking anyone.
+void test_next_course()
+{
+    bool closed;
+    int first = connect_student("first108", "CSC108");
+    int other = connect_student("only209", "CSC209");
+    int second = connect_student("second108", "CSC108");
+    int ta = connect_ta("coursework");
+
+    char *reply = command(ta, "next CSC999\r\n");
+    CHECK(strstr(reply, "This is not a valid course.") != NULL, "invalid course taken: %s", reply);
+    free(reply);
+    CHECK(queue_length(ta, 3) == 3, "a student was taken for an invalid course");
+
+    free(command(ta, "next CSC108\r\n"));
+    reply = read_until(first, NULL, &closed);
+    CHECK(strstr(reply, "Your turn to see the TA.") != NULL, "first student not taken: %s", reply);
+    free(reply);
+
+    reply = command(ta, "stats\r\n");
+    CHECK(strstr(reply, "Student first108:") == NULL, "first student still queued: %s", reply);
+    CHECK(strstr(reply, "Student second108:CSC108") != NULL, "second student not queued: %s", reply);
+    CHECK(strstr(reply, "Student only209:CSC209") != NULL, "other course's student taken: %s", reply);
+    free(reply);
+
+    free(command(ta, "next CSC108\r\n"));
+    reply = read_until(second, NULL, &closed);
+    CHECK(strstr(reply, "Your turn to see the TA.") != NULL, "second student not taken: %s", reply);
+    free(reply);
+
+    free(command(ta, "next CSC209\r\n"));
+    reply = read_until(other, NULL, &closed);
+    CHECK(strstr(reply, "Your turn to see the TA.") != NULL, "other course's student not taken: %s", reply);
+    free(reply);
+    CHECK(queue_length(ta, 0) == 0, "queue not empty once every student was taken");
+
+    close(first);
+    close(second);
+    close(other);
+    close(ta);
+}
+
+// A line longer than the server takes disconnects the client with a
+// parting message.
+void test_overlong_line()
+{
+    bool closed;
+    int fd = connect_server();
+    char line[601];
+    memset(line, 'x', 600);
+    line[600] = '\0';
+    send_str(fd, line);
+    char *reply = read_until(fd, NULL, &closed);
+    CHECK(strstr(reply, "Line too long. Good-bye.") != NULL, "no parting message: %s", reply);
+    CHECK(closed, "client not disconnected");
+    free(reply);
+    close(fd);
+}
+
+// A name holding a newline, which would split the student's journal
+// record in two, disconnects the client before it can queue.
+void test_control_name()
+{
+    bool closed;
+    int fd = connect_server();
+    send_str(fd, "bad\nname\r\nS\r\nCSC108\r\n");
+    char *reply = read_until(fd, NULL, &closed);
+    CHECK(strstr(reply, "Names can not hold control characters. Good-bye.") != NULL,
+          "no parting message: %s", reply);
+    CHECK(strstr(reply, "entered into the queue") == NULL, "student queued: %s", reply);
+    CHECK(closed, "client not disconnected");
+    free(reply);
+    close(fd);
+
+    int ta = connect_ta("ctl");
+    CHECK(queue_length(ta, 0) == 0, "student with a control character queued");
+    close(ta);
+}
+
+// Clients connecting and dropping in bulk, some of them while waiting
+// in the queue, leave the server serving, and the queue holding exactly
+// the students still connected.
+void test_churn()
+{
+    int ta = connect_ta("churner");
+    int fds[2 * CHURN_CLIENTS];
+    bool queued[2 * CHURN_CLIENTS];
+    char *line;
+
+    // the first wave half joins the queue, half stops at the name.
+    srand(1);
+    for (int i = 0; i < CHURN_CLIENTS; i++)
+    {
+        fds[i] = connect_server();
+        queued[i] = i % 2 == 0;
+        paasprintf(&line, queued[i] ? "churn%d\r\nS\r\nCSC209\r\n" : "churn%d\r\n", i);
+        send_str(fds[i], line);
+        free(line);
+    }
+    CHECK(queue_length(ta, CHURN_CLIENTS / 2) == CHURN_CLIENTS / 2, "first wave not queued");
+
+    // most of them drop, in no particular order, while a second wave
+    // connects; some of those reset their connection.
+    int left = CHURN_CLIENTS / 2;
+    for (int i = 0; i < CHURN_CLIENTS; i++)
+    {
+        if (rand() % 10 < 7)
+        {
+            close(fds[i]);
+            fds[i] = -1;
+            left -= queued[i];
+        }
+        int j = CHURN_CLIENTS + i;
+        fds[j] = connect_server();
+        queued[j] = false;
+        if (i % 3 == 0)
+        {
+            struct linger reset = {.l_onoff = 1, .l_linger = 0};
+            setsockopt(fds[j], SOL_SOCKET, SO_LINGER, &reset, sizeof(reset));
+            close(fds[j]);
+            fds[j] = -1;
+        }
+    }
+    CHECK(queue_length(ta, left) == left, "queue does not hold the %d students left", left);
+
+    for (int i = 0; i < 2 * CHURN_CLIENTS; i++)
+    {
+        if (fds[i] != -1)
+        {
+            close(fds[i]);
+        }
+    }
+    CHECK(queue_length(ta, 0) == 0, "queue not empty once every student dropped");
+
+    // the server still serves newcomers from start to finish.
+    bool closed;
+    int stu = connect_server();
+    send_str(stu, "latecomer\r\nS\r\nCSC209\r\n");
+    free(read_until(stu, "entered into the queue", &closed));
+    free(command(ta, "next\r\n"));
+    char *reply = read_until(stu, NULL, &closed);
+    CHECK(strstr(reply, "Your turn to see the TA.") != NULL, "latecomer not served: %s", reply);
+    free(reply);
+    close(stu);
+    close(ta);
+}
+
+// Once the journal holds the queue, killing the server loses none of
+// it: the restarted server puts back the students still waiting, in
+// order, and not the one who left. A student put back takes their place
+// back by giving the same name.
+void test_replay()
+{
+    bool closed;
+    int lines;
+    int keep1 = connect_student("keep1", "CSC148");
+    int gone = connect_student("gone", "CSC108");
+    int keep2 = connect_student("keep2", "CSC209");
+    close(gone);
+    CHECK(journal_holds("keep1 keep2 ", &lines), "journal does not hold the queue");
+
+    server_kill();
+    close(keep1);
+    close(keep2);
+    server_start();
+
+    int ta = connect_ta("replayer");
+    CHECK(queue_length(ta, 2) == 2, "queue not put back");
+    char *reply = command(ta, "stats\r\n");
+    char *first = strstr(reply, "Student keep1:CSC148");
+    char *second = strstr(reply, "Student keep2:CSC209");
+    CHECK(first != NULL && second != NULL && first < second, "queue not put back in order: %s", reply);
+    CHECK(strstr(reply, "Student gone:") == NULL, "student who left put back: %s", reply);
+    free(reply);
+
+    keep1 = connect_server();
+    send_str(keep1, "keep1\r\nS\r\n");
+    reply = read_until(keep1, "Welcome back.", &closed);
+    CHECK(strstr(reply, "kept your place in the queue for CSC148") != NULL, "place not reclaimed: %s", reply);
+    CHECK(strstr(reply, "Which course") == NULL, "reclaiming student asked for a course: %s", reply);
+    free(reply);
+
+    free(command(ta, "next\r\n"));
+    reply = read_until(keep1, NULL, &closed);
+    CHECK(strstr(reply, "Your turn to see the TA.") != NULL, "reclaimed place not first: %s", reply);
+    free(reply);
+
+    keep2 = connect_server();
+    send_str(keep2, "keep2\r\nS\r\n");
+    free(read_until(keep2, "Welcome back.", &closed));
+    free(command(ta, "next\r\n"));
+    free(read_until(keep2, NULL, &closed));
+    CHECK(queue_length(ta, 0) == 0, "queue not empty once every student was taken");
+
+    close(keep1);
+    close(keep2);
+    close(ta);
+}
+
+// Students joining and leaving many times over compact the journal down
+// to the queue, and the compacted journal puts the queue back after a
+// kill like any other.
+void test_compaction()
+{
+    int lines;
+    int stay[3];
+    char *name;
+    stay[0] = connect_student("stay0", "CSC108");
+    stay[1] = connect_student("stay1", "CSC148");
+    stay[2] = connect_student("stay2", "CSC209");
+    int ta = connect_ta("compactor");
+    for (int i = 0; i < COMPACT_CHANGES; i++)
+    {
+        paasprintf(&name, "passing%d", i);
+        close(connect_student(name, "CSC108"));
+        free(name);
+        CHECK(queue_length(ta, 3) == 3, "passing student %d still queued", i);
+    }
+    close(ta);
+
+    CHECK(journal_holds("stay0 stay1 stay2 ", &lines), "journal does not hold the queue");
+    CHECK(lines < COMPACT_CHANGES, "journal of %d records not compacted", lines);
+    char *tmp_path;
+    paasprintf(&tmp_path, "%s.tmp", journal);
+    CHECK(access(tmp_path, F_OK) == -1, "compacted journal left behind at %s", tmp_path);
+    free(tmp_path);
+
+    server_kill();
+    for (int i = 0; i < 3; i++)
+    {
+        close(stay[i]);
+    }
+    server_start();
+
+    ta = connect_ta("compacted");
+    CHECK(queue_length(ta, 3) == 3, "queue not put back from the compacted journal");
+    char *reply = command(ta, "stats\r\n");
+    char *s0 = strstr(reply, "Student stay0:CSC108");
+    char *s1 = strstr(reply, "Student stay1:CSC148");
+    char *s2 = strstr(reply, "Student stay2:CSC209");
+    CHECK(s0 != NULL && s1 != NULL && s2 != NULL && s0 < s1 && s1 < s2,
+          "queue not put back in order: %s", reply);
+    free(reply);
+    close(ta);
+}
+
+typedef struct
+{
+    const char *name;
+    void (*run)();
+} Test;
+
+int main(int argc, char **argv)
+{
+    Test tests[] = {
+        {"pipelined", test_pipelined},
+        {"split_line", test_split_line},
+        {"half_close", test_half_close},
+        {"overlong_line", test_overlong_line},
+        {"control_name", test_control_name},
+        {"next_course", test_next_course},
+        {"churn", test_churn},
+        {"replay", test_replay},
+        {"compaction", test_compaction},
+    };
+
+    char dir[] = "/tmp/hcqtest.XXXXXX";
+    char *path;
+    if (mkdtemp(dir) == NULL)
+    {
+        perror("hcqtest: mkdtemp");
+        exit(1);
+    }
+    paasprintf(&path, "%s/hcq.journal", dir);
+    journal = path;
+
+    // nothing is left buffered for the server's process to inherit.
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    server_start();
+
+    int nfailed = 0;
+    for (size_t i = 0; i < sizeof(tests) / sizeof(tests[0]); i++)
+    {
+        failed = 0;
+        tests[i].run();
+        printf("%s %s\n", failed ? "FAIL" : "ok  ", tests[i].name);
+        nfailed += failed > 0;
+    }
+
+    server_kill();
+    unlink(path);
+    free(path);
+    rmdir(dir);
+    return nfailed;
+}
@@ -0,0 +1,308 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "journal.h"
+#include "panic.h"
+
+// The fewest records appended since the last snapshot before the
+// journal is compacted again. It is compacted no sooner than once it
+// holds twice as many records as the last snapshot did, so compacting
+// costs a constant amount of work per record. The tests lower it, so
+// that a few dozen changes are enough to compact.
+#ifndef COMPACT_MIN_RECORDS
+#define COMPACT_MIN_RECORDS 4096
+#endif
+
+/**
+ * Struct definition for opaque type Journal.
+ *
+ * See journal.h for Journal typedef
+ */
+typedef struct journal_s
+{
+    char *path;
+    char *tmp_path;
+
+    // the journal file, appended to by the flushing thread only.
+    int fd;
+
+    // everything below is guarded by the lock. ready is signalled
+    // whenever there is something to flush.
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+
+    // records handed over but not yet written, and a cleared buffer to
+    // swap in for them while they are written.
+    DynamicString *pending;
+    DynamicString *spare;
+
+    // a snapshot not yet written, and how much of pending it replaces.
+    DynamicString *snapshot;
+    ssize_t snapshot_at;
+
+    // records handed over since the last snapshot, and the number of
+    // records in the last snapshot.
+    long records;
+    long snapshot_records;
+} journal_s;
+
+/**
+ * Writes all n bytes of buf to fd, retrying partial writes.
+ * Returns 0, or -1 if the write fails.
+ */
+static int write_all(int fd, const char *buf, size_t n)
+{
+    while (n > 0)
+    {
+        ssize_t written = write(fd, buf, n);
+        if (written == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        buf += written;
+        n -= written;
+    }
+    return 0;
+}
+
+/**
+ * Reads the whole file at path into a null-terminated buffer, storing
+ * its length in len. Returns NULL if there is no such file, and exits
+ * if it can not be read.
+ */
+static char *read_file(const char *path, size_t *len)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        if (errno == ENOENT)
+        {
+            return NULL;
+        }
+        perror(path);
+        exit(1);
+    }
+
+    size_t cap = 4096;
+    char *buf = pamalloc(cap);
+    *len = 0;
+    while (1)
+    {
+        if (*len + 1 == cap)
+        {
+            cap *= 2;
+            buf = parealloc(buf, cap);
+        }
+        ssize_t n = read(fd, buf + *len, cap - *len - 1);
+        if (n == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n == -1)
+        {
+            perror(path);
+            exit(1);
+        }
+        if (n == 0)
+        {
+            break;
+        }
+        *len += n;
+    }
+    close(fd);
+    buf[*len] = '\0';
+    return buf;
+}
+
+/**
+ * Syncs the directory holding path, so that a file just renamed
+ * to path stays renamed.
+ */
+static void sync_parent(const char *path)
+{
+    char *copy = strdup(path);
+    int fd = open(dirname(copy), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1 || fsync(fd) == -1)
+    {
+        perror("journal: syncing directory");
+    }
+    if (fd != -1)
+    {
+        close(fd);
+    }
+    free(copy);
+}
+
+/**
+ * Writes the snapshot, followed by the records of batch handed over
+ * after it, to a new journal, and puts it in place of the old one.
+ * Returns 0, or -1 if it could not be, in which case the old journal
+ * is left as it was.
+ */
+static int compact(Journal *j, DynamicString *snapshot, DynamicString *batch, ssize_t snapshot_at)
+{
+    int fd = open(j->tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0600);
+    if (fd == -1)
+    {
+        perror(j->tmp_path);
+        return -1;
+    }
+    if (write_all(fd, ds_cstr(snapshot), ds_len(snapshot) - 1) == -1 ||
+        write_all(fd, ds_cstr(batch) + snapshot_at, ds_len(batch) - 1 - snapshot_at) == -1 ||
+        fdatasync(fd) == -1 || rename(j->tmp_path, j->path) == -1)
+    {
+        perror(j->tmp_path);
+        close(fd);
+        unlink(j->tmp_path);
+        return -1;
+    }
+    sync_parent(j->path);
+
+    // the compacted journal is the journal from now on.
+    close(j->fd);
+    j->fd = fd;
+    return 0;
+}
+
+/**
+ * Body of the thread writing and syncing whatever has been handed over
+ * since the last time it did, forever.
+ */
+static void *flush_journal(void *arg)
+{
+    Journal *j = arg;
+    pthread_mutex_lock(&j->lock);
+    while (1)
+    {
+        while (ds_len(j->pending) == 1 && j->snapshot == NULL)
+        {
+            pthread_cond_wait(&j->ready, &j->lock);
+        }
+
+        // records handed over from now on wait for the next flush.
+        DynamicString *batch = j->pending;
+        DynamicString *snapshot = j->snapshot;
+        ssize_t snapshot_at = j->snapshot_at;
+        j->pending = j->spare;
+        j->spare = NULL;
+        j->snapshot = NULL;
+        pthread_mutex_unlock(&j->lock);
+
+        if (snapshot == NULL || compact(j, snapshot, batch, snapshot_at) == -1)
+        {
+            if (write_all(j->fd, ds_cstr(batch), ds_len(batch) - 1) == -1 || fdatasync(j->fd) == -1)
+            {
+                perror(j->path);
+            }
+        }
+        if (snapshot != NULL)
+        {
+            ds_free(snapshot);
+        }
+
+        pthread_mutex_lock(&j->lock);
+        j->spare = ds_clear(batch);
+    }
+    return NULL;
+}
+
+Journal *journal_open(const char *path, JournalApply apply, void *data)
+{
+    Journal *j = pacalloc(1, sizeof(Journal));
+    j->path = strdup(path);
+    paasprintf(&j->tmp_path, "%s.tmp", path);
+
+    // replay every whole record; anything after the last newline is a
+    // record cut short, and is cut off.
+    size_t len;
+    size_t keep = 0;
+    char *log = read_file(path, &len);
+    if (log != NULL)
+    {
+        char *record = log;
+        char *end;
+        while ((end = memchr(record, '\n', len - (record - log))) != NULL)
+        {
+            *end = '\0';
+            apply(record, data);
+            j->records++;
+            record = end + 1;
+        }
+        keep = record - log;
+        free(log);
+    }
+
+    if ((j->fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600)) == -1 ||
+        ftruncate(j->fd, keep) == -1)
+    {
+        perror(path);
+        exit(1);
+    }
+
+    pthread_mutex_init(&j->lock, NULL);
+    pthread_cond_init(&j->ready, NULL);
+    j->pending = ds_new();
+    j->spare = ds_new();
+
+    pthread_t thread;
+    if ((errno = pthread_create(&thread, NULL, flush_journal, j)) != 0)
+    {
+        perror("journal: pthread_create");
+        exit(1);
+    }
+    pthread_detach(thread);
+    return j;
+}
+
+void journal_record(Journal *j, const char *record)
+{
+    pthread_mutex_lock(&j->lock);
+    ds_append(j->pending, record);
+    ds_append(j->pending, "\n");
+    j->records++;
+    pthread_cond_signal(&j->ready);
+    pthread_mutex_unlock(&j->lock);
+}
+
+bool journal_snapshot_due(Journal *j)
+{
+    pthread_mutex_lock(&j->lock);
+    bool due = j->records >= COMPACT_MIN_RECORDS && j->records >= 2 * j->snapshot_records;
+    pthread_mutex_unlock(&j->lock);
+    return due;
+}
+
+void journal_snapshot(Journal *j, DynamicString *records)
+{
+    long count = 0;
+    for (const char *c = ds_cstr(records); *c != '\0'; c++)
+    {
+        count += *c == '\n';
+    }
+
+    pthread_mutex_lock(&j->lock);
+    // a snapshot not yet written is replaced, along with everything
+    // before it.
+    if (j->snapshot != NULL)
+    {
+        ds_free(j->snapshot);
+    }
+    j->snapshot = records;
+    j->snapshot_at = ds_len(j->pending) - 1;
+    j->records = 0;
+    j->snapshot_records = count;
+    pthread_cond_signal(&j->ready);
+    pthread_mutex_unlock(&j->lock);
+}
@@ -0,0 +1,66 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+#include <stdbool.h>
+
+#include "dynstr.h"
+
+/**
+ * A Journal is an append-only log of records, each a single line of
+ * text, from which state kept in memory can be rebuilt after a restart.
+ *
+ * Records are buffered in memory, and written and synced to disk by a
+ * thread of the Journal's own. Every record handed over while a sync
+ * is under way is written by the next one, so a record is on disk at
+ * most two syncs after it was handed over, however many there are.
+ *
+ * So that the journal does not grow forever, it is compacted from time
+ * to time: a snapshot holding just enough records to rebuild the state
+ * as it is now replaces every record before it. The compacted journal
+ * is written next to the journal, with ".tmp" appended to its path, and
+ * renamed over it once synced, so a crash always leaves one whole
+ * journal, either the old one or the compacted one.
+ *
+ * The Journal does not order records itself: whoever records them must
+ * hand them over in the order they are to be replayed in, and must hand
+ * over a snapshot in order with the records.
+ */
+typedef struct journal_s Journal;
+
+/**
+ * A callback applying a replayed record, given without its newline,
+ * to the state being rebuilt. The data is the pointer given to
+ * journal_open along with the callback.
+ */
+typedef void (*JournalApply)(const char *record, void *data);
+
+/**
+ * Replays the journal at the given path, if there is one, in order
+ * through the callback, then opens it to append records to. A record
+ * cut short by a crash is dropped.
+ *
+ * Exits if the journal can not be opened.
+ */
+Journal *journal_open(const char *path, JournalApply apply, void *data);
+
+/**
+ * Hands a record over to be appended to the journal. The record must be
+ * a single line, given without its newline.
+ */
+void journal_record(Journal *j, const char *record);
+
+/**
+ * Returns whether enough records have been appended since the last
+ * snapshot that the journal should be compacted.
+ */
+bool journal_snapshot_due(Journal *j);
+
+/**
+ * Hands over a snapshot, taking ownership of the DynamicString: lines
+ * of records rebuilding the state as it is after every record handed
+ * over so far, each ending with a newline. The snapshot replaces those
+ * records on disk. If the compacted journal can not be written, the
+ * records are kept instead.
+ */
+void journal_snapshot(Journal *j, DynamicString *records);
+
+#endif
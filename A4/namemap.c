@@ -0,0 +1,142 @@
+#include <stdint.h>
+#include <string.h>
+#include "namemap.h"
+#include "panic.h"
+
+// The number of slots of a new, empty NameMap; always a power of two.
+#define NM_INITIAL_SLOTS 64
+
+typedef struct namemap_slot_s
+{
+    // NULL if the slot is free.
+    const char *name;
+    uint32_t hash;
+    void *value;
+} NameMapSlot;
+
+typedef struct namemap_s
+{
+    NameMapSlot *slots;
+    size_t nslots;
+    size_t count;
+} namemap_s;
+
+// FNV-1a hash of a null-terminated name.
+uint32_t nm_hash(const char *name)
+{
+    uint32_t hash = 2166136261u;
+    for (const unsigned char *p = (const unsigned char *)name; *p != '\0'; p++)
+    {
+        hash = (hash ^ *p) * 16777619u;
+    }
+    return hash;
+}
+
+NameMap *nm_new()
+{
+    NameMap *m = pamalloc(sizeof(NameMap));
+    m->slots = pacalloc(NM_INITIAL_SLOTS, sizeof(NameMapSlot));
+    m->nslots = NM_INITIAL_SLOTS;
+    m->count = 0;
+    return m;
+}
+
+// helper function returning the slot holding name, or the free slot
+// where it would go. Slots are probed linearly from the home slot.
+NameMapSlot *nm_find_slot(NameMap *m, const char *name, uint32_t hash)
+{
+    size_t mask = m->nslots - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask)
+    {
+        NameMapSlot *slot = &m->slots[i];
+        if (slot->name == NULL || (slot->hash == hash && strcmp(slot->name, name) == 0))
+        {
+            return slot;
+        }
+    }
+}
+
+// helper function doubling the number of slots, rehashing every name.
+void nm_grow(NameMap *m)
+{
+    NameMapSlot *old = m->slots;
+    size_t nold = m->nslots;
+
+    m->nslots *= 2;
+    m->slots = pacalloc(m->nslots, sizeof(NameMapSlot));
+    for (size_t i = 0; i < nold; i++)
+    {
+        if (old[i].name != NULL)
+        {
+            *nm_find_slot(m, old[i].name, old[i].hash) = old[i];
+        }
+    }
+    free(old);
+}
+
+void *nm_get(NameMap *m, const char *name)
+{
+    return nm_find_slot(m, name, nm_hash(name))->value;
+}
+
+NameMap *nm_put(NameMap *m, const char *name, void *value)
+{
+    // keep the map at most three quarters full, so probes stay short.
+    if ((m->count + 1) * 4 > m->nslots * 3)
+    {
+        nm_grow(m);
+    }
+
+    uint32_t hash = nm_hash(name);
+    NameMapSlot *slot = nm_find_slot(m, name, hash);
+    if (slot->name == NULL)
+    {
+        m->count++;
+    }
+    slot->name = name;
+    slot->hash = hash;
+    slot->value = value;
+    return m;
+}
+
+void *nm_remove(NameMap *m, const char *name)
+{
+    NameMapSlot *slot = nm_find_slot(m, name, nm_hash(name));
+    if (slot->name == NULL)
+    {
+        return NULL;
+    }
+    void *value = slot->value;
+
+    // shift later names of the same probe run back into the hole, so
+    // that no lookup ever stops short at it.
+    size_t mask = m->nslots - 1;
+    size_t hole = slot - m->slots;
+    for (size_t i = (hole + 1) & mask; m->slots[i].name != NULL; i = (i + 1) & mask)
+    {
+        size_t home = m->slots[i].hash & mask;
+
+        // the name at i can move to the hole only if its home slot is
+        // not between the hole and i, going around the end.
+        if (((i - home) & mask) >= ((i - hole) & mask))
+        {
+            m->slots[hole] = m->slots[i];
+            hole = i;
+        }
+    }
+    m->slots[hole].name = NULL;
+    m->slots[hole].value = NULL;
+    m->count--;
+    return value;
+}
+
+size_t nm_count(NameMap *m)
+{
+    return m->count;
+}
+
+void nm_free(NameMap *m)
+{
+    free(m->slots);
+    free(m);
+}
@@ -0,0 +1,49 @@
+#ifndef NAMEMAP_H
+#define NAMEMAP_H
+#include <stddef.h>
+
+/**
+ * A hash map from names to values, used to find students and TAs by
+ * name without walking the lists that keep them in order.
+ * 
+ * The map does not own its keys: a key must stay valid, and unchanged,
+ * for as long as it is in the map. Keying a value by a name the value
+ * itself owns (such as the name of a Student) satisfies this.
+ * 
+ * Lookups, insertions and removals all take expected constant time.
+ */
+typedef struct namemap_s NameMap;
+
+/**
+ * Creates a new, empty NameMap.
+ */
+NameMap *nm_new();
+
+/**
+ * Returns the value of the given name, or NULL if the name
+ * is not in the map.
+ */
+void *nm_get(NameMap *m, const char *name);
+
+/**
+ * Maps the given name to the given value, replacing the value
+ * the name had, if any. The map keeps a reference to the name.
+ */
+NameMap *nm_put(NameMap *m, const char *name, void *value);
+
+/**
+ * Removes the given name from the map, returning the value it
+ * had, or NULL if the name was not in the map.
+ */
+void *nm_remove(NameMap *m, const char *name);
+
+/**
+ * Returns the number of names in the map.
+ */
+size_t nm_count(NameMap *m);
+
+/**
+ * Frees the map, but not its keys or values.
+ */
+void nm_free(NameMap *m);
+#endif
@@ -0,0 +1,78 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+#include "namemap.h"
+#include "panic.h"
+
+/**
+ * Checks a NameMap against a plain array of flags through a long run of
+ * random puts, removes and gets over a fixed set of names, so that the
+ * map grows, shrinks and wraps its probes around many times over.
+ *
+ * Exits with a non-zero status at the first operation the map gets
+ * wrong.
+ */
+
+#define NAMES 5000
+#define OPERATIONS 2000000
+
+int main(int argc, char **argv)
+{
+    char *names[NAMES];
+    bool present[NAMES] = {false};
+    size_t count = 0;
+    NameMap *m = nm_new();
+
+    for (int i = 0; i < NAMES; i++)
+    {
+        paasprintf(&names[i], "name%d", i);
+    }
+
+    srand(argc > 1 ? atoi(argv[1]) : 7);
+    for (long op = 0; op < OPERATIONS; op++)
+    {
+        int k = rand() % NAMES;
+        void *value;
+        switch (rand() % 3)
+        {
+        case 0:
+            nm_put(m, names[k], names[k]);
+            count += !present[k];
+            present[k] = true;
+            break;
+        case 1:
+            value = nm_remove(m, names[k]);
+            if (value != (present[k] ? names[k] : NULL))
+            {
+                fprintf(stderr, "namemaptest: operation %ld: wrong removal of %s\n", op, names[k]);
+                return 1;
+            }
+            count -= present[k];
+            present[k] = false;
+            break;
+        default:
+            value = nm_get(m, names[k]);
+            if (value != (present[k] ? names[k] : NULL))
+            {
+                fprintf(stderr, "namemaptest: operation %ld: wrong value for %s\n", op, names[k]);
+                return 1;
+            }
+            break;
+        }
+
+        if (nm_count(m) != count)
+        {
+            fprintf(stderr, "namemaptest: operation %ld: count is %zu, not %zu\n", op, nm_count(m), count);
+            return 1;
+        }
+    }
+
+    nm_free(m);
+    for (int i = 0; i < NAMES; i++)
+    {
+        free(names[i]);
+    }
+    printf("ok   namemap (%d operations, %zu names left)\n", OPERATIONS, count);
+    return 0;
+}